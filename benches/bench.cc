@@ -0,0 +1,216 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "bench.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "include/capmap.h"
+
+using capmap::benches::Bench;
+using capmap::benches::BenchRun;
+using capmap::benches::Options;
+using capmap::benches::Result;
+
+namespace {
+
+// Record every capability that the mapper passes to its maps.
+class RecordingMap : public capmap::Map {
+ public:
+  virtual char const* name() const override { return "recording"; }
+  virtual char const* address_space() const override { return "virtual memory"; }
+  virtual capmap::RangeSet const& ranges() const override { return empty_.parts(); }
+  virtual bool try_combine(void* __capability cap) override {
+    caps_.push_back(cap);
+    return true;
+  }
+
+  std::vector<void* __capability> const& caps() const { return caps_; }
+
+ private:
+  capmap::SparseRange empty_;
+  std::vector<void* __capability> caps_;
+};
+
+}  // namespace
+
+uint64_t BenchRun::now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void BenchRun::scan(void* __capability root) {
+  {
+    capmap::Mapper mapper;
+    mapper.maps()->push_back(std::make_unique<capmap::LoadMap>());
+    uint64_t start = now_ns();
+    mapper.scan(root, "root");
+    result_.scan_ns += now_ns() - start;
+    result_.granules += mapper.stats().granules;
+    result_.tagged += mapper.stats().tagged;
+    result_.scan_load_ns += mapper.stats().load_ns;
+    result_.scan_map_ns += mapper.stats().map_ns;
+  }
+
+  capmap::Mapper recorder;
+  auto recording = std::make_unique<RecordingMap>();
+  auto const& caps = recording->caps();
+  recorder.maps()->push_back(std::move(recording));
+  recorder.scan(root, "root");
+  result_.caps += caps.size();
+
+  // The range algebra that a LoadMap does, without any loads.
+  {
+    uint64_t start = now_ns();
+    capmap::SparseRange ranges;
+    for (auto cap : caps) {
+      if (cheri_perms_get(cap) & CHERI_PERM_LOAD) ranges.combine(capmap::Range::from_cap(cap));
+    }
+    result_.range_ns += now_ns() - start;
+  }
+
+  // The loads that the scan does, without any range algebra. Each distinct
+  // region is loaded once; this slightly over-counts overlapping regions,
+  // which the scanner would only load once.
+  std::vector<void* __capability> loadable;
+  for (auto cap : caps) {
+    if (capmap::LoadCapMap::can_load_caps(cap)) loadable.push_back(cap);
+  }
+  auto by_bounds = [](void* __capability a, void* __capability b) {
+    if (cheri_base_get(a) != cheri_base_get(b)) return cheri_base_get(a) < cheri_base_get(b);
+    return cheri_length_get(a) < cheri_length_get(b);
+  };
+  auto same_bounds = [](void* __capability a, void* __capability b) {
+    return (cheri_base_get(a) == cheri_base_get(b)) && (cheri_length_get(a) == cheri_length_get(b));
+  };
+  std::sort(loadable.begin(), loadable.end(), by_bounds);
+  loadable.erase(std::unique(loadable.begin(), loadable.end(), same_bounds), loadable.end());
+  {
+    uint64_t start = now_ns();
+    uint64_t tagged = 0;
+    for (auto cap : loadable) {
+      size_t const granule = sizeof(void* __capability);
+      ptraddr_t base = (cheri_base_get(cap) + granule - 1) & ~(granule - 1);
+      ptraddr_t top = cheri_base_get(cap) + cheri_length_get(cap);
+      for (ptraddr_t addr = base; addr + granule <= top; addr += granule) {
+        auto ptr = static_cast<void* __capability volatile const* __capability>(
+            cheri_address_set(cap, addr));
+        tagged += cheri_tag_get(*ptr);
+        result_.replay_granules++;
+      }
+    }
+    result_.load_ns += now_ns() - start;
+    if (options().verbose()) {
+      fprintf(stderr, "  %zu regions, %" PRIu64 " tagged\n", loadable.size(), tagged);
+    }
+  }
+}
+
+std::vector<Bench*>& Bench::list() {
+  static std::vector<Bench*> singleton;
+  return singleton;
+}
+
+bool Options::parse_arg(char const* arg) {
+  if (strncmp(arg, "--repeat=", 9) == 0) {
+    repeat_ = atoi(arg + 9);
+    return repeat_ > 0;
+  } else if (strncmp(arg, "--seed=", 7) == 0) {
+    seed_ = strtoull(arg + 7, nullptr, 0);
+    return true;
+  } else if ((strcmp(arg, "-v") == 0) || (strcmp(arg, "--verbose") == 0)) {
+    verbosity_++;
+    return true;
+  } else if (arg[0] == '-') {
+    return false;
+  }
+  filter_needles_.push_back(arg);
+  return true;
+}
+
+bool Options::should_run(char const* name) const {
+  if (filter_needles_.empty()) return true;
+  for (char const* needle : filter_needles_) {
+    if (strstr(name, needle)) return true;
+  }
+  return false;
+}
+
+static uint64_t per_sec(uint64_t count, uint64_t ns) {
+  return (ns == 0) ? 0 : static_cast<uint64_t>(count * 1e9 / ns);
+}
+
+// Results are written as JSON lines (one object per run) on stdout, so runs
+// can be compared with standard tools. Peak RSS is the process's high-water
+// mark so far, so run benchmarks individually to compare their footprints.
+int main(int argc, char const* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (!options.parse_arg(argv[i])) {
+      fprintf(stderr, "Bad argument: %s\n", argv[i]);
+      fprintf(stderr, "Usage: %s [-v] [--repeat=N] [--seed=S] [FILTER...]\n", argv[0]);
+      exit(1);
+    }
+  }
+#ifdef __CHERI_PURE_CAPABILITY__
+  char const* abi = "purecap";
+#else
+  char const* abi = "hybrid";
+#endif
+  capmap::JsonWriter out(stdout);
+  for (Bench* bench : Bench::list()) {
+    if (!options.should_run(bench->name())) continue;
+    for (int i = 0; i < options.repeat(); i++) {
+      BenchRun run(options);
+      bench->run(&run);
+      Result const& r = run.result();
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+
+      out.raw("{ \"bench\": ");
+      out.string(bench->name());
+      out.raw(", \"abi\": ");
+      out.string(abi);
+      out.raw(", \"run\": ");
+      out.dec(i);
+      out.raw(", \"seed\": ");
+      out.dec(options.seed());
+      out.raw(", \"caps\": ");
+      out.dec(r.caps);
+      out.raw(", \"granules\": ");
+      out.dec(r.granules);
+      out.raw(", \"tagged\": ");
+      out.dec(r.tagged);
+      out.raw(", \"scan_ns\": ");
+      out.dec(r.scan_ns);
+      out.raw(", \"scan_load_ns\": ");
+      out.dec(r.scan_load_ns);
+      out.raw(", \"scan_map_ns\": ");
+      out.dec(r.scan_map_ns);
+      out.raw(", \"caps_per_sec\": ");
+      out.dec(per_sec(r.caps, r.scan_ns));
+      out.raw(", \"granules_per_sec\": ");
+      out.dec(per_sec(r.granules, r.scan_ns));
+      out.raw(", \"range_ns\": ");
+      out.dec(r.range_ns);
+      out.raw(", \"replay_granules\": ");
+      out.dec(r.replay_granules);
+      out.raw(", \"load_ns\": ");
+      out.dec(r.load_ns);
+      out.raw(", \"max_rss_kib\": ");
+      out.dec(usage.ru_maxrss);
+      out.raw(" }\n");
+      out.flush();
+    }
+  }
+  return out.ok() ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef BENCHES_BENCH_H_
+#define BENCHES_BENCH_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "include/capmap.h"
+
+namespace capmap {
+namespace benches {
+
+class Options {
+ public:
+  bool parse_arg(char const *arg);
+
+  bool verbose() const { return verbosity_ > 0; }
+  // The number of times to run each benchmark.
+  int repeat() const { return repeat_; }
+  // The seed for synthetic graphs. Each run of a benchmark starts from the
+  // same seed, so runs (and builds) see identical graphs.
+  uint64_t seed() const { return seed_; }
+  bool should_run(char const *name) const;
+
+ private:
+  int verbosity_ = 0;
+  int repeat_ = 5;
+  uint64_t seed_ = 42;
+  std::vector<char const *> filter_needles_;
+};
+
+// A small, deterministic PRNG (xorshift64*), so that graphs do not depend on
+// the C library's `rand()`.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed ? seed : 1) {}
+  uint64_t next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 0x2545f4914f6cdd1dull;
+  }
+  // A value in [0, bound).
+  uint64_t below(uint64_t bound) { return next() % bound; }
+
+ private:
+  uint64_t state_;
+};
+
+// Measurements from one run of one benchmark.
+struct Result {
+  // Capabilities passed to the maps (including repeats).
+  uint64_t caps = 0;
+  // Granules examined by the timed scan (`ScanStats::granules`), and how many
+  // of them held a valid capability.
+  uint64_t granules = 0;
+  uint64_t tagged = 0;
+  // Granules loaded by the load replay, which over-counts overlapping regions.
+  uint64_t replay_granules = 0;
+  // Time in `Mapper::scan()`, and the parts of it that `ScanStats` attributes
+  // to the granule loop and to the maps.
+  uint64_t scan_ns = 0;
+  uint64_t scan_load_ns = 0;
+  uint64_t scan_map_ns = 0;
+  // Time to replay the same capabilities into a `SparseRange`, without any
+  // memory loads.
+  uint64_t range_ns = 0;
+  // Time to load every granule of the same capabilities, without any range
+  // algebra.
+  uint64_t load_ns = 0;
+};
+
+class BenchRun {
+ public:
+  explicit BenchRun(Options const &options) : options_(options), random_(options.seed()) {}
+
+  Options const &options() const { return options_; }
+  Random *random() { return &random_; }
+  Result const &result() const { return result_; }
+
+  // Scan from `root` with a `LoadMap`, and time it. The same capabilities are
+  // then replayed separately (untimed collection, timed replay) to split the
+  // cost between range algebra and memory loads.
+  void scan(void *__capability root);
+
+  // Time `fn()` as pure range algebra, e.g. for `SparseRange` workloads that
+  // don't scan anything.
+  template <typename F>
+  void time_ranges(F fn) {
+    uint64_t start = now_ns();
+    fn();
+    result_.range_ns += now_ns() - start;
+  }
+
+  static uint64_t now_ns();
+
+ private:
+  Options const &options_;
+  Random random_;
+  Result result_;
+};
+
+class Bench {
+ public:
+  virtual ~Bench() {}
+  virtual void run(BenchRun *run) const = 0;
+  char const *name() const { return name_; }
+
+  static std::vector<Bench *> &list();
+
+ protected:
+  Bench(char const *name) : name_(name) { list().push_back(this); }
+  char const *name_;
+};
+
+// Define a benchmark. The body builds its input, then calls `run->scan()` (or
+// `run->time_ranges()`); only those calls are timed.
+#define BENCH(name)                                                        \
+  class Bench_##name : public capmap::benches::Bench {                     \
+   public:                                                                 \
+    Bench_##name(char const *name) : capmap::benches::Bench(name) {}       \
+    virtual void run(capmap::benches::BenchRun *run) const override final; \
+  };                                                                       \
+  Bench_##name bench_##name(#name);                                        \
+  void Bench_##name::run(capmap::benches::BenchRun *run) const
+
+// Return a capability for `obj`, with bounds of `size` bytes.
+//
+// In purecap, this is just `obj`, so the bounds are those of the allocation.
+template <typename T = void, typename S>
+T *__capability cap(S *obj, size_t size = sizeof(S)) {
+#ifdef __CHERI_PURE_CAPABILITY__
+  (void)size;
+  return reinterpret_cast<T *__capability>(obj);
+#else
+  auto addr = reinterpret_cast<ptraddr_t>(obj);
+  auto ret = cheri_bounds_set(cheri_address_set(cheri_ddc_get(), addr), size);
+  return reinterpret_cast<T *__capability>(ret);
+#endif
+}
+
+}  // namespace benches
+}  // namespace capmap
+
+#endif
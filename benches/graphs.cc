@@ -0,0 +1,132 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "bench.h"
+#include "include/capmap.h"
+
+using capmap::Range;
+using capmap::SparseRange;
+using capmap::benches::cap;
+using capmap::benches::Random;
+
+namespace {
+
+// Allocate `count` objects of `size` bytes, in a shuffled order, so that
+// consecutive graph nodes are not usually adjacent in memory.
+std::vector<void*> allocate_shuffled(Random* random, size_t count, size_t size) {
+  std::vector<void*> objects(count);
+  for (auto& object : objects) object = calloc(1, size);
+  for (size_t i = count; i > 1; i--) std::swap(objects[i - 1], objects[random->below(i)]);
+  return objects;
+}
+
+void free_all(std::vector<void*> const& objects) {
+  for (void* object : objects) free(object);
+}
+
+struct ListNode {
+  ListNode* __capability next;
+  uint64_t payload[6];
+};
+
+struct TreeNode {
+  TreeNode* __capability children[2];
+  uint64_t payload[2];
+};
+
+TreeNode* __capability make_tree(std::vector<void*>* objects, size_t* next, int depth) {
+  auto node = static_cast<TreeNode*>((*objects)[(*next)++]);
+  for (auto& child : node->children) {
+    child = (depth > 0) ? make_tree(objects, next, depth - 1) : nullptr;
+  }
+  return cap<TreeNode>(node);
+}
+
+}  // namespace
+
+BENCH(linked_list) {
+  // A long list, so the worklist never holds more than one item.
+  size_t const kNodes = 1 << 17;
+  auto nodes = allocate_shuffled(run->random(), kNodes, sizeof(ListNode));
+  for (size_t i = 0; i + 1 < kNodes; i++) {
+    static_cast<ListNode*>(nodes[i])->next = cap<ListNode>(static_cast<ListNode*>(nodes[i + 1]));
+  }
+  run->scan(cap(static_cast<ListNode*>(nodes[0])));
+  free_all(nodes);
+}
+
+BENCH(balanced_tree) {
+  int const kDepth = 16;
+  auto nodes = allocate_shuffled(run->random(), (2ul << kDepth) - 1, sizeof(TreeNode));
+  size_t next = 0;
+  run->scan(make_tree(&nodes, &next, kDepth));
+  free_all(nodes);
+}
+
+BENCH(wide_array) {
+  // One large object holding many capabilities to small objects.
+  size_t const kWidth = 1 << 17;
+  auto objects = allocate_shuffled(run->random(), kWidth, 32);
+  auto array = static_cast<void* __capability*>(calloc(kWidth, sizeof(void* __capability)));
+  for (size_t i = 0; i < kWidth; i++) array[i] = cap(static_cast<char(*)[32]>(objects[i]));
+  run->scan(cap(array, kWidth * sizeof(void* __capability)));
+  free(array);
+  free_all(objects);
+}
+
+BENCH(aliased_buffers) {
+  // Many holders referring to a few shared buffers, mostly through identical
+  // capabilities, but sometimes through sub-ranges of them.
+  size_t const kBuffers = 64;
+  size_t const kBufferSize = 4096;
+  size_t const kHolders = 1 << 16;
+  auto buffers = allocate_shuffled(run->random(), kBuffers, kBufferSize);
+  // Buffers hold capabilities to each other, so they are scanned too.
+  for (size_t i = 0; i < kBuffers; i++) {
+    auto slots = static_cast<void* __capability*>(buffers[i]);
+    slots[0] = cap(static_cast<char(*)[kBufferSize]>(buffers[(i + 1) % kBuffers]));
+  }
+  auto holders = static_cast<void* __capability*>(calloc(kHolders, sizeof(void* __capability)));
+  for (size_t i = 0; i < kHolders; i++) {
+    void* __capability buffer =
+        cap(static_cast<char(*)[kBufferSize]>(buffers[run->random()->below(kBuffers)]));
+    if (run->random()->below(8) == 0) {
+      size_t offset = run->random()->below(kBufferSize / 16) * 16;
+      buffer = cheri_address_set(buffer, cheri_base_get(buffer) + offset);
+      buffer = cheri_bounds_set(buffer, kBufferSize - offset);
+    }
+    holders[i] = buffer;
+  }
+  run->scan(cap(holders, kHolders * sizeof(void* __capability)));
+  free(holders);
+  free_all(buffers);
+}
+
+BENCH(fragmented_sparse_range) {
+  // Range algebra alone: build a heavily fragmented SparseRange, then punch
+  // holes in it and query it.
+  size_t const kRanges = 1 << 16;
+  ptraddr_t const kSpan = 1ul << 32;
+  std::vector<Range> add(kRanges);
+  std::vector<Range> remove(kRanges / 4);
+  for (auto& range : add) {
+    range = Range::from_base_length(run->random()->below(kSpan), 1 + run->random()->below(4096));
+  }
+  for (auto& range : remove) {
+    range = Range::from_base_length(run->random()->below(kSpan), 1 + run->random()->below(65536));
+  }
+  size_t found = 0;
+  run->time_ranges([&]() {
+    SparseRange sr;
+    for (auto range : add) sr.combine(range);
+    for (auto range : remove) sr.remove(range);
+    for (auto range : add) found += sr.includes(range.base());
+  });
+  if (run->options().verbose()) fprintf(stderr, "  %zu of %zu bases remain\n", found, kRanges);
+}
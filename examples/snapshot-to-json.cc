@@ -0,0 +1,24 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdio.h>
+
+#include "include/capmap-binary.h"
+
+// Convert a binary snapshot (from `Mapper::write_binary()`) to the JSON that
+// `Mapper::print_json()` would have printed.
+int main(int argc, char const* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s SNAPSHOT\n", argv[0]);
+    return 1;
+  }
+  capmap::BinarySnapshot snapshot;
+  if (!snapshot.open(argv[1])) {
+    fprintf(stderr, "%s: not a valid capmap snapshot (version %u)\n", argv[1],
+            capmap::binary::kVersion);
+    return 1;
+  }
+  capmap::JsonWriter out(stdout);
+  snapshot.print_json(&out);
+  return out.flush() ? 0 : 1;
+}
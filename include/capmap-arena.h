@@ -0,0 +1,148 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_ARENA_H_
+#define CAPMAP_ARENA_H_
+
+#if __has_feature(capabilities)
+#include <cheriintrin.h>
+#else
+#error "capmap-arena.h requires capabilities"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+// The size of the address space reserved for the arena, in bytes. Pages are
+// only allocated as they are used. If the arena is exhausted (or this is 0),
+// allocations fall back to `posix_memalign()`, and each such block is excluded
+// from scans separately (see `Arena::fallback_blocks()`).
+#ifndef CAPMAP_ARENA_SIZE
+#define CAPMAP_ARENA_SIZE (1ul << 30)
+#endif
+
+namespace capmap {
+
+// A private, mmap-backed region from which the library allocates its own data
+// structures (SparseRange parts, worklists, and so on).
+//
+// The region is reserved once, so `Mapper` can exclude all of it from scans
+// with a single range, however much it allocates. Every block is rounded up to
+// a power-of-two size class (which leaves room for its alignment), and freed
+// blocks are kept on per-class free lists. When the last live allocation is
+// freed (e.g. when every `Mapper` has been destroyed between snapshots), the
+// whole arena is rewound to the start.
+//
+// In purecap builds, each allocation is returned with bounds set to its block.
+//
+// A single lock protects the arena, so threads allocating at the same time
+// (such as `ParallelScan` workers growing their ranges) contend for it. Each
+// operation is short, and workers batch most of their work, but allocation-
+// heavy maps will not scale across threads.
+class Arena {
+ public:
+  // The process-wide arena, reserved on first use.
+  static Arena &get();
+
+  // Allocate `size` bytes, aligned to at least `align` (which must be a power
+  // of two). Throws `std::bad_alloc` on failure.
+  void *allocate(size_t size, size_t align);
+  // Free a block from `allocate()`, given the same `size` and `align`.
+  void deallocate(void *ptr, size_t size, size_t align = 1);
+
+  // True if `ptr` was allocated from the reserved region.
+  bool contains(void const *ptr) const;
+
+  // The reserved region, as a [base, limit) pair of addresses. This is empty
+  // if the region could not be reserved.
+  ptraddr_t base() const { return base_addr_; }
+  ptraddr_t limit() const { return base_addr_ + size_; }
+
+  // The number of live allocations (including any that fell back to
+  // `malloc()`), and the number of times that the arena has been rewound.
+  size_t live() const { return live_; }
+  uint64_t generation() const { return generation_; }
+
+  // The number of bytes in live allocations, with each rounded up to its size
+  // class. Blocks on free lists are not counted, since they will be reused.
+  size_t bytes() const;
+
+  // The live blocks that fell back to `posix_memalign()`, as (base, size)
+  // pairs, so that they can be excluded from scans too.
+  std::vector<std::pair<ptraddr_t, size_t>> fallback_blocks() const;
+
+ private:
+  // Size classes are powers of two, from `kMinBlock` up to `kMaxClassBlock`
+  // (as large as the default arena). Larger blocks are never reused until the
+  // arena is rewound.
+  static size_t const kMinBlock = 16;
+  static size_t const kClasses = 27;
+  static size_t const kMaxClassBlock = kMinBlock << (kClasses - 1);
+
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  Arena();
+  // The smallest size class that holds `size` bytes.
+  static size_t size_class(size_t size);
+  // The size class for `size` bytes aligned to `align`, or `kClasses` if they
+  // need a block larger than `kMaxClassBlock`.
+  static size_t class_for(size_t size, size_t align);
+  // The size of the block used for `size` bytes aligned to `align`.
+  static size_t block_size(size_t size, size_t align);
+  void *bump(size_t size, size_t align);
+  void rewind();
+
+  mutable std::mutex lock_;
+  char *base_ = nullptr;
+  ptraddr_t base_addr_ = 0;
+  size_t size_ = 0;
+  size_t top_ = 0;
+  size_t live_ = 0;
+  size_t bytes_ = 0;
+  uint64_t generation_ = 0;
+  FreeBlock *free_[kClasses] = {};
+  // Live blocks from `posix_memalign()`, by address.
+  std::map<ptraddr_t, size_t> fallback_;
+};
+
+// A standard allocator drawing from `Arena::get()`.
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  ArenaAllocator() noexcept {}
+  template <typename U>
+  ArenaAllocator(ArenaAllocator<U> const &) noexcept {}
+
+  T *allocate(size_t n) {
+    if (n > SIZE_MAX / sizeof(T)) throw std::bad_alloc();
+    return static_cast<T *>(Arena::get().allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *ptr, size_t n) noexcept {
+    Arena::get().deallocate(ptr, n * sizeof(T), alignof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(ArenaAllocator<T> const &, ArenaAllocator<U> const &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(ArenaAllocator<T> const &, ArenaAllocator<U> const &) {
+  return false;
+}
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+}  // namespace capmap
+#endif
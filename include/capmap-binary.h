@@ -0,0 +1,251 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_BINARY_H_
+#define CAPMAP_BINARY_H_
+
+#include "capmap-json.h"
+#include "capmap-range.h"
+#include "capmap-writer.h"
+#include "capmap.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <type_traits>
+
+namespace capmap {
+
+// The binary snapshot format, written by `Mapper::write_binary()`.
+//
+// A snapshot holds the same information as `Mapper::print_json()`, laid out so
+// that it can be mapped and queried in place. It starts with a `Header`, then a
+// table of `Section`s, then each section's data, aligned to 16 bytes. All
+// fields are little-endian, as on Morello.
+//
+// Names are byte offsets into the (NUL-terminated) strings section. Ranges are
+// stored as [base, last] pairs, sorted by base. They are disjoint, except in
+// sections flagged `kSectionOverlapping`, which keep individual (possibly
+// overlapping or repeated) bounds, sorted by base and then by last.
+//
+// Diffs (from `ScanDiff::write_binary()`, read by `ScanDiff::read_binary()`)
+// use the same layout, with a different magic, and only the sections that have
+// something in them.
+namespace binary {
+
+static uint32_t const kVersion = 3;
+static char const kMagic[8] = {'C', 'A', 'P', 'M', 'A', 'P', 'B', '\0'};
+static char const kDiffMagic[8] = {'C', 'A', 'P', 'M', 'A', 'P', 'D', '\0'};
+static size_t const kAlign = 16;
+
+// `size`, rounded up to the alignment of sections.
+inline size_t aligned(size_t size) { return (size + kAlign - 1) & ~(kAlign - 1); }
+
+enum SectionKind : uint32_t {
+  // `count` bytes of NUL-terminated names. Offset 0 is always "".
+  kSectionStrings = 1,
+  // `count` `Root`s, in the order in which they were added.
+  kSectionRoots = 2,
+  // One `Config`.
+  kSectionConfig = 3,
+  // `count` 64-bit counters from `ScanStats`, in a fixed order (see
+  // `kStatsFields` in `src/binary.cc`). Readers ignore any counters that they
+  // don't know about.
+  kSectionStats = 4,
+  // `count` ranges each, for the scan's include and (self-)exclude sets.
+  kSectionInclude = 5,
+  kSectionExclude = 6,
+  // `count` ranges of one map, with its `name` and `address_space`. Maps appear
+  // in the order in which `print_json()` prints them. Each map flagged
+  // `kSectionOverlapping` is followed immediately by its `kSectionMapMaxLast`.
+  kSectionMap = 7,
+
+  // Diffs only. `count` `Root`s each, sorted by name: roots only in the later
+  // snapshot, roots only in the earlier one, and the new values of roots whose
+  // bits changed.
+  kSectionRootsAdded = 8,
+  kSectionRootsRemoved = 9,
+  kSectionRootsChanged = 10,
+  // Two 64-bit values: the earlier and later `max_seen_scan_depth`, if they
+  // differ.
+  kSectionDepth = 11,
+  // `count` ranges each, added to or removed from the named map. For each map,
+  // any added ranges come first, and both sections share its name offsets.
+  kSectionMapAdded = 12,
+  kSectionMapRemoved = 13,
+  // The earlier values of the roots in `kSectionRootsChanged`, in the same
+  // order.
+  kSectionRootsChangedBefore = 14,
+  // `count` 64-bit addresses, one for each range of the preceding (overlapping)
+  // map: the greatest `last` of that range and all those before it (see
+  // `RangeIndex::max_last()`).
+  kSectionMapMaxLast = 15,
+};
+
+enum SectionFlags : uint32_t {
+  kSectionOverlapping = 1u << 0,
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  // The size of the whole snapshot, in bytes.
+  uint64_t size;
+};
+
+struct Section {
+  uint32_t kind;
+  uint32_t flags;
+  // The offset of the data from the start of the snapshot, and the number of
+  // elements in it.
+  uint64_t offset;
+  uint64_t count;
+  // String offsets, for maps.
+  uint64_t name;
+  uint64_t address_space;
+};
+
+// A root capability, as its raw bits.
+struct Root {
+  uint64_t name;
+  uint64_t tag;
+  uint64_t high;
+  uint64_t low;
+};
+
+struct Config {
+  uint64_t max_scan_depth;
+  uint64_t max_seen_scan_depth;
+  uint64_t dedup_hits;
+  uint64_t dedup_misses;
+};
+
+// Check the header and section table of a snapshot (or, given `kDiffMagic`, a
+// diff) in `data`, which must be aligned to 16 bytes. The magic and version
+// must match, and every section of a known kind must be aligned and within the
+// snapshot. Returns the header, or nullptr if the checks fail.
+Header const *validate(void const *data, size_t size, char const *magic);
+
+inline Section const *sections(Header const *header) {
+  return reinterpret_cast<Section const *>(header + 1);
+}
+
+static_assert(sizeof(Header) == 24, "Unexpected binary::Header layout");
+static_assert(sizeof(Section) == 40, "Unexpected binary::Section layout");
+static_assert(sizeof(Range) == 2 * sizeof(uint64_t), "Ranges are stored as [base, last] pairs");
+static_assert(std::is_trivially_copyable<Range>::value, "Ranges are read in place");
+
+}  // namespace binary
+
+// A read-only view of a sorted array of ranges, such as a map in a
+// `BinarySnapshot`.
+//
+// This answers the same queries as a `SparseRange`, in place, by binary search.
+// Views of overlapping ranges (see `binary::kSectionOverlapping`) need their
+// `max_last` array (as from `RangeIndex::max_last()`) for that, and otherwise
+// fall back to a linear search. The arrays must outlive the view.
+class RangeView {
+ public:
+  typedef Range const *const_iterator;
+
+  RangeView() {}
+  RangeView(Range const *ranges, size_t size, bool overlapping = false,
+            uint64_t const *max_last = nullptr)
+      : ranges_(ranges), size_(size), overlapping_(overlapping), max_last_(max_last) {}
+
+  const_iterator begin() const { return ranges_; }
+  const_iterator end() const { return ranges_ + size_; }
+  size_t size() const { return size_; }
+  bool is_empty() const { return size_ == 0; }
+  Range operator[](size_t i) const { return ranges_[i]; }
+  // True if the ranges may overlap one another.
+  bool overlapping() const { return overlapping_; }
+
+  bool includes(ptraddr_t addr) const;
+  bool overlaps(Range range) const;
+
+  // Copy the ranges into a `SparseRange`, merging any that overlap or touch.
+  SparseRange to_sparse_range() const;
+
+ private:
+  Range const *ranges_ = nullptr;
+  size_t size_ = 0;
+  bool overlapping_ = false;
+  uint64_t const *max_last_ = nullptr;
+};
+
+// A binary snapshot, opened for reading.
+//
+// `open()` maps the file and validates its structure (but not the order of its
+// ranges), so every accessor afterwards is a direct read from the mapping. No
+// memory is allocated, except by `capture()` and `RangeView::to_sparse_range()`.
+class BinarySnapshot {
+ public:
+  BinarySnapshot() {}
+  BinarySnapshot(BinarySnapshot const &) = delete;
+  BinarySnapshot &operator=(BinarySnapshot const &) = delete;
+  ~BinarySnapshot() { close(); }
+
+  // Map the snapshot at `path`. Returns false if it can't be read, or isn't a
+  // valid snapshot (of this version).
+  bool open(char const *path);
+  // As above, but for a snapshot already in memory, which must outlive this
+  // object and be aligned to 16 bytes.
+  bool open(void const *data, size_t size);
+  // Snapshot `mapper` (with `Mapper::write_binary()`) into memory owned by this
+  // object, for example to compare it with a later scan using `ScanDiff`.
+  bool capture(Mapper *mapper);
+  void close();
+  bool is_open() const { return data_ != nullptr; }
+
+  size_t root_count() const { return roots_count_; }
+  char const *root_name(size_t i) const { return string(roots_[i].name); }
+  binary::Root const &root(size_t i) const { return roots_[i]; }
+
+  binary::Config const &config() const { return *config_; }
+  ScanStats stats() const;
+
+  RangeView include() const { return ranges(*include_); }
+  RangeView exclude() const { return ranges(*exclude_); }
+
+  // Maps, in the order in which `Mapper::print_json()` prints them. The first
+  // is always `Mapper::load_cap_map()`.
+  // For `i` beyond `map_count()`, the names are nullptr and the ranges are
+  // empty.
+  size_t map_count() const { return map_count_; }
+  char const *map_name(size_t i) const;
+  char const *map_address_space(size_t i) const;
+  RangeView map_ranges(size_t i) const;
+
+  // Write the snapshot as JSON, in the format of `Mapper::print_json()`.
+  void print_json(FILE *stream) const;
+  void print_json(JsonWriter *out) const;
+
+ private:
+  bool validate();
+  char const *string(uint64_t offset) const { return strings_ + offset; }
+  RangeView ranges(binary::Section const &section) const;
+  // The section for map `i`, or nullptr.
+  binary::Section const *map(size_t i) const;
+
+  char const *data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  bool owned_ = false;
+
+  binary::Section const *sections_ = nullptr;
+  size_t section_count_ = 0;
+  char const *strings_ = nullptr;
+  binary::Root const *roots_ = nullptr;
+  size_t roots_count_ = 0;
+  binary::Config const *config_ = nullptr;
+  binary::Section const *stats_ = nullptr;
+  binary::Section const *include_ = nullptr;
+  binary::Section const *exclude_ = nullptr;
+  size_t map_count_ = 0;
+};
+
+}  // namespace capmap
+#endif
@@ -0,0 +1,95 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_DIFF_H_
+#define CAPMAP_DIFF_H_
+
+#include "capmap-arena.h"
+#include "capmap-binary.h"
+#include "capmap-json.h"
+#include "capmap-range.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace capmap {
+
+// A root that was added, removed or changed between two snapshots.
+struct RootChange {
+  char const *name;
+  // The root in each snapshot, or nullptr if it was added (or removed).
+  binary::Root const *before;
+  binary::Root const *after;
+};
+
+// The ranges added to, or removed from, one map.
+struct MapChange {
+  char const *name;
+  char const *address_space;
+  // As `RangeView::overlapping()`. For maps that keep individual bounds, the
+  // changes are the bounds that appeared or disappeared, and may overlap.
+  bool overlapping;
+  RangeVector added;
+  RangeVector removed;
+};
+
+// The difference between two scans, such as successive snapshots of one
+// `Mapper` (captured with `BinarySnapshot::capture()`) as it is rescanned.
+//
+// Maps are matched by name and address space, and roots by name (in order,
+// where names repeat). Each map's ranges are compared with a single linear
+// merge of the two sorted arrays, so the cost is proportional to the size of
+// the maps, but the result (and its output) is proportional to the change.
+// Unchanged maps and roots are left out entirely.
+//
+// Names and roots point into the snapshots, so these must outlive the diff.
+class ScanDiff {
+ public:
+  ScanDiff() {}
+
+  // Compare `before` and `after`, replacing any earlier result.
+  void compute(BinarySnapshot const &before, BinarySnapshot const &after);
+
+  // True if nothing changed (or nothing has been compared).
+  bool is_empty() const {
+    return roots_.empty() && maps_.empty() && (depth_before_ == depth_after_);
+  }
+
+  // Changed roots, sorted by name.
+  ArenaVector<RootChange> const &roots() const { return roots_; }
+  // Changed maps, in the order of `after` (then maps that only `before` had).
+  ArenaVector<MapChange> const &maps() const { return maps_; }
+
+  // `max_seen_scan_depth()` in each snapshot.
+  uint64_t depth_before() const { return depth_before_; }
+  uint64_t depth_after() const { return depth_after_; }
+
+  // Write only the changes, as JSON (`"capmap-diff": {}` if there are none).
+  void print_json(FILE *stream) const;
+  void print_json(JsonWriter *out) const;
+
+  // Write only the changes, in the binary snapshot layout (see
+  // `include/capmap-binary.h`). An empty diff is just a header. Returns false
+  // if any write failed.
+  bool write_binary(FILE *stream) const;
+  bool write_binary(ByteWriter *out) const;
+
+  // Read a diff written by `write_binary()`, replacing any earlier result. The
+  // data must be aligned to 16 bytes, and must outlive the diff, since names
+  // and roots point into it. Returns false (leaving the diff empty) if the data
+  // isn't a valid diff of this version. Depths are only stored if they
+  // differ, so otherwise both read as 0.
+  bool read_binary(void const *data, size_t size);
+
+ private:
+  void compare_roots(BinarySnapshot const &before, BinarySnapshot const &after);
+  bool parse_binary(void const *data, size_t size);
+
+  ArenaVector<RootChange> roots_;
+  ArenaVector<MapChange> maps_;
+  uint64_t depth_before_ = 0;
+  uint64_t depth_after_ = 0;
+};
+
+}  // namespace capmap
+#endif
@@ -0,0 +1,86 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_JSON_H_
+#define CAPMAP_JSON_H_
+
+#include "capmap-range.h"
+#include "capmap-writer.h"
+
+#if __has_feature(capabilities)
+#include <cheriintrin.h>
+#else
+#error "capmap-json.h requires capabilities"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace capmap {
+
+// A buffered writer for JSON output.
+//
+// Output is formatted directly into the `ByteWriter` buffer, without stdio, so
+// (given a suitable sink) this is safe to use while the process is being
+// mapped.
+class JsonWriter : public ByteWriter {
+ public:
+  explicit JsonWriter(int fd) : ByteWriter(fd) {}
+  explicit JsonWriter(FILE *stream) : ByteWriter(stream) {}
+  JsonWriter(Sink sink, void *context) : ByteWriter(sink, context) {}
+
+  using ByteWriter::raw;
+  // Append `str` verbatim.
+  void raw(char const *str);
+
+  // Append `str` as a quoted, escaped JSON string.
+  void string(char const *str);
+
+  // Append `value` in lower-case hexadecimal, without a prefix.
+  void hex(uint64_t value);
+  // Append `value` in decimal.
+  void dec(uint64_t value);
+
+  // Append `{ "base": 0x..., "last": 0x... }`.
+  void range(Range range);
+
+  // Append the raw bits of a capability, as `0x<tag>:<high>:<low>`.
+  void raw_cap(void *__capability cap);
+  // As `raw_cap()`, for a capability held as its raw bits.
+  void raw_cap_bits(bool tag, uint64_t high, uint64_t low);
+};
+
+// Write a sorted sequence of ranges as a JSON array, one at a time.
+//
+// Unless `coalesce` is false, overlapping or adjacent ranges are merged, and
+// each range is written as soon as it can no longer grow, so a caller producing
+// ranges in address order never needs to materialise the whole set. The output
+// format matches `print_json()`.
+class JsonRangeStream {
+ public:
+  JsonRangeStream(JsonWriter *out, char const *line_prefix = "", bool coalesce = true)
+      : out_(out), line_prefix_(line_prefix), coalesce_(coalesce) {}
+
+  // `range` must not start before any range already added.
+  void add(Range range);
+
+  // Write any pending range, and close the array.
+  void finish();
+
+ private:
+  void emit(Range range);
+
+  JsonWriter *out_;
+  char const *line_prefix_;
+  bool coalesce_;
+  bool has_pending_ = false;
+  Range pending_ = Range::from_base_last(0, 0);
+  // The first range is held back, since a lone range is written on one line.
+  Range first_ = Range::from_base_last(0, 0);
+  size_t count_ = 0;
+};
+
+void print_json(JsonWriter *out, RangeSet const &ranges, char const *line_prefix = "");
+
+}  // namespace capmap
+#endif
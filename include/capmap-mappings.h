@@ -5,6 +5,7 @@
 #ifndef CAPMAP_MAPPERS_H_
 #define CAPMAP_MAPPERS_H_
 
+#include "capmap-json.h"
 #include "capmap-range.h"
 
 namespace capmap {
@@ -21,17 +22,31 @@ class Map {
   // Return a user-facing address space name for the map.
   virtual char const *address_space() const = 0;
 
-  // All ranges included in the map.
+  // All ranges included in the map, merged like SparseRange.
   //
-  // Whilst most maps will merge adjacent or overlapping ranges, like SparseRange,
-  // some might preserve the individual ranges. This is useful for execution
-  // permissions, for example.
-  //
-  // TODO: This doesn't actually work for Execute, because we can't store those
-  // in a std::set. Differently-overlapping ranges are relevant for Execute, so
-  // we need a better way to represent them. Do we need some abstract iterator
-  // type?
-  virtual std::set<Range> const &ranges() const = 0;
+  // Maps that preserve individual (possibly overlapping) ranges, like
+  // `ExecuteMap`, keep them separately, and override `print_ranges_json()`.
+  virtual RangeSet const &ranges() const = 0;
+
+  // Write the map's ranges as a JSON array (as `print_json()` does for
+  // `ranges()`, by default).
+  virtual void print_ranges_json(JsonWriter *out, char const *line_prefix) const {
+    ::capmap::print_json(out, ranges(), line_prefix);
+  }
+
+  // The individual ranges of maps that keep them (sorted by base), or nullptr
+  // if `ranges()` describes the map. `Mapper::write_binary()` writes these
+  // instead of `ranges()`, when they exist.
+  virtual RangeIndex const *distinct_ranges() const { return nullptr; }
+
+  // Maps that are made up of several maps (like `PermissionComboMap`) can
+  // expose them here. `Mapper::print_json()` then prints each of them as a
+  // separate map, instead of this one.
+  virtual size_t submap_count() const { return 0; }
+  virtual Map const &submap(size_t i) const {
+    (void)i;
+    return *this;
+  }
 
   // If the capability has the necessary permissions, add it to the map.
   //
@@ -43,6 +58,26 @@ class Map {
   // included it), and false otherwise.
   virtual bool try_combine(void *__capability cap) = 0;
 
+  // Call `try_combine()` for each of the `count` capabilities at `caps`.
+  //
+  // The `Mapper` passes capabilities in batches (typically all of those found
+  // in one region), so maps can override this to check and merge the whole
+  // batch in one pass. The result must be the same as a `try_combine()` loop.
+  virtual void try_combine_batch(void *__capability const *caps, size_t count) {
+    for (size_t i = 0; i < count; i++) try_combine(caps[i]);
+  }
+
+  // Reduce the map's memory use by merging ranges separated by gaps of fewer
+  // than `gap` bytes (as `SparseRange::coarsen()` does), when the `Mapper` is
+  // short of memory. Returns the number of bytes added to the map this way.
+  //
+  // By default, nothing is merged. Maps that must stay exact need not
+  // override this.
+  virtual uint64_t coarsen(uint64_t gap) {
+    (void)gap;
+    return 0;
+  }
+
   virtual ~Map(){};
 };
 
@@ -54,29 +89,46 @@ class LoadCapMap : public Map {
  public:
   virtual char const *name() const override { return "load capabilities"; }
   virtual char const *address_space() const override { return "virtual memory"; }
-  virtual std::set<Range> const &ranges() const override { return ranges_.parts(); }
+  virtual RangeSet const &ranges() const override { return ranges_.parts(); }
 
   virtual bool try_combine(void *__capability cap) override;
+  virtual void try_combine_batch(void *__capability const *caps, size_t count) override;
+  virtual uint64_t coarsen(uint64_t gap) override { return ranges_.coarsen(gap); }
 
   virtual ~LoadCapMap() {}
 
+  // True if `cap` has the permissions needed for `try_combine()`.
+  static bool can_load_caps(void *__capability cap) {
+    Range range;
+    return filter(cap, &range);
+  }
+
   // If `addr` refers to an area of memory that might contain a capability that
   // we haven't already scanned, return false, and leave `*cont` unmodified.
   //
   // Otherwise, return true, and set `*cont` to point to the next address that a
-  // scan for new capability might continue from. This will typically be the
-  // first capability-aligned excluded address after `addr`, but in some cases
-  // (e.g. if the map covers the whole address space), it may still be included.
+  // scan for new capability might continue from: the first capability-aligned
+  // granule after `addr` that the covering range doesn't fully include, so a
+  // whole included range is skipped at once. If the covering range reaches the
+  // end of the address space, there is no such granule, and `*cont` is 0 (as
+  // if it had wrapped), so callers should stop once `*cont <= addr`.
   bool includes_cap(ptraddr_t addr, ptraddr_t *cont) const;
 
   // Return a SparseRange representing all mapped regions from which
   // capabilities could be loaded (at the page table level).
+  //
+  // This uses the shared, cached `VmMap::process()`, so repeated calls only
+  // re-read the kernel's map if it has changed.
   static SparseRange vmmap();
 
   SparseRange const &sparse_range() const { return ranges_; }
 
  private:
+  // If `cap` should be combined, set `*range` to the range to combine.
+  static bool filter(void *__capability cap, Range *range);
+
   SparseRange ranges_;
+  RangeVector batch_;
 };
 
 // Memory ranges from which data can be loaded.
@@ -84,14 +136,19 @@ class LoadMap : public Map {
  public:
   virtual char const *name() const override { return "load"; }
   virtual char const *address_space() const override { return "virtual memory"; }
-  virtual std::set<Range> const &ranges() const override { return ranges_.parts(); }
+  virtual RangeSet const &ranges() const override { return ranges_.parts(); }
   virtual bool try_combine(void *__capability cap) override;
+  virtual void try_combine_batch(void *__capability const *caps, size_t count) override;
+  virtual uint64_t coarsen(uint64_t gap) override { return ranges_.coarsen(gap); }
   virtual ~LoadMap() {}
 
   SparseRange const &sparse_range() const { return ranges_; }
 
  private:
+  static bool filter(void *__capability cap, Range *range);
+
   SparseRange ranges_;
+  RangeVector batch_;
 };
 
 // Ranges with given permissions
@@ -101,17 +158,91 @@ class PermissionMap : public Map {
       : name_(name), addrsp_(addrsp), perms_(perms) {}
   virtual char const *name() const override { return name_; }
   virtual char const *address_space() const override { return addrsp_; }
-  virtual std::set<Range> const &ranges() const override { return ranges_.parts(); }
+  virtual RangeSet const &ranges() const override { return ranges_.parts(); }
   virtual bool try_combine(void *__capability cap) override;
+  virtual void try_combine_batch(void *__capability const *caps, size_t count) override;
+  virtual uint64_t coarsen(uint64_t gap) override { return ranges_.coarsen(gap); }
   virtual ~PermissionMap() {}
 
  private:
+  bool filter(void *__capability cap, Range *range) const;
+
   SparseRange ranges_;
+  RangeVector batch_;
   const char *const name_;
   const char *const addrsp_;
   const cheri_perms_t perms_;
 };
 
+// Ranges with any of several permission combinations, found in a single pass.
+//
+// This is equivalent to a `PermissionMap` for each combination, but each
+// capability's tag, seal and permissions are checked once, and a small cache
+// maps each permission mask directly to the set of matching combinations, so
+// the per-capability cost barely grows with the number of combinations.
+//
+// Each combination is a `submap()`, so `Mapper::print_json()` prints it as a
+// separate map. `ranges()` is their union.
+class PermissionComboMap : public Map {
+ public:
+  static size_t const kMaxCombinations = 64;
+
+  PermissionComboMap(const char *name, const char *addrsp) : name_(name), addrsp_(addrsp) {}
+  virtual char const *name() const override { return name_; }
+  virtual char const *address_space() const override { return addrsp_; }
+  virtual RangeSet const &ranges() const override { return union_.parts(); }
+  virtual bool try_combine(void *__capability cap) override;
+  virtual void try_combine_batch(void *__capability const *caps, size_t count) override;
+  // The union is coarsened too, but only bytes added to the combinations
+  // (which are what `Mapper::print_json()` prints) are counted.
+  virtual uint64_t coarsen(uint64_t gap) override;
+  virtual ~PermissionComboMap() {}
+
+  // Track capabilities with all of `perms`, printed as `name`. Returns false
+  // (adding nothing) if there are already `kMaxCombinations`. Add every
+  // combination before scanning; this invalidates references from `submap()`.
+  bool add(const char *name, cheri_perms_t perms);
+
+  virtual size_t submap_count() const override { return combinations_.size(); }
+  virtual Map const &submap(size_t i) const override { return combinations_[i]; }
+
+ private:
+  class Combination : public Map {
+   public:
+    Combination(const char *name, const char *addrsp, cheri_perms_t perms)
+        : name_(name), addrsp_(addrsp), perms_(perms) {}
+    virtual char const *name() const override { return name_; }
+    virtual char const *address_space() const override { return addrsp_; }
+    virtual RangeSet const &ranges() const override { return ranges_.parts(); }
+    virtual bool try_combine(void *__capability cap) override;
+
+    SparseRange ranges_;
+    RangeVector batch_;
+    const char *name_;
+    const char *addrsp_;
+    cheri_perms_t perms_;
+  };
+
+  // The combinations matched by a capability, as a bit for each, or 0 if it
+  // can't be tracked (e.g. because it is sealed).
+  uint64_t matches(void *__capability cap);
+
+  // A direct-mapped cache of `perms -> matching combinations`.
+  struct CacheEntry {
+    uint64_t perms;
+    uint64_t matches;
+    bool valid;
+  };
+  static size_t const kCacheSize = 64;
+  CacheEntry cache_[kCacheSize] = {};
+
+  ArenaVector<Combination> combinations_;
+  SparseRange union_;
+  RangeVector batch_;
+  const char *const name_;
+  const char *const addrsp_;
+};
+
 // Finds memory ranges which are available branch targets:
 //  - `BranchMap` tracks only addresses which can be branched to directly; it does not track
 //     possible PCC bounds after a branch
@@ -122,12 +253,44 @@ class BranchMap : public Map {
  public:
   virtual char const *name() const override { return "branch"; }
   virtual char const *address_space() const override { return "virtual memory"; }
-  virtual std::set<Range> const &ranges() const override { return ranges_.parts(); }
+  virtual RangeSet const &ranges() const override { return ranges_.parts(); }
   virtual bool try_combine(void *__capability cap) override;
+  virtual void try_combine_batch(void *__capability const *caps, size_t count) override;
+  virtual uint64_t coarsen(uint64_t gap) override { return ranges_.coarsen(gap); }
   virtual ~BranchMap() {}
 
  private:
+  static bool filter(void *__capability cap, Range *range);
+
   SparseRange ranges_;
+  RangeVector batch_;
+};
+
+// Finds the possible PCC bounds: the bounds of each executable capability,
+// including sentries.
+//
+// Differently-overlapping bounds grant different things, so `index()` keeps
+// each distinct range, and these are what `print_ranges_json()` writes.
+// `ranges()` is their union.
+class ExecuteMap : public Map {
+ public:
+  virtual char const *name() const override { return "execute"; }
+  virtual char const *address_space() const override { return "virtual memory"; }
+  virtual RangeSet const &ranges() const override { return union_.parts(); }
+  virtual void print_ranges_json(JsonWriter *out, char const *line_prefix) const override;
+  virtual RangeIndex const *distinct_ranges() const override { return &index_; }
+  virtual bool try_combine(void *__capability cap) override;
+  virtual void try_combine_batch(void *__capability const *caps, size_t count) override;
+  virtual ~ExecuteMap() {}
+
+  RangeIndex const &index() const { return index_; }
+
+ private:
+  static bool filter(void *__capability cap, Range *range);
+
+  RangeIndex index_;
+  SparseRange union_;
+  RangeVector batch_;
 };
 
 typedef bool (*poison_callback_t)(void *__capability cap);
@@ -140,8 +303,9 @@ class PoisonMap : public Map {
       : name_(name), addrsp_(addrsp), perms_(perms), poison_(poison), callback_(callback) {}
   virtual char const *name() const override { return name_; }
   virtual char const *address_space() const override { return addrsp_; }
-  virtual std::set<Range> const &ranges() const override { return ranges_.parts(); }
+  virtual RangeSet const &ranges() const override { return ranges_.parts(); }
   virtual bool try_combine(void *__capability cap) override;
+  virtual uint64_t coarsen(uint64_t gap) override { return ranges_.coarsen(gap); }
   virtual ~PoisonMap() {}
 
  private:
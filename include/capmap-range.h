@@ -4,15 +4,34 @@
 #ifndef CAPMAP_RANGE_H_
 #define CAPMAP_RANGE_H_
 
+#include "capmap-arena.h"
+
 #if __has_feature(capabilities)
 #include <cheriintrin.h>
 #else
-#error "capmap.h requires capabilities"
+#error "capmap-range.h requires capabilities"
 #endif
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
+#include <new>
 #include <set>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// SparseRange can store its parts either in a `std::set<Range>` (the default)
+// or in a `FlatRangeSet`. Define CAPMAP_FLAT_RANGE_SET to 1 to select the
+// latter. This affects the library's ABI, so the library and everything that
+// uses it must be built with the same setting.
+#ifndef CAPMAP_FLAT_RANGE_SET
+#define CAPMAP_FLAT_RANGE_SET 0
+#endif
 
 namespace capmap {
 
@@ -124,7 +143,148 @@ class Range {
   ptraddr_t last_;
 };
 
-void print_json(FILE *stream, std::set<Range> const &ranges, char const *line_prefix = "");
+// Scratch lists of ranges, allocated (like SparseRange parts) from the arena.
+typedef ArenaVector<Range> RangeVector;
+
+static_assert(std::is_trivially_copyable<Range>::value,
+              "FlatRangeSet relocates Ranges with memcpy");
+
+// A set of Ranges, ordered (and compared for equivalence) like `std::set<Range>`,
+// but stored as a sorted, contiguous array (allocated from the arena).
+//
+// This provides the subset of the `std::set` interface that SparseRange (and
+// its users) need. Look-ups are binary searches, and there is inline space for
+// a few parts, so the common small cases never allocate. Iterators are plain
+// pointers, and are invalidated by any modification.
+class FlatRangeSet {
+ public:
+  typedef Range value_type;
+  typedef Range const *iterator;
+  typedef Range const *const_iterator;
+
+  FlatRangeSet() {}
+  FlatRangeSet(FlatRangeSet const &other) { *this = other; }
+  FlatRangeSet(FlatRangeSet &&other) { *this = std::move(other); }
+  ~FlatRangeSet() { release(); }
+
+  FlatRangeSet &operator=(FlatRangeSet const &other) {
+    if (this != &other) {
+      size_ = 0;
+      reserve(other.size_);
+      memcpy(data_, other.data_, other.size_ * sizeof(Range));
+      size_ = other.size_;
+    }
+    return *this;
+  }
+
+  FlatRangeSet &operator=(FlatRangeSet &&other) {
+    if (this == &other) return *this;
+    if (other.data_ == other.inline_) {
+      *this = static_cast<FlatRangeSet const &>(other);
+    } else {
+      release();
+      data_ = other.data_;
+      size_ = other.size_;
+      capacity_ = other.capacity_;
+      other.data_ = other.inline_;
+      other.capacity_ = kInlineParts;
+    }
+    other.size_ = 0;
+    return *this;
+  }
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+  const_iterator begin() const { return data_; }
+  const_iterator end() const { return data_ + size_; }
+
+  // The first range that does not compare less than `range`.
+  const_iterator lower_bound(Range range) const { return std::lower_bound(begin(), end(), range); }
+
+  const_iterator find(Range range) const {
+    auto it = lower_bound(range);
+    return ((it != end()) && !(range < *it)) ? it : end();
+  }
+  size_t count(Range range) const { return (find(range) == end()) ? 0 : 1; }
+
+  std::pair<iterator, bool> insert(Range range) {
+    auto it = lower_bound(range);
+    if ((it != end()) && !(range < *it)) return std::make_pair(it, false);
+    return std::make_pair(insert_at(it - begin(), range), true);
+  }
+
+  // As `insert(range)`, but constant-time if `range` belongs just before `hint`.
+  iterator insert(const_iterator hint, Range range) {
+    bool fits_before = (hint == end()) || (range < *hint);
+    bool fits_after = (hint == begin()) || (*(hint - 1) < range);
+    if (fits_before && fits_after) return insert_at(hint - begin(), range);
+    return insert(range).first;
+  }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    size_t index = first - begin();
+    size_t count = last - first;
+    memmove(data_ + index, data_ + index + count, (size_ - index - count) * sizeof(Range));
+    size_ -= count;
+    return data_ + index;
+  }
+  iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+  void clear() { size_ = 0; }
+
+  void reserve(size_t capacity) {
+    if (capacity <= capacity_) return;
+    if (capacity > SIZE_MAX / sizeof(Range)) throw std::bad_alloc();
+    void *data_bytes = Arena::get().allocate(capacity * sizeof(Range), alignof(Range));
+    Range *data = static_cast<Range *>(data_bytes);
+    memcpy(data, data_, size_ * sizeof(Range));
+    release();
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  // Merge the sorted, disjoint, non-adjacent ranges in [first,last) into this
+  // set, coalescing any that overlap or are adjacent (as SparseRange requires).
+  //
+  // This assumes that the existing parts are also disjoint and non-adjacent.
+  // The merge is done in place, in time linear in the total number of parts.
+  void unite(const_iterator first, const_iterator last);
+
+  bool operator==(FlatRangeSet const &other) const {
+    return (size_ == other.size_) && std::equal(begin(), end(), other.begin());
+  }
+  bool operator!=(FlatRangeSet const &other) const { return !(operator==(other)); }
+
+ private:
+  static size_t const kInlineParts = 4;
+
+  iterator insert_at(size_t index, Range range) {
+    if (size_ == capacity_) reserve(capacity_ * 2);
+    memmove(data_ + index + 1, data_ + index, (size_ - index) * sizeof(Range));
+    data_[index] = range;
+    size_++;
+    return data_ + index;
+  }
+
+  void release() {
+    if (data_ != inline_) Arena::get().deallocate(data_, capacity_ * sizeof(Range), alignof(Range));
+    data_ = inline_;
+    capacity_ = kInlineParts;
+  }
+
+  Range inline_[kInlineParts];
+  Range *data_ = inline_;
+  size_t size_ = 0;
+  size_t capacity_ = kInlineParts;
+};
+
+#if CAPMAP_FLAT_RANGE_SET
+typedef FlatRangeSet RangeSet;
+#else
+typedef std::set<Range, std::less<Range>, ArenaAllocator<Range>> RangeSet;
+#endif
+
+void print_json(FILE *stream, RangeSet const &ranges, char const *line_prefix = "");
 
 // Zero or more non-empty, non-overlapping, non-adjacent ranges, sorted by
 // address.
@@ -143,26 +303,81 @@ class SparseRange {
   void combine(Range range);
   void remove(Range range);
 
-  void combine(SparseRange ranges) {
-    for (auto range : ranges.parts()) combine(range);
-  }
-  void remove(SparseRange ranges) { remove(ranges.parts()); }
-  void remove(std::set<Range> const &ranges) {
+  void combine(SparseRange const &ranges) { unite(ranges); }
+  // Combine every range in `*ranges`, in any order. The vector is used as
+  // scratch space: it is sorted and coalesced in place, so that the result can
+  // be merged in a single pass.
+  void combine_all(RangeVector *ranges);
+
+  void remove(SparseRange const &ranges) { subtract(ranges); }
+  void remove(RangeSet const &ranges) {
     for (auto range : ranges) remove(range);
   }
 
+  // Bulk set operations with another SparseRange.
+  //
+  // Each is a single merge sweep over both sets, building the result in a new
+  // set (which is then moved into place), so the cost is linear in the total
+  // number of parts. If `other` has only a few parts compared to this set,
+  // they are applied one at a time instead, which is cheaper.
+  void unite(SparseRange const &other);
+  void unite(SparseRange &&other);
+  void subtract(SparseRange const &other);
+  void intersect(SparseRange const &other);
+  // Intersect with a single range, dropping (or trimming) parts outside it.
+  void clip(Range range);
+
+  // Merge parts separated by gaps of fewer than `gap` bytes, so that the set
+  // has fewer parts, but also includes the gaps. Returns the number of bytes
+  // that were added this way.
+  uint64_t coarsen(uint64_t gap);
+
   bool overlaps(Range other) const;
   bool includes(Range other) const;
   bool includes(ptraddr_t addr) const { return includes(Range::from_base_last(addr, addr)); }
 
-  bool includes(SparseRange other) const {
+  bool includes(SparseRange const &other) const {
     for (auto range : other.parts()) {
       if (!includes(range)) return false;
     }
     return true;
   }
 
-  std::set<Range> const &parts() const { return ranges_; }
+  RangeSet const &parts() const { return ranges_; }
+
+  // A forward-only position in a SparseRange, for callers that walk through
+  // addresses in increasing order.
+  //
+  // Each query advances the cursor to the part containing (or following) its
+  // address, so a walk costs amortised constant time per part, rather than a
+  // look-up per address. Addresses must not decrease between queries. The
+  // cursor is invalidated by any modification to the SparseRange.
+  class Cursor {
+   public:
+    explicit Cursor(SparseRange const &sr) : parts_(&sr.parts()), part_(sr.parts().begin()) {}
+
+    // The part that includes `addr`, or nullptr.
+    Range const *seek(ptraddr_t addr);
+    bool includes(ptraddr_t addr) { return seek(addr) != nullptr; }
+
+    // The first included address at or after `addr`, if there is one.
+    std::pair<bool, ptraddr_t> next_included(ptraddr_t addr);
+    // The first excluded address at or after `addr`, if there is one.
+    std::pair<bool, ptraddr_t> next_excluded(ptraddr_t addr);
+
+   private:
+    // After this many single steps, fall back to a look-up.
+    static int const kMaxSteps = 4;
+
+    RangeSet const *parts_;
+    RangeSet::const_iterator part_;
+  };
+  Cursor cursor() const { return Cursor(*this); }
+
+  // The number of (non-empty) ranges combined into, or removed from, this set
+  // so far. These are for statistics, and are not compared by `operator==`.
+  uint64_t combine_count() const { return combines_; }
+  uint64_t remove_count() const { return removes_; }
 
   bool operator==(const SparseRange &other) const { return ranges_ == other.ranges_; }
   bool operator!=(const SparseRange &other) const { return !(operator==(other)); }
@@ -172,7 +387,167 @@ class SparseRange {
   }
 
  private:
-  std::set<Range> ranges_;
+  // Overwrite the part at `it` with `range`. Parts are ordered by `last()`
+  // alone, so this is safe as long as `range` still belongs in the same place.
+  // It never allocates, so it can't fail part way through an update.
+  static void replace_part(RangeSet::const_iterator it, Range range) {
+    *const_cast<Range *>(&*it) = range;
+  }
+
+  // True if `other` is small enough that per-part updates beat a sweep.
+  bool prefer_per_part(SparseRange const &other) const {
+    return other.ranges_.size() * kPerPartRatio < ranges_.size();
+  }
+  static size_t const kPerPartRatio = 16;
+
+  RangeSet ranges_;
+  uint64_t combines_ = 0;
+  uint64_t removes_ = 0;
+};
+
+// The set of ranges that a scan may examine: some included ranges, minus some
+// excluded ones.
+//
+// This is precompiled so that the scanner can clip each capability that it
+// finds without repeating the set algebra on `include` and `exclude`. Callers
+// must `rebuild()` the filter whenever either of those changes.
+class ScanFilter {
+ public:
+  void rebuild(SparseRange const &include, SparseRange const &exclude) {
+    ranges_ = include;
+    ranges_.subtract(exclude);
+  }
+
+  // Append to `*out` each part of `range` that passes the filter, but is not in
+  // `done`, in address order.
+  //
+  // This does not allocate, except to grow `*out`.
+  void clip(Range range, SparseRange const &done, RangeVector *out) const;
+
+  SparseRange const &ranges() const { return ranges_; }
+
+ private:
+  SparseRange ranges_;
+};
+
+// Zero or more distinct ranges, which may overlap, ordered by base (and then
+// by last).
+//
+// Unlike SparseRange, this keeps each range as it was inserted, so it can
+// answer questions like "which capability bounds contain this address" (a
+// stabbing query). Identical ranges are stored once, so memory use scales with
+// the number of distinct ranges, not with the number of insertions.
+//
+// Insertions are buffered, and sorted into the index in amortised batches. Any
+// query (including iteration) may do this, so queries are not thread-safe,
+// even though they are `const`. Iterators are plain pointers, and are
+// invalidated by any insertion.
+class RangeIndex {
+ public:
+  typedef Range const *const_iterator;
+
+  void insert(Range range) {
+    if (range.is_empty()) return;
+    inserts_++;
+    pending_.push_back(range);
+    if ((pending_.size() >= kMinPending) && (pending_.size() >= sorted_.size())) settle();
+  }
+  void clear() {
+    sorted_.clear();
+    max_last_.clear();
+    tops_.clear();
+    pending_.clear();
+  }
+
+  bool is_empty() const { return sorted_.empty() && pending_.empty(); }
+  // The number of distinct ranges.
+  size_t size() const {
+    settle();
+    return sorted_.size();
+  }
+  // The number of (non-empty) ranges inserted, including duplicates.
+  uint64_t insert_count() const { return inserts_; }
+
+  const_iterator begin() const {
+    settle();
+    return sorted_.data();
+  }
+  const_iterator end() const {
+    settle();
+    return sorted_.data() + sorted_.size();
+  }
+
+  // Call `fn(Range)` for each range that includes `addr`, in no particular
+  // order.
+  template <typename F>
+  void for_each_containing(ptraddr_t addr, F fn) const {
+    for_each_overlapping(Range::from_base_last(addr, addr), fn);
+  }
+
+  // Call `fn(Range)` for each range that overlaps `range`, in no particular
+  // order. This takes O(log n + k) time, for k results.
+  template <typename F>
+  void for_each_overlapping(Range range, F fn) const {
+    if (range.is_empty()) return;
+    settle();
+    // Only ranges starting at or before `range.last()` can overlap it.
+    auto by_base = [](ptraddr_t addr, Range const &r) { return addr < r.base(); };
+    size_t end = std::upper_bound(sorted_.begin(), sorted_.end(), range.last(), by_base) -
+                 sorted_.begin();
+    visit(1, 0, sorted_.size(), end, range.base(), fn);
+  }
+
+  size_t count_containing(ptraddr_t addr) const {
+    size_t count = 0;
+    for_each_containing(addr, [&](Range) { count++; });
+    return count;
+  }
+  // This takes O(log n) time.
+  bool overlaps(Range range) const;
+
+  // The greatest `last()` of the first i + 1 ranges, for each i, parallel to
+  // `begin()`. A range overlaps one of the first i + 1 only if it ends at or
+  // after this, so `RangeView` stores it with overlapping ranges too.
+  ptraddr_t const *max_last() const {
+    settle();
+    return max_last_.data();
+  }
+
+ private:
+  static size_t const kMinPending = 64;
+  static size_t const kNoRange = SIZE_MAX;
+
+  // Merge `pending_` into `sorted_`, and rebuild `max_last_` and `tops_`.
+  void settle() const;
+  void build(size_t node, size_t lo, size_t hi, ArenaVector<char> *taken) const;
+
+  // Report the ranges under `node` (covering `sorted_[lo..hi)`) that start
+  // before `sorted_[end]` and end at or after `base`.
+  template <typename F>
+  void visit(size_t node, size_t lo, size_t hi, size_t end, ptraddr_t base, F &fn) const {
+    if (lo >= end) return;
+    size_t top = tops_[node];
+    // Nothing else under `node` ends later than `top`.
+    if ((top == kNoRange) || (sorted_[top].last() < base)) return;
+    if (top < end) fn(sorted_[top]);
+    if (hi - lo < 2) return;
+    size_t mid = lo + (hi - lo) / 2;
+    visit(2 * node, lo, mid, end, base, fn);
+    visit(2 * node + 1, mid, hi, end, base, fn);
+  }
+
+  mutable RangeVector sorted_;
+  // `max_last_[i]` is the greatest `last()` of `sorted_[0..i]`.
+  mutable ArenaVector<ptraddr_t> max_last_;
+  // A priority search tree over `sorted_`: node 1 covers every range, and node
+  // n's children, 2n and 2n + 1, split its ranges in half by position. Each
+  // node holds the index of the range that ends last of those it covers (other
+  // than those held by its ancestors), or `kNoRange`. A query stops at any
+  // node whose range ends too early, or that starts too late, so it visits
+  // O(log n) nodes that report nothing.
+  mutable ArenaVector<size_t> tops_;
+  mutable RangeVector pending_;
+  uint64_t inserts_ = 0;
 };
 
 }  // namespace capmap
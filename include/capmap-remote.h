@@ -0,0 +1,88 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_REMOTE_H_
+#define CAPMAP_REMOTE_H_
+
+#include "capmap-arena.h"
+#include "capmap-vmmap.h"
+#include "capmap.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <utility>
+
+namespace capmap {
+
+// Another process, attached through `ptrace(2)` so that it can be mapped from
+// outside.
+//
+// The target is stopped while it is attached, so the scan sees a consistent
+// image, and the analysis runs in a separate process, which may use more
+// memory (and time) than the target could spare. Nothing needs to be linked
+// into the target.
+//
+// Memory is read together with its tags, many granules per system call
+// (`PIOD_READ_CHERI_CAP`). The capabilities found are rebuilt in the analysis
+// process, from DDC, so that the usual maps can inspect their bounds and
+// permissions. They refer to the target's address space, and are never
+// dereferenced. Rebuilding needs a DDC that covers the address space, so this
+// is only supported in hybrid builds. Sealed capabilities (other than sentries)
+// cannot be rebuilt, and are counted as rejected.
+class RemoteTarget {
+ public:
+  explicit RemoteTarget(pid_t pid) : pid_(pid), vmmap_(pid) {}
+  RemoteTarget(RemoteTarget const &) = delete;
+  RemoteTarget &operator=(RemoteTarget const &) = delete;
+  ~RemoteTarget() { detach(); }
+
+  // True if this build can scan other processes.
+  static bool supported();
+
+  // Attach to (and stop) the target, and read its memory map. Returns false on
+  // failure, e.g. without permission to debug the target.
+  bool attach();
+  // Let the target continue. This is implied by destruction.
+  void detach();
+  bool attached() const { return attached_; }
+
+  pid_t pid() const { return pid_; }
+  VmMap const &vmmap() const { return vmmap_; }
+
+  // The target's mappings from which capabilities can be loaded, suitable as a
+  // `Mapper` include set.
+  SparseRange ranges() const { return vmmap_.ranges(); }
+
+  // Read `count` granules from `addr` (which must be capability-aligned), and
+  // set each of `caps` to the rebuilt capability, or to null if the granule
+  // was not tagged. Sealed capabilities that cannot be rebuilt are also null,
+  // and are counted in `*sealed`. Returns false if the memory can't be read.
+  bool read_caps(ptraddr_t addr, size_t count, void *__capability *caps, uint64_t *sealed);
+
+  // Append the (tagged) capability registers of every thread of the target.
+  bool read_roots(ArenaVector<std::pair<char const *, void *__capability>> *roots);
+
+  // The number of granules read by each `PIOD_READ_CHERI_CAP` request during
+  // `scan_remote()`.
+  static size_t const kReadGranules = 4096;
+
+ private:
+  pid_t pid_;
+  VmMap vmmap_;
+  bool attached_ = false;
+  // Scratch space for `read_caps()`.
+  ArenaVector<unsigned char> records_;
+};
+
+// Scan `target` (which must be attached) from the capability registers of all
+// of its threads, and incorporate the result into `*mapper`, whose include set
+// should normally be `target->ranges()`. Returns false if the target's
+// registers could not be read. Memory that can't be read is skipped, and
+// counted in `ScanStats::unreadable`.
+//
+// The scan is single-threaded, whatever `mapper->threads()` says.
+bool scan_remote(Mapper *mapper, RemoteTarget *target);
+
+}  // namespace capmap
+#endif
@@ -0,0 +1,42 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_ROOTS_H_
+#define CAPMAP_ROOTS_H_
+
+#include "capmap.h"
+
+#include <stddef.h>
+
+namespace capmap {
+
+// Sources of memory roots, for `discover_roots()`.
+enum RootSource : unsigned {
+  // The writable PT_LOAD segments of every loaded object (from
+  // `dl_iterate_phdr()`), named after the object.
+  kRootGlobals = 1u << 0,
+  // The calling thread's TLS block for every loaded object that has one.
+  kRootTls = 1u << 1,
+  // Stack mappings (from `VmMap::process()`) from which capabilities can be
+  // loaded.
+  kRootStacks = 1u << 2,
+
+  kRootAll = kRootGlobals | kRootTls | kRootStacks,
+};
+
+// Append a root to `*roots` for each region found from `sources`, and return
+// the number appended.
+//
+// Each root is a capability bounded to its region, derived from the best
+// available authority: DDC in hybrid, and in purecap, the capabilities that
+// the run-time linker provides (for globals and TLS) or the caller's stack
+// capability (for the caller's stack). Regions without a suitable authority,
+// such as other threads' stacks in purecap, are skipped.
+//
+// Register roots are not included; combine these with `get_roots()` to cover
+// the calling thread completely. Pass the result to `Mapper::scan(RootList)`,
+// which scans the batch in address order.
+size_t discover_roots(RootList *roots, unsigned sources = kRootAll);
+
+}  // namespace capmap
+#endif
@@ -0,0 +1,90 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_SAMPLE_H_
+#define CAPMAP_SAMPLE_H_
+
+#include "capmap-arena.h"
+#include "capmap-json.h"
+#include "capmap-range.h"
+#include "capmap.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace capmap {
+
+// An estimated count, with a 95% confidence interval.
+struct Estimate {
+  uint64_t value;
+  uint64_t low;
+  uint64_t high;
+};
+
+// What a sampled scan suggests an exact scan would find in one map.
+struct MapEstimate {
+  char const *name;
+  char const *address_space;
+  // The bytes in the map. Everything in it is reachable, so this is a lower
+  // bound on what an exact scan would find.
+  uint64_t bytes;
+  // Granules in scanned pages that overlap the map, how many of them were
+  // examined, and how many of those held a valid capability.
+  uint64_t population;
+  uint64_t examined;
+  uint64_t tagged;
+  // The number of valid capabilities in `population`, and the same as a
+  // density, in capabilities per million granules.
+  Estimate capabilities;
+  Estimate density_ppm;
+};
+
+// Estimates extrapolated from a sampled scan (see
+// `Mapper::set_sample_interval()`).
+//
+// Each scanned page is a stratum, sampled systematically, so the density of
+// capabilities in the examined granules estimates their density in the whole
+// page. Pages are pooled for each map, and the confidence interval is Wilson's
+// score interval for that proportion (treating the sample as random), scaled
+// to the sampled population. Pages examined in full are counted exactly.
+//
+// Estimates cover only the memory that the sampled scan reached. Capabilities
+// missed by sampling may lead to memory that it never saw, so the map sizes
+// are only lower bounds. Where the estimated density is high, scanning exactly
+// (for example with `Mapper::set_exact_ranges(dense_ranges(...))`) is the most
+// likely to find more.
+class SampleEstimate {
+ public:
+  SampleEstimate() {}
+
+  // Estimate from the scans performed by `mapper` so far, replacing any
+  // earlier result.
+  void compute(Mapper const &mapper);
+
+  // The whole sampled population, named "scanned".
+  MapEstimate const &total() const { return total_; }
+  // `Mapper::load_cap_map()`, then each user map.
+  ArenaVector<MapEstimate> const &maps() const { return maps_; }
+
+  // The sampled pages (or parts of pages) in which the observed density is at
+  // least `density_ppm` capabilities per million granules. Pages in which
+  // nothing was examined are never included.
+  SparseRange dense_ranges(uint64_t density_ppm) const;
+
+  void print_json(FILE *stream) const;
+  void print_json(JsonWriter *out) const;
+
+ private:
+  // Estimate for the samples that overlap `ranges` (or all samples, if
+  // `ranges` is nullptr).
+  MapEstimate estimate(char const *name, char const *address_space, RangeSet const *ranges) const;
+
+  uint64_t interval_ = 1;
+  // The mapper's samples, sorted by address.
+  ArenaVector<SampleRecord> samples_;
+  MapEstimate total_ = MapEstimate();
+  ArenaVector<MapEstimate> maps_;
+};
+
+}  // namespace capmap
+#endif
@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_SNAPSHOT_H_
+#define CAPMAP_SNAPSHOT_H_
+
+#include "capmap.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+
+namespace capmap {
+
+// Scan a copy-on-write snapshot of the process, in a forked child.
+//
+// `start()` forks, and the child scans the given roots with a `Mapper`, then
+// streams its `print_json()` output back through a pipe. The parent continues
+// as soon as the fork returns, so its pause is only the cost of the fork, and
+// the child sees a consistent image however long the traversal takes. CheriBSD
+// preserves tags across copy-on-write fork, so the child's capabilities are as
+// valid as the parent's.
+//
+// Only the forking thread exists in the child; other threads' stacks and
+// registers are frozen as they were, so registers other than the caller's are
+// not roots. Configure the `Mapper` (maps, include ranges, and so on) before
+// calling `start()`; the parent's copy is never used to scan.
+//
+// The child blocks once the pipe is full, so call `finish()` (or read from
+// `fd()`) promptly.
+class ForkedScan {
+ public:
+  ForkedScan() {}
+  ForkedScan(ForkedScan const &) = delete;
+  ForkedScan &operator=(ForkedScan const &) = delete;
+  // If the scan is still running, this kills the child, and waits for it.
+  ~ForkedScan();
+
+  // Fork, and scan `roots` (typically from `get_roots()`, just before this
+  // call) or `cap` in the child. Returns false if the fork failed, or a scan is
+  // already in progress.
+  bool start(Mapper *mapper, Roots const &roots);
+  bool start(Mapper *mapper, void *__capability cap, char const *name);
+  // As above, but scan a batch of roots, for example from `discover_roots()`
+  // and `ThreadCapture::append_roots()`. Stopped threads can be released as
+  // soon as this returns.
+  bool start(Mapper *mapper, RootList const &roots);
+
+  // Copy the child's output to `out`, then wait for it to exit. Returns true if
+  // the child completed its scan and all of its output was copied.
+  bool finish(FILE *out);
+
+  // The read end of the pipe, for use with `poll()`, or -1.
+  int fd() const { return fd_; }
+  pid_t pid() const { return pid_; }
+
+ private:
+  bool spawn(Mapper *mapper, Roots const *roots, RootList const *batch, void *__capability cap,
+             char const *name);
+  bool reap();
+
+  int fd_ = -1;
+  pid_t pid_ = -1;
+};
+
+// Shorthand for creating a new Mapper, and scanning all roots from
+// `get_roots()` in a forked snapshot, then copying the JSON to `stream`.
+bool snapshot_scan_and_print_json(FILE *stream);
+
+}  // namespace capmap
+#endif
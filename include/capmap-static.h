@@ -0,0 +1,153 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_STATIC_H_
+#define CAPMAP_STATIC_H_
+
+#include "capmap.h"
+
+#if __has_feature(capabilities)
+#include <cheriintrin.h>
+#else
+#error "capmap-static.h requires capabilities"
+#endif
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace capmap {
+
+// A `Mapper` with a fixed set of maps, known at compile time.
+//
+// The maps are held by value, and called without virtual dispatch: maps that
+// override `Map::try_combine_batch()` get one direct call per batch, and the
+// other maps' `try_combine()` calls are fused into a single loop over the
+// batch, which the compiler can inline if they are defined in a header. The
+// engine itself is specialised for `kPolicy` (a combination of `ScanPolicy`
+// flags).
+//
+// Maps added through `maps()` still work, as for `Mapper`. The output of
+// `print_json()` lists the static maps first, in order, then dynamic ones.
+//
+// For example:
+//
+//   BasicStaticMapper<kScanPolicyNone, LoadMap, BranchMap> mapper;
+//   mapper.scan(get_roots());
+//   mapper.map<1>().ranges();  // The BranchMap.
+template <unsigned kPolicy, typename... Maps>
+class BasicStaticMapper : public Mapper {
+ public:
+  // Maps that are not default-constructible (such as `PermissionMap`) must be
+  // passed in, e.g. as `std::make_tuple(LoadMap(), PermissionMap(...))`.
+  BasicStaticMapper() {}
+  explicit BasicStaticMapper(std::tuple<Maps...> maps) : maps_(std::move(maps)) {}
+  BasicStaticMapper(SparseRange include, std::tuple<Maps...> maps)
+      : Mapper(include), maps_(std::move(maps)) {}
+
+  template <size_t I>
+  typename std::tuple_element<I, std::tuple<Maps...>>::type &map() {
+    return std::get<I>(maps_);
+  }
+  template <size_t I>
+  typename std::tuple_element<I, std::tuple<Maps...>>::type const &map() const {
+    return std::get<I>(maps_);
+  }
+
+  virtual ~BasicStaticMapper() {}
+
+ protected:
+  // A depth limit can only be enforced with depth tracking, so it overrides
+  // `kPolicy`.
+  virtual void drain() override {
+    if (depth_limited()) return drain_with<kPolicy | kScanTrackDepth>();
+    drain_with<kPolicy>();
+  }
+  virtual bool resume(StepBudget const &budget) override {
+    if (depth_limited()) return resume_with<kPolicy | kScanTrackDepth>(budget);
+    return resume_with<kPolicy>(budget);
+  }
+
+  virtual void combine_maps(void *__capability const *caps, size_t count) override {
+    combine_static(caps, count, std::index_sequence_for<Maps...>());
+    Mapper::combine_maps(caps, count);
+  }
+
+  virtual size_t user_map_count() const override {
+    return sizeof...(Maps) + Mapper::user_map_count();
+  }
+
+  virtual Map const &user_map(size_t i) const override {
+    if (i >= sizeof...(Maps)) return Mapper::user_map(i - sizeof...(Maps));
+    return static_map(i, std::index_sequence_for<Maps...>());
+  }
+
+ private:
+  static_assert(kPolicy <= (kScanTrackDepth | kScanLog), "Unknown ScanPolicy flags");
+
+  template <size_t I>
+  using MapType = typename std::tuple_element<I, std::tuple<Maps...>>::type;
+
+  // True if `M` provides its own `try_combine_batch()`.
+  template <typename M>
+  using HasBatch =
+      std::integral_constant<bool, !std::is_same<decltype(&M::try_combine_batch),
+                                                 decltype(&Map::try_combine_batch)>::value>;
+
+  // True if any map lacks `try_combine_batch()`.
+  static constexpr bool kAnyUnbatched = !std::is_same<
+      std::integer_sequence<bool, HasBatch<Maps>::value..., true>,
+      std::integer_sequence<bool, true, HasBatch<Maps>::value...>>::value;
+
+  // Maps with their own `try_combine_batch()` are given the whole batch.
+  template <typename M>
+  static void combine_batch(M &map, void *__capability const *caps, size_t count,
+                            std::true_type /* has batch */) {
+    map.M::try_combine_batch(caps, count);
+  }
+
+  template <typename M>
+  static void combine_batch(M &, void *__capability const *, size_t,
+                            std::false_type /* has batch */) {}
+
+  // The others are called for one capability at a time.
+  template <typename M>
+  static void combine_each(M &, void *__capability, std::true_type /* has batch */) {}
+
+  template <typename M>
+  static void combine_each(M &map, void *__capability cap, std::false_type /* has batch */) {
+    map.M::try_combine(cap);
+  }
+
+  template <size_t... I>
+  void combine_static(void *__capability const *caps, size_t count, std::index_sequence<I...>) {
+    int batches[] = {0, (combine_batch(std::get<I>(maps_), caps, count, HasBatch<MapType<I>>()),
+                         0)...};
+    (void)batches;
+    if (!kAnyUnbatched) return;
+    // Fuse the unbatched maps into a single pass over the batch, so that each
+    // capability is loaded once, and checks that the maps share (such as the
+    // tag) can be combined by the compiler.
+    for (size_t c = 0; c < count; c++) {
+      int each[] = {0, (combine_each(std::get<I>(maps_), caps[c], HasBatch<MapType<I>>()), 0)...};
+      (void)each;
+    }
+  }
+
+  template <size_t... I>
+  Map const &static_map(size_t i, std::index_sequence<I...>) const {
+    Map const *const all[] = {&std::get<I>(maps_)..., nullptr};
+    return *all[i];
+  }
+
+  std::tuple<Maps...> maps_;
+};
+
+template <typename... Maps>
+using StaticMapper = BasicStaticMapper<kScanPolicyDefault, Maps...>;
+
+}  // namespace capmap
+#endif
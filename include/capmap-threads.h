@@ -0,0 +1,112 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_THREADS_H_
+#define CAPMAP_THREADS_H_
+
+#include "capmap-arena.h"
+#include "capmap-vmmap.h"
+#include "capmap.h"
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace capmap {
+
+// The roots captured from one stopped thread.
+struct ThreadRoots {
+  // The kernel's thread ID.
+  long tid;
+  // True if the thread was stopped, and the capabilities below are valid.
+  bool captured;
+  // The signal context, holding every register that the thread had when it
+  // was stopped (including caller-saved ones), as spilled by the kernel.
+  void *__capability context;
+  // The live part of the thread's stack, from the signal handler's frame to
+  // the top of the stack mapping. This includes the signal context.
+  void *__capability stack;
+  char context_name[32];
+  char stack_name[32];
+};
+
+// Stop every other thread in the process, and capture its registers and stack.
+//
+// `stop()` signals all threads at once, and each one records its roots from
+// its own signal handler, then waits until `release()`. The registers are
+// found in the signal context that the kernel spills onto the thread's stack,
+// so nothing needs to know the layout of that context. Roots are kept in an
+// array allocated (from the arena) by the constructor, so the signal handlers
+// never allocate.
+//
+// For a consistent snapshot without a long pause, call `release()` as soon as
+// a `ForkedScan` has started; the child sees the stopped threads' stacks as
+// they were. Otherwise, scan with the threads stopped, then call `release()`.
+//
+// Stopped threads might hold locks, so don't stop threads that might be using
+// capmap (for example, scanning from another `Mapper`). `signal` is reserved:
+// the handler is installed on the first `stop()`, and never removed, so that
+// late signals (from timed-out threads) are harmless.
+class ThreadCapture {
+ public:
+  explicit ThreadCapture(size_t max_threads = 256, int signal = SIGUSR2);
+  ThreadCapture(ThreadCapture const &) = delete;
+  ThreadCapture &operator=(ThreadCapture const &) = delete;
+  // Release any stopped threads.
+  ~ThreadCapture();
+
+  // Stop and capture every other thread (up to `max_threads`), waiting no
+  // longer than `timeout_ns` for them all to respond. Threads that don't
+  // respond in time (e.g. because they block `signal`) are left running, and
+  // not `captured`. Returns false if threads could not be listed, or a capture
+  // (from any ThreadCapture) is already in progress.
+  bool stop(uint64_t timeout_ns = 100 * 1000 * 1000);
+
+  // Let the stopped threads continue.
+  void release();
+
+  // One entry for each thread found by the last `stop()`, other than the
+  // caller.
+  ArenaVector<ThreadRoots> const &threads() const { return threads_; }
+  size_t captured() const { return captured_; }
+
+  // Append each captured thread's context and stack to `*roots`. The calling
+  // thread is not included; use `get_roots()` and `discover_roots()` for it.
+  void append_roots(RootList *roots) const;
+
+  // The time from the first signal until every thread had been captured (or
+  // the timeout expired): the stop-the-world latency.
+  uint64_t pause_ns() const { return pause_ns_; }
+  // The time from the first signal until `release()`.
+  uint64_t stopped_ns() const { return stopped_ns_; }
+
+ private:
+  static void handle(int signal, siginfo_t *info, void *context);
+  void capture(ThreadRoots *thread, void *context);
+
+  int signal_;
+  size_t max_threads_;
+  ArenaVector<ThreadRoots> threads_;
+  // Space for the kernel's thread list.
+  void *procs_ = nullptr;
+  size_t procs_size_ = 0;
+  VmMap vmmap_;
+  // The pipe that stopped threads wait on; `release()` writes a byte for each.
+  int wait_fds_[2] = {-1, -1};
+  size_t captured_ = 0;
+  bool stopped_ = false;
+  uint64_t start_ticks_ = 0;
+  uint64_t pause_ns_ = 0;
+  uint64_t stopped_ns_ = 0;
+
+  // Updated by the signal handlers.
+  std::atomic<bool> accepting_{false};
+  std::atomic<size_t> responded_{0};
+  // Captured threads that have not yet returned from their handlers.
+  std::atomic<size_t> waiting_{0};
+};
+
+}  // namespace capmap
+#endif
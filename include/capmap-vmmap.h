@@ -0,0 +1,108 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_VMMAP_H_
+#define CAPMAP_VMMAP_H_
+
+#include "capmap-arena.h"
+#include "capmap-range.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace capmap {
+
+// Properties of a process mapping, derived from the kernel's description.
+//
+// Each entry has exactly one of the role flags (stack, heap, text, data, guard
+// or other), and one of the backing flags (anonymous or file).
+enum VmKind : unsigned {
+  // Stacks (mappings that grow down), including thread stacks.
+  kVmStack = 1u << 0,
+  // Other anonymous, accessible memory. This includes malloc heaps, but also
+  // zero-initialised library data and private `mmap()` regions.
+  kVmHeap = 1u << 1,
+  // File-backed, executable mappings (e.g. shared-library text).
+  kVmText = 1u << 2,
+  // File-backed, non-executable mappings (e.g. shared-library data).
+  kVmData = 1u << 3,
+  // Guard pages, and any other inaccessible mapping.
+  kVmGuard = 1u << 4,
+  // Device, physical or otherwise unclassified mappings.
+  kVmOther = 1u << 5,
+
+  kVmAnonymous = 1u << 8,
+  kVmFile = 1u << 9,
+
+  kVmAnyRole = kVmStack | kVmHeap | kVmText | kVmData | kVmGuard | kVmOther,
+};
+
+struct VmEntry {
+  Range range;
+  // KVME_PROT_* flags.
+  int protection;
+  // VmKind flags.
+  unsigned kinds;
+  // The backing file, if known, or "".
+  char const *path;
+
+  bool can_load_caps() const;
+};
+
+// A cached snapshot of a process's memory map.
+//
+// Querying the kernel for the full map is relatively expensive, so this keeps
+// the last result. `refresh_if_changed()` only re-reads it if the total size of
+// the process's mappings has changed, which the kernel reports without walking
+// the map. This is a heuristic: changes that keep the total the same, such as
+// `mprotect()` or replacing one mapping with another of the same size, are only
+// seen after `refresh()`.
+class VmMap {
+ public:
+  // An empty map for `pid` (the current process by default). Call `refresh()`
+  // to populate it.
+  explicit VmMap(pid_t pid = 0) : pid_(pid) {}
+
+  // The current process's map is cached, and shared by every default-constructed
+  // `Mapper`. These refresh it (if it has changed) and return a copy of it, or
+  // of `ranges(kinds, load_caps_only)`.
+  static VmMap process();
+  static SparseRange process_ranges(unsigned kinds = kVmAnyRole, bool load_caps_only = true);
+
+  // Re-read the map from the kernel. Returns false (leaving the map empty) on
+  // failure.
+  bool refresh();
+  // As `refresh()`, but only if the kernel's map appears to have changed since
+  // the last refresh. Returns true if the map was re-read.
+  bool refresh_if_changed();
+
+  VmMap(VmMap const &other) { *this = other; }
+  VmMap &operator=(VmMap const &other);
+
+  ArenaVector<VmEntry> const &entries() const { return entries_; }
+
+  // The number of times that the map has been read from the kernel.
+  uint64_t generation() const { return generation_; }
+
+  // Return the entry containing `addr`, or nullptr.
+  VmEntry const *find(ptraddr_t addr) const;
+
+  // All mappings with any of the specified kinds (and, if `load_caps_only`,
+  // from which capabilities can be loaded). This is suitable as a `Mapper`
+  // include set.
+  SparseRange ranges(unsigned kinds = kVmAnyRole, bool load_caps_only = true) const;
+
+ private:
+  // The process's total mapped bytes (`kinfo_proc::ki_size`), or 0 on error.
+  size_t mapped_bytes() const;
+
+  pid_t pid_;
+  ArenaVector<VmEntry> entries_;
+  ArenaVector<char> paths_;
+  size_t mapped_bytes_ = 0;
+  uint64_t generation_ = 0;
+};
+
+}  // namespace capmap
+#endif
@@ -0,0 +1,192 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_WORKLIST_H_
+#define CAPMAP_WORKLIST_H_
+
+#include "capmap-arena.h"
+
+#if __has_feature(capabilities)
+#include <cheriintrin.h>
+#else
+#error "capmap-worklist.h requires capabilities"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <vector>
+
+namespace capmap {
+
+// The order in which discovered capabilities are visited.
+//
+// The set of capabilities found is the same for both orders, but the depth at
+// which each one is first seen (and therefore `max_seen_scan_depth()`) can
+// differ. Breadth-first scans always find the shortest path to each region.
+enum class ScanOrder {
+  kDepthFirst,
+  kBreadthFirst,
+};
+
+// A capability waiting to be visited.
+struct ScanItem {
+  static size_t const kNoParent = SIZE_MAX;
+
+  void *__capability cap;
+  uint64_t depth;
+  // The root that this capability was (indirectly) found from.
+  char const *root;
+  // The address that `cap` was loaded from. This is meaningless for roots.
+  ptraddr_t found_at;
+  // The index of the visited capability that `cap` was found in (see
+  // `Worklist::record()`), or `kNoParent` for roots.
+  size_t parent;
+};
+
+// Print the path from the root to `item`, one hop per line, in the same style
+// as the rest of the scan diagnostics. `parent_of(index)` must return the
+// `ScanItem` recorded with each `parent` index on the path.
+template <typename ParentOf>
+void print_scan_trail(FILE *stream, ScanItem const &item, ParentOf parent_of) {
+  ScanItem const *hop = &item;
+  while (hop->parent != ScanItem::kNoParent) {
+    ScanItem const &parent = parent_of(hop->parent);
+    fprintf(stream, " found at %lx while scanning capability %#p\n", hop->found_at, parent.cap);
+    hop = &parent;
+  }
+  fprintf(stream, " from root %s at depth %" PRIu64 "\n", item.root, item.depth);
+}
+
+// Capabilities that have already been visited, for skipping repeat visits.
+//
+// Capabilities are keyed on their bounds, permissions and object type; their
+// addresses are ignored, since they do not affect what a visit finds. This is
+// an open-addressing hash table with linear probing, since it is queried for
+// every visited capability.
+class SeenSet {
+ public:
+  bool contains(void *__capability cap) const;
+
+  // Insert `cap`, returning false if an equivalent capability was already
+  // present.
+  bool insert(void *__capability cap);
+
+  size_t size() const { return size_; }
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+ private:
+  struct Key {
+    ptraddr_t base;
+    uint64_t length;
+    uint64_t perms;
+    uint64_t otype;
+    bool used;
+
+    bool operator==(Key const &other) const {
+      return (base == other.base) && (length == other.length) && (perms == other.perms) &&
+             (otype == other.otype);
+    }
+  };
+
+  static Key key_of(void *__capability cap);
+  static size_t hash(Key const &key);
+
+  // Return the slot holding `key`, or the empty slot where it would go.
+  size_t find(Key const &key) const;
+  void grow();
+
+  ArenaVector<Key> slots_;
+  size_t size_ = 0;
+};
+
+// Sealed capabilities that have been found, but not yet unsealed, indexed by
+// object type.
+//
+// When a capability that can unseal a range of object types is found, every
+// pending capability of those types is taken in a single range query, rather
+// than by re-examining every sealed capability for every unsealer. Entries are
+// appended unsorted, and sorted (once) on the next query.
+class SealedIndex {
+ public:
+  void add(ScanItem const &item);
+
+  // Remove every item whose object type is in [`first`, `last`], and append
+  // them to `*out`.
+  void take(uint64_t first, uint64_t last, ArenaVector<ScanItem> *out);
+
+  size_t size() const { return entries_.size(); }
+  void clear() {
+    entries_.clear();
+    sorted_ = 0;
+  }
+
+ private:
+  struct Entry {
+    uint64_t otype;
+    ScanItem item;
+  };
+
+  ArenaVector<Entry> entries_;
+  // The length of the sorted prefix of `entries_`.
+  size_t sorted_ = 0;
+};
+
+// Pending capabilities for `Mapper`, stored on the heap so that stack usage
+// does not depend on the depth of the capability graph.
+//
+// Alongside the pending items, the worklist records each capability that has
+// been dereferenced, so that the path to any pending item can be reported
+// without unwinding through the traversal.
+class Worklist {
+ public:
+  ScanOrder order() const { return order_; }
+  void set_order(ScanOrder order) { order_ = order; }
+
+  bool empty() const { return pending_.empty(); }
+  size_t size() const { return pending_.size(); }
+
+  void push(ScanItem const &item) { pending_.push_back(item); }
+
+  ScanItem pop() {
+    ScanItem item;
+    if (order_ == ScanOrder::kDepthFirst) {
+      item = pending_.back();
+      pending_.pop_back();
+    } else {
+      item = pending_.front();
+      pending_.pop_front();
+    }
+    return item;
+  }
+
+  // Note that `item` is being dereferenced, and return an index that can be
+  // used as the `parent` of any capabilities found through it.
+  size_t record(ScanItem const &item) {
+    trail_.push_back(item);
+    return trail_.size() - 1;
+  }
+
+  // Forget all pending items, and the recorded trail.
+  void clear() {
+    pending_.clear();
+    trail_.clear();
+  }
+
+  // Print the path from the root to `item`, one hop per line, in the same
+  // style as the rest of the scan diagnostics.
+  void print_trail(FILE *stream, ScanItem const &item) const;
+
+ private:
+  ScanOrder order_ = ScanOrder::kDepthFirst;
+  std::deque<ScanItem, ArenaAllocator<ScanItem>> pending_;
+  ArenaVector<ScanItem> trail_;
+};
+
+}  // namespace capmap
+#endif
@@ -0,0 +1,72 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#ifndef CAPMAP_WRITER_H_
+#define CAPMAP_WRITER_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+namespace capmap {
+
+// A buffered writer for raw bytes, such as a binary snapshot.
+//
+// Output is copied into a fixed buffer, and handed to the sink each time the
+// buffer fills, so arbitrarily large outputs are streamed out in `kBufferSize`
+// pieces. No memory is allocated.
+//
+// A file descriptor sink is written with `write(2)`, bypassing stdio entirely,
+// so this is safe to use while the process is being mapped. A `FILE *` sink is
+// written with `fwrite()`, so it stays in order with other stdio output, but
+// stdio may allocate its own buffer. A `Sink` callback receives each piece
+// directly, e.g. to compress it or send it elsewhere as it is produced.
+//
+// The buffer is part of the object, so avoid placing writers on small stacks.
+class ByteWriter {
+ public:
+  static size_t const kBufferSize = 32 * 1024;
+
+  // Consume `size` bytes of output, returning false on failure.
+  typedef bool (*Sink)(void *context, char const *data, size_t size);
+
+  // Write to a file descriptor.
+  explicit ByteWriter(int fd) : fd_(fd) {}
+
+  // Write to `stream`.
+  explicit ByteWriter(FILE *stream) : stream_(stream) {}
+
+  // Pass the output to `sink`, with `context`.
+  ByteWriter(Sink sink, void *context) : sink_(sink), context_(context) {}
+
+  ByteWriter(ByteWriter const &) = delete;
+  ByteWriter &operator=(ByteWriter const &) = delete;
+
+  ~ByteWriter() { flush(); }
+
+  // Write out everything buffered so far (and, for a `FILE *`, flush the
+  // stream). Returns false if any write has failed, in which case subsequent
+  // output is discarded.
+  bool flush();
+  bool ok() const { return ok_; }
+
+  // Append `size` bytes of `data` verbatim.
+  void raw(void const *data, size_t size);
+  void raw(char c) {
+    if (used_ == kBufferSize) flush();
+    buffer_[used_++] = c;
+  }
+
+ private:
+  void write_out(char const *data, size_t size);
+
+  int fd_ = -1;
+  FILE *stream_ = nullptr;
+  Sink sink_ = nullptr;
+  void *context_ = nullptr;
+  bool ok_ = true;
+  size_t used_ = 0;
+  char buffer_[kBufferSize];
+};
+
+}  // namespace capmap
+#endif
@@ -5,8 +5,10 @@
 #ifndef CAPMAP_H_
 #define CAPMAP_H_
 
+#include "capmap-json.h"
 #include "capmap-mappings.h"
 #include "capmap-range.h"
+#include "capmap-worklist.h"
 
 #if __has_feature(capabilities)
 #include <cheriintrin.h>
@@ -40,6 +42,15 @@ struct Roots {
   }
 };
 
+// A root capability, with a user-facing name. The name must outlive the
+// `Mapper` that scans it.
+struct NamedRoot {
+  char const *name;
+  void *__capability cap;
+};
+
+typedef ArenaVector<NamedRoot> RootList;
+
 // Retrieve all register roots.
 //
 // This is "naked" to minimise disturbance to caller-saved registers, etc.
@@ -58,15 +69,162 @@ __attribute((naked)) Roots get_roots();
 // capabilities left in caller-saved registers.
 void simple_scan_and_print_json(FILE *stream);
 
+// The state of a scanned region, recorded for `Mapper::rescan()`.
+struct PageRecord {
+  // A scanned range, never spanning more than one page.
+  Range range;
+  // The capability through which `range` was scanned, and how it was found.
+  void *__capability authority;
+  char const *root;
+  uint64_t depth;
+  // A summary of the contents of `range`: a hash of its data and tags, and the
+  // number of valid capabilities that it holds.
+  uint64_t hash;
+  uint64_t caps;
+  // The `Mapper::generation()` in which `range` was last walked.
+  uint64_t generation;
+};
+
+// The result of sampling part of a page, recorded for `SampleEstimate`.
+struct SampleRecord {
+  // A scanned range, never spanning more than one page.
+  Range range;
+  // The number of granules examined in `range`, and how many of them held a
+  // valid capability. If `exact`, every granule was examined.
+  uint32_t examined;
+  uint32_t tagged;
+  bool exact;
+};
+
+// The size of one map, for `ScanStats::maps`.
+struct MapRangeStats {
+  char const *name;
+  // The parts in `Map::ranges()`, and the bytes that they cover (or UINT64_MAX,
+  // if that does not fit).
+  uint64_t parts;
+  uint64_t bytes;
+};
+
+// Counters and timings for the scans performed by a `Mapper`.
+//
+// These are cheap enough to leave enabled: counters are updated on paths that
+// already do more work, and times are read from the generic timer once per
+// batch or phase. Times are wall-clock nanoseconds.
+struct ScanStats {
+  // Capability-aligned granules examined in scanned regions, and how many of
+  // them held a valid capability.
+  uint64_t granules = 0;
+  uint64_t tagged = 0;
+  uint64_t untagged() const { return granules - tagged; }
+  // Granules in scanned regions that could not be read, and were skipped. Only
+  // `scan_remote()` can fail to read memory.
+  uint64_t unreadable = 0;
+
+  // Visited capabilities that were not scanned (in full), by reason. Sealed
+  // capabilities are counted here each time they are found, even if they are
+  // unsealed later.
+  uint64_t rejected_sealed = 0;
+  uint64_t rejected_no_load_cap = 0;
+  // Everything that they point to is outside the included ranges.
+  uint64_t rejected_excluded = 0;
+  // Everything that they point to has already been mapped, by this capability
+  // or by others.
+  uint64_t rejected_mapped = 0;
+  // They are beyond `set_max_scan_depth()`.
+  uint64_t rejected_depth = 0;
+
+  // Sealed capabilities that were unsealed (by unsealing capabilities found
+  // in the scan) and scanned, and those still waiting for an unsealer.
+  uint64_t unsealed = 0;
+  uint64_t sealed_pending = 0;
+
+  // Activity in `load_cap_map()`, which drives the traversal, and the size of
+  // the include set.
+  uint64_t range_combines = 0;
+  uint64_t range_removes = 0;
+  uint64_t range_parts = 0;
+  uint64_t include_parts = 0;
+  // The size of each map, as `print_json()` lists them: `load_cap_map()`, then
+  // each user map (or its submaps).
+  ArenaVector<MapRangeStats> maps;
+
+  // Reading the process's memory map for the default include set.
+  uint64_t vmmap_ns = 0;
+  // Walking the capability graph, excluding map updates.
+  uint64_t traversal_ns = 0;
+  // Passing capabilities to user maps.
+  uint64_t map_ns = 0;
+  // `print_json()`. The "stats" block itself includes time spent up to the
+  // point at which it is written.
+  uint64_t output_ns = 0;
+
+  // The memory budget (see `Mapper::set_memory_budget()`): the most arena
+  // memory seen in use during scans, the bytes added to maps by coarsening
+  // them, the largest gap merged, and whether a scan was truncated (1) or not
+  // (0). Usage is only sampled when there is a budget.
+  uint64_t memory_peak = 0;
+  uint64_t coarsened_bytes = 0;
+  uint64_t coarsen_gap = 0;
+  uint64_t truncated = 0;
+
+  // Sampling (see `Mapper::set_sample_interval()`): the interval, and the
+  // number of granules in the ranges scanned while sampling. Of those,
+  // `granules` counts only the ones examined.
+  uint64_t sample_interval = 1;
+  uint64_t sample_population = 0;
+
+  // The part of `traversal_ns` spent in the granule loop itself, loading
+  // memory and collecting the capabilities in it. The rest is spent queueing
+  // and claiming capabilities, and on range bookkeeping. Only single-threaded,
+  // local scans measure this.
+  uint64_t load_ns = 0;
+};
+
+// A limit on the work done by one `Mapper::step()`.
+//
+// A step stops once either limit is reached, after finishing the granule (or,
+// for time limits, the region or batch of granules) that it is working on. The
+// default is unlimited.
+struct StepBudget {
+  uint64_t ns = UINT64_MAX;
+  uint64_t granules = UINT64_MAX;
+
+  static StepBudget time_ns(uint64_t ns) {
+    StepBudget budget;
+    budget.ns = ns;
+    return budget;
+  }
+  static StepBudget max_granules(uint64_t granules) {
+    StepBudget budget;
+    budget.granules = granules;
+    return budget;
+  }
+};
+
+// Compile-time options for the scan engine, as used by `BasicStaticMapper`.
+enum ScanPolicy : unsigned {
+  kScanPolicyNone = 0,
+  // Track the depth of each capability, so that `max_seen_scan_depth()` works.
+  // Without this, every depth is reported as 0. A limit set with
+  // `set_max_scan_depth()` needs depths, so it turns this on regardless.
+  kScanTrackDepth = 1u << 0,
+  // Log every dereferenced capability to stderr, like `SCAN_LOG(1, ...)`.
+  kScanLog = 1u << 1,
+
+  kScanPolicyDefault = kScanTrackDepth,
+};
+
 // The primary container, and expected API entry point.
 class Mapper {
  public:
   // The default Mapper will scan all accessible memory where capabilities are
   // found to it, but will not attempt to access unmapped pages, even if
   // capabilities are found.
-  Mapper() : include_(LoadCapMap::vmmap()) {}
+  Mapper();
 
-  Mapper(SparseRange include) : include_(include) {}
+  Mapper(SparseRange include) : include_(std::move(include)) {}
+
+  virtual ~Mapper() {}
 
   // The number of dereference hops that are permitted when mapping a
   // compartment.
@@ -83,50 +241,296 @@ class Mapper {
   // The maximum scan depth that was actually seen.
   uint64_t max_seen_scan_depth() { return max_seen_scan_depth_; }
 
+  // The number of visited capabilities that were skipped early, because an
+  // equivalent capability (or one covering the same region) had already been
+  // visited, and the number that had to be checked in full. Only unsealed
+  // capabilities that can load capabilities are counted in either.
+  uint64_t dedup_hits() const { return dedup_hits_; }
+  uint64_t dedup_misses() const { return dedup_misses_; }
+
+  // Counters and timings for every scan so far.
+  ScanStats stats() const;
+
+  // The order in which discovered capabilities are dereferenced.
+  //
+  // Either way, pending capabilities are held on the heap, so deep graphs (such
+  // as long linked lists) do not exhaust the stack. The default is
+  // `ScanOrder::kDepthFirst`, which keeps the worklist small for trees.
+  void set_scan_order(ScanOrder order) { worklist_.set_order(order); }
+  ScanOrder scan_order() const { return worklist_.order(); }
+
   // Memory ranges to scan for indirect capabilities.
   //
   // Capabilities to memory outside included ranges will still be reported, but
   // those ranges won't be examined.
-  SparseRange *include() { return &include_; }
+  //
+  // The scan filter is recompiled from this before the next scan, so modify
+  // include ranges through a fresh call to `include()` rather than through a
+  // pointer retained across scans. The default include set is refreshed by
+  // `rescan()`, unless it has been accessed this way.
+  SparseRange *include() {
+    filter_stale_ = true;
+    include_from_vmmap_ = false;
+    return &include_;
+  }
+
+  // The number of threads used to traverse the capability graph.
+  //
+  // With more than one thread, the scan is performed by that many dedicated
+  // worker threads (excluded from the scan themselves), which steal pending
+  // capabilities from one another. Each region is still examined only once,
+  // but the traversal order (and so `max_seen_scan_depth()`) is
+  // non-deterministic, and `set_scan_order()` has no effect.
+  //
+  // User maps are updated from the workers, but never concurrently, so
+  // `Map::try_combine()` implementations need not be thread-safe. However, note
+  // that `PoisonMap` callbacks may be called from worker threads.
+  void set_threads(unsigned threads) { threads_ = (threads == 0) ? 1 : threads; }
+  unsigned threads() const { return threads_; }
+
+  // Ask the kernel which pages have never had capabilities stored to them, and
+  // skip those pages without loading them.
+  //
+  // This costs a system call for each range that covers at least one whole
+  // page, so it helps most when large areas of included memory hold only data.
+  // It has no effect unless `can_skip_capability_free_pages()`.
+  void set_skip_capability_free_pages(bool skip) { skip_capability_free_pages_ = skip; }
+  static bool can_skip_capability_free_pages();
+
+  // Limit the memory used by the library's own data structures, in bytes, or 0
+  // (the default) for no limit.
+  //
+  // Usage is measured as `Arena::bytes()`, which every `Mapper` shares, and is
+  // checked regularly during single-threaded scans (and before multi-threaded
+  // ones). Once it passes three quarters of the budget, the user maps are
+  // coarsened, merging ranges separated by progressively larger gaps. This
+  // loses precision (recorded in `stats()`), but `load_cap_map()` stays exact,
+  // so the same memory is still scanned. If usage still exceeds the budget,
+  // the scan stops, and `truncated()` becomes true. Allocation failures during
+  // a scan are treated in the same way, rather than thrown.
+  void set_memory_budget(size_t bytes) { memory_budget_ = bytes; }
+  size_t memory_budget() const { return memory_budget_; }
+
+  // True if a scan stopped early because it ran out of memory. The results are
+  // valid, but incomplete: the capabilities still waiting to be scanned were
+  // dropped.
+  bool truncated() const { return stats_.truncated != 0; }
+
+  // Examine only one granule in every `interval` (at a random offset in each
+  // page), rather than every granule, for a quick estimate of what an exact
+  // scan would find. Capabilities found this way are followed, and sampled in
+  // the same way. `SampleEstimate` extrapolates from the results.
+  //
+  // An interval of 1 (the default) examines every granule. `seed` selects the
+  // offsets, so a scan of unchanged memory is repeatable. Sampling applies to
+  // single-threaded, local scans only.
+  void set_sample_interval(uint32_t interval, uint64_t seed = 1) {
+    sample_interval_ = (interval == 0) ? 1 : interval;
+    sample_state_ = seed;
+  }
+  uint32_t sample_interval() const { return sample_interval_; }
+
+  // While sampling, examine every granule of pages that overlap `ranges`, such
+  // as `SampleEstimate::dense_ranges()` from an earlier scan.
+  void set_exact_ranges(SparseRange ranges) { exact_ranges_ = std::move(ranges); }
+  SparseRange const &exact_ranges() const { return exact_ranges_; }
+
+  // Every range scanned while sampling, in the order in which they were
+  // scanned.
+  ArenaVector<SampleRecord> const &samples() const { return samples_; }
+
+  // Record a summary of every scanned page, so that `rescan()` can revisit
+  // only the pages that have changed.
+  //
+  // This must be set before the scans that `rescan()` should cover. It costs an
+  // extra pass over each scanned page, and memory for each record.
+  void set_incremental(bool incremental) { incremental_ = incremental; }
+  bool incremental() const { return incremental_; }
+
+  // Revisit the pages recorded by earlier incremental scans, and re-walk only
+  // those whose data or tags have changed since they were last walked.
+  //
+  // As with `scan()`, the result is incorporated into the existing map, so
+  // regions that are no longer reachable are not removed. Each recorded page is
+  // still read (to check its hash), but unchanged pages cost no capability
+  // loads, claims or map updates.
+  //
+  // Scanned memory may have been unmapped since, so the process's memory map is
+  // read again first (if its total size has changed; see
+  // `VmMap::refresh_if_changed()`). Recorded pages that are no longer in a
+  // mapping from which capabilities can be loaded are dropped, and counted by
+  // `stale_pages()`, and the default include set is updated to match. Memory
+  // that is unmapped and replaced without changing the total is not noticed.
+  void rescan();
+
+  // The number of `rescan()` calls so far.
+  uint64_t generation() const { return generation_; }
+
+  // Recorded pages, in the order in which they were first walked.
+  ArenaVector<PageRecord> const &pages() const { return pages_; }
+
+  // The number of recorded pages that the last `rescan()` found had changed.
+  size_t changed_pages() const { return changed_pages_; }
+  // The number of recorded pages that the last `rescan()` dropped, because
+  // they were no longer mapped.
+  size_t stale_pages() const { return stale_pages_; }
 
   // Scan all of the specified roots.
   //
   // The result is incorporated into the existing map.
   void scan(Roots const &roots) {
-    for (size_t i = 0; i < sizeof(roots.c) / sizeof(roots.c[0]); i++) {
-      scan(roots.c[i], Roots::name_c(i));
-    }
-    scan(roots.csp, "csp");
-    scan(roots.ddc, "DDC");
-    scan(roots.pcc, "PCC");
-    scan(roots.cid_el0, "CID_EL0");
+    begin(roots);
+    drain();
+  }
+
+  // Scan a batch of roots, for example from `discover_roots()`.
+  //
+  // The result is incorporated into the existing map.
+  void scan(RootList const &roots) {
+    begin(roots);
+    drain();
   }
 
   // Scan the specified capability.
   //
   // The result is incorporated into the existing map.
   void scan(void *__capability cap, char const *name) {
+    begin(cap, name);
+    drain();
+  }
+
+  // Resumable scans: `begin()` queues roots, then each `step()` does a bounded
+  // amount of work, so that an application can interleave scanning with its
+  // own work. The pending capabilities, and the position within a partly
+  // scanned region, are kept between steps. `scan()` is equivalent to `begin()`
+  // followed by a single, unlimited step.
+  //
+  // Memory may change between steps, so the result is not a consistent
+  // snapshot unless the application arranges for that. Multi-threaded scans
+  // cannot be paused, so with `threads() > 1`, each step runs to completion.
+  void begin(Roots const &roots) {
     update_self_ranges();
-    if (cheri_tag_get(cap)) {
-      roots_.push_back(std::make_pair(name, cap));
-      try {
-        scan(cap);
-      } catch (int n) {
-        fprintf(stderr, " from root %s at depth %d\n", name, n);
-        abort();
-      }
+    for (size_t i = 0; i < sizeof(roots.c) / sizeof(roots.c[0]); i++) {
+      add_root(roots.c[i], Roots::name_c(i));
     }
+    add_root(roots.csp, "csp");
+    add_root(roots.ddc, "DDC");
+    add_root(roots.pcc, "PCC");
+    add_root(roots.cid_el0, "CID_EL0");
+  }
+  void begin(void *__capability cap, char const *name) {
+    update_self_ranges();
+    add_root(cap, name);
   }
+  // Queue a batch of roots, to be scanned in address order (whatever the scan
+  // order), so that neighbouring roots are scanned together.
+  void begin(RootList const &roots);
+
+  // Scan until the budget is spent, or there is nothing left to scan. Returns
+  // `done()`.
+  bool step(StepBudget const &budget) { return resume(budget); }
 
+  // True if there is nothing left to scan.
+  bool done() const { return !cursor_.active && worklist_.empty(); }
+
+  // The pages scanned (in whole or in part) by the last step, rounded out to
+  // page boundaries. This is empty after multi-threaded steps.
+  SparseRange const &step_pages() const { return step_pages_; }
+
+  // Print the roots, scan parameters and maps as JSON.
+  //
+  // Output is buffered in a `JsonWriter`, so `stream` is only written (and not
+  // formatted into) by stdio.
   void print_json(FILE *stream);
+  void print_json(JsonWriter *out);
+
+  // Write the same information as a binary snapshot (see
+  // `include/capmap-binary.h`), which is much smaller, and can be mapped and
+  // queried without parsing. Returns false if any write failed.
+  bool write_binary(FILE *stream);
+  bool write_binary(ByteWriter *out);
 
   LoadCapMap const &load_cap_map() const { return load_cap_map_; }
 
   std::vector<std::unique_ptr<Map>> *maps() { return &maps_; }
 
+ protected:
+  // Visit every item on the worklist (and everything found from them).
+  virtual void drain() { drain_with<kScanPolicyDefault>(); }
+
+  // `drain()`, with the scan engine specialised for `kPolicy`.
+  //
+  // This is instantiated in the library for every combination of `ScanPolicy`
+  // flags. The policy applies to single-threaded scans; multi-threaded scans
+  // always track depth.
+  template <unsigned kPolicy>
+  void drain_with();
+
+  // Do up to `budget` worth of scanning, and return `done()`.
+  virtual bool resume(StepBudget const &budget) { return resume_with<kScanPolicyDefault>(budget); }
+
+  // `resume()`, with the scan engine specialised for `kPolicy`, as for
+  // `drain_with()`.
+  template <unsigned kPolicy>
+  bool resume_with(StepBudget const &budget);
+
+  // Pass `count` capabilities to every user map, in batches.
+  virtual void combine_maps(void *__capability const *caps, size_t count);
+
+  // True if `set_max_scan_depth()` has set a limit.
+  bool depth_limited() const { return max_scan_depth_ != UINT64_MAX; }
+
+  // The maps printed (after `load_cap_map()`) by `print_json()`.
+  virtual size_t user_map_count() const { return maps_.size(); }
+  virtual Map const &user_map(size_t i) const { return *maps_[i]; }
+
  private:
+  friend class ParallelScan;
+  friend class RemoteScan;
+  friend class SampleEstimate;
+
   void update_self_ranges();
-  void scan(void *__capability cap, uint64_t depth = 0);
+
+  // Queue a root for the next `drain()`, if it is a valid capability.
+  void add_root(void *__capability cap, char const *name);
+
+  void drain_parallel();
+
+  // Claim `item`, and if any of it needs to be scanned, point `cursor_` at it.
+  template <unsigned kPolicy>
+  void visit(ScanItem const &item);
+
+  // Scan up to `max_granules` from `cursor_`, queue any capabilities found,
+  // and pass them to the maps. Returns the number of granules covered (all of
+  // which are examined, unless sampling).
+  template <unsigned kPolicy>
+  uint64_t scan_cursor(uint64_t max_granules);
+
+  // Decide whether `item` needs to be scanned, and if so, claim it in
+  // `load_cap_map_`, set `*pieces` to the parts that `filter` permits, and
+  // return true. Repeat visits are rejected before any range work.
+  bool claim(ScanItem const &item, bool check_depth, ScanFilter const &filter,
+             RangeVector *pieces);
+
+  // Keep a sealed capability until an unsealer for it is found (or unseal it
+  // now, if one already has been).
+  void defer_sealed(ScanItem const &item);
+  // Record an unsealing capability, and unseal any pending capabilities that
+  // it can unseal.
+  void add_unsealer(void *__capability unsealer);
+  // Queue `item.cap`, unsealed with `unsealer`, for scanning.
+  void unseal(ScanItem const &item, void *__capability unsealer);
+
+  // `combine_maps()`, timed for `stats()`.
+  void update_maps(void *__capability const *caps, size_t count);
+
+  // Check memory usage against `memory_budget_`, coarsening the maps if it is
+  // getting close. Returns false if the scan must stop.
+  bool check_memory_budget();
+  // Coarsen every map, merging gaps of fewer than `gap` bytes.
+  void coarsen_maps(uint64_t gap);
+  // Stop the scan, dropping everything still waiting to be scanned.
+  void truncate();
 
   SparseRange include_;
 
@@ -134,16 +538,90 @@ class Mapper {
   // scan, in case the `Mapper` moves or allocates.
   SparseRange exclude_self_;
 
+  // `include_` minus `exclude_self_`, rebuilt only when either changes.
+  ScanFilter filter_;
+  bool filter_stale_ = true;
+  // True if `include_` is still the default, read from the memory map.
+  bool include_from_vmmap_ = false;
+
+  // The parts of the capability being visited that still need to be scanned.
+  // This is kept to avoid reallocating it for every capability.
+  RangeVector scan_pieces_;
+  // The capabilities found in the region being visited, and where.
+  ArenaVector<void *__capability> found_caps_;
+  ArenaVector<ptraddr_t> found_at_;
+
+  // The region being scanned, if a step stopped part way through it (or is
+  // about to start it): the claimed capability, its index in the worklist's
+  // trail, and the next granule to scan in `scan_pieces_`.
+  struct Cursor {
+    bool active = false;
+    ScanItem item = {};
+    size_t parent = 0;
+    size_t piece = 0;
+    ptraddr_t next = 0;
+  };
+  Cursor cursor_;
+
+  // The pages touched by the last step.
+  SparseRange step_pages_;
+  RangeVector step_page_ranges_;
+
+  bool skip_capability_free_pages_ = false;
+  RangeVector page_pieces_;
+  ArenaVector<char> page_status_;
+
+  bool incremental_ = false;
+  uint64_t generation_ = 0;
+  ArenaVector<PageRecord> pages_;
+  size_t changed_pages_ = 0;
+  size_t stale_pages_ = 0;
+
   // We always track Load + LoadCaps, because we use it to walk the graph.
   LoadCapMap load_cap_map_;
 
+  // Capabilities that have been visited (and won't need visiting again), and
+  // the most recent range claimed in `load_cap_map_`.
+  SeenSet seen_;
+  Range last_claimed_;
+  uint64_t dedup_hits_ = 0;
+  uint64_t dedup_misses_ = 0;
+
+  // Sealed capabilities waiting to be unsealed, and the unsealers found so
+  // far, with the object types that they cover.
+  SealedIndex sealed_;
+  ArenaVector<void *__capability> unsealers_;
+  SparseRange unsealable_;
+  ArenaVector<ScanItem> unsealing_;
+
+  // Counters and times. Some fields are only filled in by `stats()`.
+  ScanStats stats_;
+
   // User-configurable maps.
   std::vector<std::unique_ptr<Map>> maps_;
 
+  // Capabilities waiting to be dereferenced.
+  Worklist worklist_;
+
+  unsigned threads_ = 1;
+
   uint64_t max_scan_depth_ = UINT64_MAX;
   uint64_t max_seen_scan_depth_ = 0;
 
-  std::vector<std::pair<char const *, void *__capability>> roots_;
+  static unsigned const kBudgetInterval = 64;
+  static uint64_t const kMinCoarsenGap = 256;
+  static uint64_t const kMaxCoarsenGap = uint64_t(1) << 30;
+  uint32_t sample_interval_ = 1;
+  uint64_t sample_state_ = 1;
+  SparseRange exact_ranges_;
+  ArenaVector<SampleRecord> samples_;
+
+  size_t memory_budget_ = 0;
+  // The number of visits until memory usage is next checked.
+  unsigned budget_countdown_ = 0;
+
+  ArenaVector<std::pair<char const *, void *__capability>> roots_;
+  RootList root_batch_;
 };
 
 }  // namespace capmap
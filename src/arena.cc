@@ -0,0 +1,153 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-arena.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "src/scan.h"
+
+namespace capmap {
+
+Arena& Arena::get() {
+  // This is never destroyed, since static objects with SparseRanges could
+  // still be using it during exit.
+  static Arena* arena = new Arena();
+  return *arena;
+}
+
+size_t Arena::size_class(size_t size) {
+  size_t cls = 0;
+  while ((kMinBlock << cls) < size) cls++;
+  return cls;
+}
+
+size_t Arena::class_for(size_t size, size_t align) {
+  // A class block is aligned to its own size, so one at least as large as
+  // `align` satisfies it.
+  size = std::max(std::max<size_t>(size, 1), align);
+  return (size <= kMaxClassBlock) ? size_class(size) : kClasses;
+}
+
+size_t Arena::block_size(size_t size, size_t align) {
+  size_t cls = class_for(size, align);
+  return (cls < kClasses) ? (kMinBlock << cls) : std::max<size_t>(size, 1);
+}
+
+Arena::Arena() {
+  // Hold the lock across `fork()`, so that a child (e.g. of `ForkedScan`)
+  // never inherits it locked by a thread that doesn't exist there.
+  pthread_atfork([] { Arena::get().lock_.lock(); }, [] { Arena::get().lock_.unlock(); },
+                 [] { Arena::get().lock_.unlock(); });
+  if (CAPMAP_ARENA_SIZE == 0) return;
+  void* base = mmap(nullptr, CAPMAP_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+                    -1, 0);
+  if (base == MAP_FAILED) return;
+  base_ = static_cast<char*>(base);
+  base_addr_ = address_of(base);
+  size_ = CAPMAP_ARENA_SIZE;
+}
+
+size_t Arena::bytes() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return bytes_;
+}
+
+std::vector<std::pair<ptraddr_t, size_t>> Arena::fallback_blocks() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return std::vector<std::pair<ptraddr_t, size_t>>(fallback_.begin(), fallback_.end());
+}
+
+bool Arena::contains(void const* ptr) const {
+  ptraddr_t addr = address_of(ptr);
+  return (size_ > 0) && (addr >= base_addr_) && (addr - base_addr_ < size_);
+}
+
+void* Arena::bump(size_t size, size_t align) {
+#ifdef __CHERI_PURE_CAPABILITY__
+  // Make sure that the bounds can be set exactly.
+  size = cheri_representable_length(size);
+  size_t representable = ~cheri_representable_alignment_mask(size) + 1;
+  if (representable > align) align = representable;
+#endif
+  size_t offset = (top_ + align - 1) & ~(align - 1);
+  if ((offset < top_) || (offset > size_) || (size > size_ - offset)) return nullptr;
+  top_ = offset + size;
+#ifdef __CHERI_PURE_CAPABILITY__
+  return cheri_bounds_set_exact(base_ + offset, size);
+#else
+  return base_ + offset;
+#endif
+}
+
+void* Arena::allocate(size_t size, size_t align) {
+  if (size == 0) size = 1;
+  if (align < kMinBlock) align = kMinBlock;
+
+  std::lock_guard<std::mutex> guard(lock_);
+  void* ptr = nullptr;
+  size_t cls = class_for(size, align);
+  if (size_ > 0) {
+    if (cls == kClasses) {
+      ptr = bump(size, align);
+    } else if (free_[cls]) {
+      ptr = free_[cls];
+      free_[cls] = free_[cls]->next;
+    } else {
+      // Align the block to its size, so that it can be reused for any request in
+      // its class, whatever that request's alignment.
+      ptr = bump(kMinBlock << cls, kMinBlock << cls);
+    }
+  }
+  if (!ptr) {
+    if (posix_memalign(&ptr, align, size) != 0) throw std::bad_alloc();
+    try {
+      fallback_.emplace(address_of(ptr), size);
+    } catch (...) {
+      free(ptr);
+      throw;
+    }
+  }
+  live_++;
+  bytes_ += block_size(size, align);
+  return ptr;
+}
+
+void Arena::deallocate(void* ptr, size_t size, size_t align) {
+  if (!ptr) return;
+  if (align < kMinBlock) align = kMinBlock;
+  std::lock_guard<std::mutex> guard(lock_);
+  size_t cls = class_for(size, align);
+  if (!contains(ptr)) {
+    fallback_.erase(address_of(ptr));
+    free(ptr);
+  } else if (cls < kClasses) {
+    // Every class block in the arena is the full size of its class, so it can
+    // be reused for anything else in the class.
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    block->next = free_[cls];
+    free_[cls] = block;
+  }
+  bytes_ -= block_size(size, align);
+  if (--live_ == 0) rewind();
+}
+
+void Arena::rewind() {
+  // Give the pages back, but keep the reservation so that it can still be
+  // excluded as one range.
+  if (top_ > 0) madvise(base_, top_, MADV_FREE);
+  top_ = 0;
+  for (auto& list : free_) list = nullptr;
+  generation_++;
+}
+
+}  // namespace capmap
@@ -0,0 +1,506 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-binary.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "include/capmap.h"
+#include "scan.h"
+
+namespace capmap {
+
+namespace {
+
+using binary::aligned;
+
+// The counters in the stats section, in order. New counters are only ever
+// added at the end, so that older readers can ignore them.
+uint64_t ScanStats::*const kStatsFields[] = {
+    &ScanStats::granules,
+    &ScanStats::tagged,
+    &ScanStats::unreadable,
+    &ScanStats::rejected_sealed,
+    &ScanStats::rejected_no_load_cap,
+    &ScanStats::rejected_excluded,
+    &ScanStats::rejected_mapped,
+    &ScanStats::rejected_depth,
+    &ScanStats::unsealed,
+    &ScanStats::sealed_pending,
+    &ScanStats::range_combines,
+    &ScanStats::range_removes,
+    &ScanStats::range_parts,
+    &ScanStats::include_parts,
+    &ScanStats::vmmap_ns,
+    &ScanStats::traversal_ns,
+    &ScanStats::map_ns,
+    &ScanStats::output_ns,
+    &ScanStats::memory_peak,
+    &ScanStats::coarsened_bytes,
+    &ScanStats::coarsen_gap,
+    &ScanStats::truncated,
+    &ScanStats::sample_interval,
+    &ScanStats::sample_population,
+    &ScanStats::load_ns,
+};
+size_t const kStatsFieldCount = sizeof(kStatsFields) / sizeof(kStatsFields[0]);
+
+// The size of each element of a section, or 0 for unknown kinds.
+size_t element_size(uint32_t kind) {
+  switch (kind) {
+    case binary::kSectionStrings:
+      return 1;
+    case binary::kSectionRoots:
+      return sizeof(binary::Root);
+    case binary::kSectionConfig:
+      return sizeof(binary::Config);
+    case binary::kSectionStats:
+      return sizeof(uint64_t);
+    case binary::kSectionInclude:
+    case binary::kSectionExclude:
+    case binary::kSectionMap:
+    case binary::kSectionMapAdded:
+    case binary::kSectionMapRemoved:
+      return sizeof(Range);
+    case binary::kSectionRootsAdded:
+    case binary::kSectionRootsRemoved:
+    case binary::kSectionRootsChanged:
+    case binary::kSectionRootsChangedBefore:
+      return sizeof(binary::Root);
+    case binary::kSectionDepth:
+      return 2 * sizeof(uint64_t);
+    case binary::kSectionMapMaxLast:
+      return sizeof(uint64_t);
+    default:
+      return 0;
+  }
+}
+
+void pad(ByteWriter* out, size_t size) {
+  static char const zeros[binary::kAlign] = {};
+  out->raw(zeros, aligned(size) - size);
+}
+
+void write_ranges(ByteWriter* out, RangeSet const& ranges) {
+  for (auto const range : ranges) out->raw(&range, sizeof(range));
+  pad(out, ranges.size() * sizeof(Range));
+}
+
+void print_ranges(JsonWriter* out, RangeView ranges, char const* line_prefix) {
+  JsonRangeStream stream(out, line_prefix, false);
+  for (auto range : ranges) stream.add(range);
+  stream.finish();
+}
+
+}  // namespace
+
+bool Mapper::write_binary(FILE* stream) {
+  ByteWriter out(stream);
+  return write_binary(&out);
+}
+
+bool Mapper::write_binary(ByteWriter* out) {
+  uint64_t start = now_ticks();
+
+  // Maps are written in the order that `print_json()` prints them.
+  ArenaVector<Map const*> maps;
+  maps.push_back(&load_cap_map_);
+  for (size_t i = 0; i < user_map_count(); i++) {
+    Map const& map = user_map(i);
+    if (map.submap_count() == 0) maps.push_back(&map);
+    for (size_t j = 0; j < map.submap_count(); j++) maps.push_back(&map.submap(j));
+  }
+
+  ArenaVector<char> strings(1, '\0');
+  auto intern = [&](char const* str) -> uint64_t {
+    if ((str == nullptr) || (*str == '\0')) return 0;
+    uint64_t offset = strings.size();
+    strings.insert(strings.end(), str, str + strlen(str) + 1);
+    return offset;
+  };
+
+  ArenaVector<binary::Root> roots;
+  roots.reserve(roots_.size());
+  for (auto const& name_cap : roots_) {
+    uint64_t parts[2];
+    static_assert(sizeof(parts) == sizeof(name_cap.second), "Expected 128-bit capability");
+    memcpy(parts, &name_cap.second, sizeof(parts));
+    roots.push_back(
+        binary::Root{intern(name_cap.first), cheri_tag_get(name_cap.second), parts[1], parts[0]});
+  }
+
+  ArenaVector<binary::Section> sections;
+  auto add = [&](uint32_t kind, uint64_t count) -> binary::Section& {
+    sections.push_back(binary::Section{kind, 0, 0, count, 0, 0});
+    return sections.back();
+  };
+  add(binary::kSectionStrings, 0);
+  add(binary::kSectionRoots, roots.size());
+  add(binary::kSectionConfig, 1);
+  add(binary::kSectionStats, kStatsFieldCount);
+  add(binary::kSectionInclude, include_.parts().size());
+  add(binary::kSectionExclude, exclude_self_.parts().size());
+  for (Map const* map : maps) {
+    RangeIndex const* distinct = map->distinct_ranges();
+    auto& section = add(binary::kSectionMap, distinct ? distinct->size() : map->ranges().size());
+    if (distinct) section.flags |= binary::kSectionOverlapping;
+    section.name = intern(map->name());
+    section.address_space = intern(map->address_space());
+    if (distinct) add(binary::kSectionMapMaxLast, distinct->size());
+  }
+  sections[0].count = strings.size();
+
+  size_t offset = aligned(sizeof(binary::Header) + sections.size() * sizeof(binary::Section));
+  for (auto& section : sections) {
+    section.offset = offset;
+    offset += aligned(section.count * element_size(section.kind));
+  }
+
+  binary::Header header;
+  memcpy(header.magic, binary::kMagic, sizeof(header.magic));
+  header.version = binary::kVersion;
+  header.section_count = sections.size();
+  header.size = offset;
+  out->raw(&header, sizeof(header));
+  out->raw(sections.data(), sections.size() * sizeof(binary::Section));
+  pad(out, sizeof(binary::Header) + sections.size() * sizeof(binary::Section));
+
+  out->raw(strings.data(), strings.size());
+  pad(out, strings.size());
+  out->raw(roots.data(), roots.size() * sizeof(binary::Root));
+  pad(out, roots.size() * sizeof(binary::Root));
+
+  binary::Config config = {max_scan_depth_, max_seen_scan_depth_, dedup_hits_, dedup_misses_};
+  out->raw(&config, sizeof(config));
+  pad(out, sizeof(config));
+
+  // As for `print_json()`, the stats include time spent up to this point.
+  stats_.output_ns += elapsed_ns(start);
+  start = now_ticks();
+  ScanStats stats = this->stats();
+  for (auto field : kStatsFields) {
+    uint64_t value = stats.*field;
+    out->raw(&value, sizeof(value));
+  }
+  pad(out, kStatsFieldCount * sizeof(uint64_t));
+
+  write_ranges(out, include_.parts());
+  write_ranges(out, exclude_self_.parts());
+  for (Map const* map : maps) {
+    RangeIndex const* distinct = map->distinct_ranges();
+    if (distinct) {
+      out->raw(distinct->begin(), distinct->size() * sizeof(Range));
+      pad(out, distinct->size() * sizeof(Range));
+      static_assert(sizeof(ptraddr_t) == sizeof(uint64_t), "Addresses are stored as 64 bits");
+      out->raw(distinct->max_last(), distinct->size() * sizeof(uint64_t));
+      pad(out, distinct->size() * sizeof(uint64_t));
+    } else {
+      write_ranges(out, map->ranges());
+    }
+  }
+
+  bool ok = out->flush();
+  stats_.output_ns += elapsed_ns(start);
+  return ok;
+}
+
+bool RangeView::includes(ptraddr_t addr) const {
+  return overlaps(Range::from_base_last(addr, addr));
+}
+
+bool RangeView::overlaps(Range range) const {
+  if (range.is_empty()) return false;
+  // Only ranges starting at or before `range.last()` can overlap it.
+  auto by_base = [](ptraddr_t addr, Range const& r) { return addr < r.base(); };
+  const_iterator it = std::upper_bound(begin(), end(), range.last(), by_base);
+  if (overlapping_) {
+    // Any of those might reach `range`, as in `RangeIndex::overlaps()`.
+    if (max_last_) return (it != begin()) && (max_last_[it - begin() - 1] >= range.base());
+    return std::any_of(begin(), it, [&](Range r) { return r.last() >= range.base(); });
+  }
+  // Otherwise, only the last of them can.
+  return (it != begin()) && ((it - 1)->last() >= range.base());
+}
+
+SparseRange RangeView::to_sparse_range() const {
+  SparseRange ranges;
+  for (auto range : *this) ranges.combine(range);
+  return ranges;
+}
+
+bool BinarySnapshot::open(char const* path) {
+  close();
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  void* data = MAP_FAILED;
+  if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  ::close(fd);
+  if (data == MAP_FAILED) return false;
+  data_ = static_cast<char const*>(data);
+  size_ = st.st_size;
+  mapped_ = true;
+  if (validate()) return true;
+  close();
+  return false;
+}
+
+bool BinarySnapshot::open(void const* data, size_t size) {
+  close();
+  data_ = static_cast<char const*>(data);
+  size_ = size;
+  if (validate()) return true;
+  close();
+  return false;
+}
+
+bool BinarySnapshot::capture(Mapper* mapper) {
+  close();
+  char* data = nullptr;
+  size_t size = 0;
+  FILE* stream = open_memstream(&data, &size);
+  if (stream == nullptr) return false;
+  bool ok = mapper->write_binary(stream);
+  // This sets `data` and `size`, even on failure.
+  ok = (fclose(stream) == 0) && ok;
+  data_ = data;
+  size_ = size;
+  owned_ = true;
+  if (ok && validate()) return true;
+  close();
+  return false;
+}
+
+void BinarySnapshot::close() {
+  if (mapped_) munmap(const_cast<char*>(data_), size_);
+  if (owned_) free(const_cast<char*>(data_));
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = false;
+  owned_ = false;
+  sections_ = nullptr;
+  section_count_ = 0;
+  strings_ = nullptr;
+  roots_ = nullptr;
+  roots_count_ = 0;
+  config_ = nullptr;
+  stats_ = nullptr;
+  include_ = nullptr;
+  exclude_ = nullptr;
+  map_count_ = 0;
+}
+
+namespace binary {
+
+Header const* validate(void const* data, size_t size, char const* magic) {
+  auto bytes = static_cast<char const*>(data);
+  if ((bytes == nullptr) || (address_of(bytes) % kAlign != 0)) return nullptr;
+  if (size < sizeof(Header)) return nullptr;
+  auto header = reinterpret_cast<Header const*>(bytes);
+  if (memcmp(header->magic, magic, sizeof(header->magic)) != 0) return nullptr;
+  if ((header->version != kVersion) || (header->size > size)) return nullptr;
+  size_t limit = header->size;
+  if (header->section_count > (limit - sizeof(Header)) / sizeof(Section)) return nullptr;
+  Section const* table = sections(header);
+  for (size_t i = 0; i < header->section_count; i++) {
+    // Unknown sections are skipped, so that they can be added without
+    // breaking older readers.
+    size_t element = element_size(table[i].kind);
+    if (element == 0) continue;
+    if ((table[i].offset % kAlign != 0) || (table[i].offset > limit)) return nullptr;
+    if (table[i].count > (limit - table[i].offset) / element) return nullptr;
+  }
+  return header;
+}
+
+}  // namespace binary
+
+bool BinarySnapshot::validate() {
+  binary::Header const* header = binary::validate(data_, size_, binary::kMagic);
+  if (header == nullptr) return false;
+  sections_ = binary::sections(header);
+  section_count_ = header->section_count;
+
+  uint64_t strings_size = 0;
+  binary::Section const* roots = nullptr;
+  binary::Section const* config = nullptr;
+  for (size_t i = 0; i < section_count_; i++) {
+    binary::Section const& section = sections_[i];
+    binary::Section const** unique = nullptr;
+    switch (section.kind) {
+      case binary::kSectionStrings:
+        if (strings_ != nullptr) return false;
+        strings_ = data_ + section.offset;
+        strings_size = section.count;
+        break;
+      case binary::kSectionRoots:
+        unique = &roots;
+        break;
+      case binary::kSectionConfig:
+        unique = &config;
+        break;
+      case binary::kSectionStats:
+        unique = &stats_;
+        break;
+      case binary::kSectionInclude:
+        unique = &include_;
+        break;
+      case binary::kSectionExclude:
+        unique = &exclude_;
+        break;
+      case binary::kSectionMap:
+        map_count_++;
+        if (section.flags & binary::kSectionOverlapping) {
+          binary::Section const* max_last = (i + 1 < section_count_) ? &sections_[i + 1] : nullptr;
+          if (!max_last || (max_last->kind != binary::kSectionMapMaxLast) ||
+              (max_last->count != section.count)) {
+            return false;
+          }
+        }
+        break;
+    }
+    if (unique != nullptr) {
+      if (*unique != nullptr) return false;
+      *unique = &section;
+    }
+  }
+  if (!strings_ || !roots || !config || !stats_ || !include_ || !exclude_) return false;
+  if ((config->count != 1) || (strings_size == 0)) return false;
+  if ((strings_[0] != '\0') || (strings_[strings_size - 1] != '\0')) return false;
+
+  roots_ = reinterpret_cast<binary::Root const*>(data_ + roots->offset);
+  roots_count_ = roots->count;
+  config_ = reinterpret_cast<binary::Config const*>(data_ + config->offset);
+  for (size_t i = 0; i < roots_count_; i++) {
+    if (roots_[i].name >= strings_size) return false;
+  }
+  for (size_t i = 0; i < map_count_; i++) {
+    binary::Section const* section = map(i);
+    if ((section->name >= strings_size) || (section->address_space >= strings_size)) return false;
+  }
+  return true;
+}
+
+ScanStats BinarySnapshot::stats() const {
+  // Newer snapshots may have more counters.
+  ScanStats stats;
+  auto values = reinterpret_cast<uint64_t const*>(data_ + stats_->offset);
+  size_t count = std::min<size_t>(stats_->count, kStatsFieldCount);
+  for (size_t i = 0; i < count; i++) stats.*kStatsFields[i] = values[i];
+  // Map sizes aren't stored, since the maps themselves are.
+  for (size_t i = 0; i < map_count_; i++) {
+    RangeView view = map_ranges(i);
+    uint64_t parts = view.size();
+    uint64_t bytes = range_bytes(view);
+    if (view.overlapping()) {
+      SparseRange merged = view.to_sparse_range();
+      parts = merged.parts().size();
+      bytes = range_bytes(merged.parts());
+    }
+    stats.maps.push_back(MapRangeStats{map_name(i), parts, bytes});
+  }
+  return stats;
+}
+
+RangeView BinarySnapshot::ranges(binary::Section const& section) const {
+  auto ranges = reinterpret_cast<Range const*>(data_ + section.offset);
+  if (!(section.flags & binary::kSectionOverlapping)) return RangeView(ranges, section.count);
+  // `validate()` checked that this follows every overlapping map.
+  binary::Section const& max_last = *(&section + 1);
+  return RangeView(ranges, section.count, true,
+                   reinterpret_cast<uint64_t const*>(data_ + max_last.offset));
+}
+
+binary::Section const* BinarySnapshot::map(size_t i) const {
+  // There are only a few maps, so they aren't indexed.
+  for (size_t s = 0; s < section_count_; s++) {
+    if ((sections_[s].kind == binary::kSectionMap) && (i-- == 0)) return &sections_[s];
+  }
+  return nullptr;
+}
+
+char const* BinarySnapshot::map_name(size_t i) const {
+  binary::Section const* section = map(i);
+  return section ? string(section->name) : nullptr;
+}
+
+char const* BinarySnapshot::map_address_space(size_t i) const {
+  binary::Section const* section = map(i);
+  return section ? string(section->address_space) : nullptr;
+}
+
+RangeView BinarySnapshot::map_ranges(size_t i) const {
+  binary::Section const* section = map(i);
+  return section ? ranges(*section) : RangeView();
+}
+
+void BinarySnapshot::print_json(FILE* stream) const {
+  JsonWriter out(stream);
+  print_json(&out);
+}
+
+void BinarySnapshot::print_json(JsonWriter* out) const {
+  out->raw("\"capmap\": {\n");
+
+  {
+    char const* sep = "\n        ";
+    out->raw("    \"roots\": {");
+    for (size_t i = 0; i < root_count(); i++) {
+      out->raw(sep);
+      out->string(root_name(i));
+      out->raw(": \"");
+      out->raw_cap_bits(root(i).tag, root(i).high, root(i).low);
+      out->raw('"');
+      sep = ",\n        ";
+    }
+    out->raw("\n    },\n");
+  }
+
+  out->raw("    \"scan\": {\n");
+  out->raw("        \"include\": ");
+  print_ranges(out, include(), "        ");
+  out->raw(",\n");
+  out->raw("        \"exclude\": ");
+  print_ranges(out, exclude(), "        ");
+  out->raw(",\n");
+  out->raw("        \"depth\": ");
+  out->dec(config().max_seen_scan_depth);
+  out->raw(",\n");
+  out->raw("        \"dedup\": { \"hits\": ");
+  out->dec(config().dedup_hits);
+  out->raw(", \"misses\": ");
+  out->dec(config().dedup_misses);
+  out->raw(" }\n    },\n");
+
+  out->raw("    \"maps\": {");
+  for (size_t i = 0; i < map_count(); i++) {
+    out->raw((i == 0) ? "\n" : ",\n");
+    out->raw("        ");
+    out->string(map_name(i));
+    out->raw(": {\n");
+    out->raw("            \"address-space\": ");
+    out->string(map_address_space(i));
+    out->raw(",\n");
+    out->raw("            \"ranges\": ");
+    print_ranges(out, map_ranges(i), "            ");
+    out->raw("\n        }");
+  }
+  out->raw("\n    },\n");
+
+  print_stats_json(out, stats());
+  out->raw("    }\n}\n");
+  out->flush();
+}
+
+}  // namespace capmap
@@ -6,35 +6,21 @@
 
 #include <inttypes.h>
 #include <stdio.h>
-
-// BSD headers for kinfo_getvmmap.
-#include <libutil.h>
-#include <sys/types.h>
-#include <sys/user.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include <new>
+
+#include "include/capmap-arena.h"
+#include "include/capmap-vmmap.h"
+#include "src/scan.h"
+
 #if __has_feature(capabilities)
 #include <cheriintrin.h>
 #else
 #error "capmap.cc requires capabilities"
 #endif
 
-// If greater than zero, print scan-related debug message to stderr.
-// This can help to diagnose why something is or isn't being found, but it
-// occurs before coalescing and redundancy checks, so is very verbose.
-#define SCAN_LOG_VERBOSITY 0
-
-#if SCAN_LOG_VERBOSITY > 0
-#define SCAN_LOG(verbosity, ...)             \
-  do {                                       \
-    if ((verbosity) <= SCAN_LOG_VERBOSITY) { \
-      fprintf(stderr, __VA_ARGS__);          \
-    }                                        \
-  } while (0)
-#else
-#define SCAN_LOG(...)
-#endif
-
 namespace capmap {
 
 #ifdef __CHERI_PURE_CAPABILITY__
@@ -82,13 +68,6 @@ __attribute((naked)) Roots get_roots() {
   // clang-format on
 }
 
-void print_raw_cap(FILE* stream, void* __capability cap) {
-  uint64_t parts[2];
-  static_assert(sizeof(parts) == sizeof(cap), "Expected 128-bit capability");
-  memcpy(parts, &cap, sizeof(parts));
-  fprintf(stream, "0x%u:%" PRIx64 ":%" PRIx64, cheri_tag_get(cap), parts[1], parts[0]);
-}
-
 void simple_scan_and_print_json(FILE* stream) {
   Roots roots = get_roots();
   Mapper mapper;
@@ -96,169 +75,766 @@ void simple_scan_and_print_json(FILE* stream) {
   mapper.print_json(stream);
 }
 
+Mapper::Mapper() {
+  uint64_t start = now_ticks();
+  include_ = LoadCapMap::vmmap();
+  include_from_vmmap_ = true;
+  stats_.vmmap_ns += elapsed_ns(start);
+}
+
 void Mapper::update_self_ranges() {
-  // TODO: Do a better job here.
-  //  - We have several heap objects, which should also be excluded.
-  //  - If using scan(Roots), we might want to exclude invariant regions once,
-  //    and update the exclusion ranges only when we allocate new map entries,
-  //    etc.
-  exclude_self_ = SparseRange();
-  exclude_self_.combine(Range::from_object(this));
-}
-
-void Mapper::scan(void* __capability cap, uint64_t depth) {
-  SCAN_LOG(1, "scan(%#lp, %" PRIu64 ")\n", cap, depth);
-  if (depth > max_seen_scan_depth_) max_seen_scan_depth_ = depth;
-
-  for (auto& map : maps_) map->try_combine(cap);
-
-  // TODO: Defer this until after the depth check and the
-  // load_cap_map_.try_combine() permissions check (but before the actual
-  // combination).
-  auto cap_range = Range::from_cap(cap);
-  auto scan_ranges = SparseRange(cap_range);
-  scan_ranges.remove(load_cap_map_.ranges());
-  scan_ranges.remove(exclude_self_);
-
-  // TODO: Make a SparseRange::filter() function or similar, to avoid repeating
-  // this for every scan.
-  auto exclude = SparseRange(Range::full_64bit());
-  exclude.remove(include_);
-  scan_ranges.remove(exclude);
-
-  if (load_cap_map_.try_combine(cap) && (depth < max_scan_depth_)) {
-    for (auto scan_range : scan_ranges.parts()) {
-      scan_range.shrink_to_alignment(sizeof(void* __capability));
-      ptraddr_t last = cheri_align_down(scan_range.last(), sizeof(void* __capability));
-      for (ptraddr_t next = scan_range.base(); next <= last; next += sizeof(void* __capability)) {
-        void* __capability candidate_cap;
-        asm("ldr %w[candidate], [%w[addr]]\n"
-            : [candidate] "=r"(candidate_cap)
-            : [addr] "r"(cheri_address_set(cap, next)));
-        if (cheri_tag_get(candidate_cap)) {
-          SCAN_LOG(2, "Recursing at %zx: %#lp\n", next, candidate_cap);
-          try {
-            scan(candidate_cap, depth + 1);
-          } catch (int n) {
-            fprintf(stderr, " found at %lx while scanning capability %#p\n", next, cap);
-            throw(n + 1);
-          }
-        } else {
-          SCAN_LOG(2, "No cap at %zx.\n", next);
+  // Our own heap data (SparseRange parts, the worklist, and so on) lives in the
+  // arena, which is reserved once, so excluding it all is a single range that
+  // only needs to be checked, not recomputed.
+  //
+  // TODO: The `Map` objects themselves are allocated by the caller, and are
+  // still scanned (though their ranges are in the arena).
+  SparseRange exclude_self(Range::from_object(this));
+  Arena const& arena = Arena::get();
+  if (arena.limit() > arena.base()) {
+    exclude_self.combine(Range::from_base_limit(arena.base(), arena.limit()));
+  }
+  // Blocks that didn't fit in the arena are excluded individually, as of the
+  // start of each scan.
+  for (auto const& block : arena.fallback_blocks()) {
+    exclude_self.combine(Range::from_base_length(block.first, block.second));
+  }
+  if (exclude_self != exclude_self_) {
+    exclude_self_ = exclude_self;
+    filter_stale_ = true;
+  }
+  if (filter_stale_) {
+    filter_.rebuild(include_, exclude_self_);
+    filter_stale_ = false;
+  }
+}
+
+bool Mapper::can_skip_capability_free_pages() { return can_probe_capability_free_pages(); }
+
+void Mapper::add_root(void* __capability cap, char const* name) {
+  if (cheri_tag_get(cap)) {
+    roots_.push_back(std::make_pair(name, cap));
+    worklist_.push(ScanItem{cap, 0, name, 0, ScanItem::kNoParent});
+  }
+}
+
+void Mapper::begin(RootList const& roots) {
+  update_self_ranges();
+  root_batch_ = roots;
+  auto by_address = [](NamedRoot const& a, NamedRoot const& b) {
+    return cheri_base_get(a.cap) < cheri_base_get(b.cap);
+  };
+  std::sort(root_batch_.begin(), root_batch_.end(), by_address);
+  // The worklist pops from the back when scanning depth-first, so push in
+  // reverse to visit the lowest address first.
+  if (worklist_.order() == ScanOrder::kDepthFirst) {
+    std::reverse(root_batch_.begin(), root_batch_.end());
+  }
+  for (auto const& root : root_batch_) add_root(root.cap, root.name);
+  root_batch_.clear();
+}
+
+bool Mapper::check_memory_budget() {
+  budget_countdown_ = kBudgetInterval;
+  if (memory_budget_ == 0) return true;
+  size_t used = Arena::get().bytes();
+  if (used > stats_.memory_peak) stats_.memory_peak = used;
+  // Coarsen with ever larger gaps until usage is comfortably within the budget,
+  // or merging further wouldn't help.
+  size_t const soft_limit = memory_budget_ - memory_budget_ / 4;
+  uint64_t gap = (stats_.coarsen_gap == 0) ? kMinCoarsenGap : stats_.coarsen_gap * 16;
+  while ((used > soft_limit) && (gap <= kMaxCoarsenGap)) {
+    coarsen_maps(gap);
+    used = Arena::get().bytes();
+    gap *= 16;
+  }
+  if (used <= memory_budget_) return true;
+  truncate();
+  return false;
+}
+
+void Mapper::coarsen_maps(uint64_t gap) {
+  stats_.coarsen_gap = gap;
+  // `load_cap_map_` is left exact: `claim()` uses it to decide what to scan, so
+  // merging its gaps would skip memory that no capability reached, and the
+  // traversal would no longer match an unbudgeted one.
+  //
+  // `user_map()` is only const for the benefit of callers; the maps belong to
+  // this object.
+  for (size_t i = 0; i < user_map_count(); i++) {
+    stats_.coarsened_bytes += const_cast<Map&>(user_map(i)).coarsen(gap);
+  }
+}
+
+void Mapper::truncate() {
+  stats_.truncated = 1;
+  cursor_.active = false;
+  worklist_.clear();
+}
+
+template <unsigned kPolicy>
+void Mapper::drain_with() {
+  resume_with<kPolicy>(StepBudget());
+}
+
+template <unsigned kPolicy>
+bool Mapper::resume_with(StepBudget const& budget) {
+  uint64_t start = now_ticks();
+  uint64_t map_ns = stats_.map_ns;
+  step_page_ranges_.clear();
+  if ((threads_ > 1) && !cursor_.active) {
+    // Multi-threaded scans can't be paused, so they always run to completion.
+    try {
+      if (check_memory_budget()) drain_parallel();
+    } catch (std::bad_alloc const&) {
+      truncate();
+    }
+  } else {
+    // Only `PoisonMap` throws, and only to abort the scan. The path to the
+    // offending capability is recorded in the worklist, so a single handler
+    // here is enough to report it.
+    ScanItem item = cursor_.item;
+    uint64_t granules = 0;
+    bool const timed = budget.ns != UINT64_MAX;
+    try {
+      // Always make some progress, however small the budget.
+      do {
+        if (!cursor_.active) {
+          if (worklist_.empty()) break;
+          if ((memory_budget_ != 0) && (budget_countdown_-- == 0) && !check_memory_budget()) break;
+          item = worklist_.pop();
+          visit<kPolicy>(item);
+          if (!cursor_.active) continue;
         }
+        uint64_t left = (granules < budget.granules) ? budget.granules - granules : 1;
+        // Check the clock between chunks, so a time budget bounds even a step
+        // through one large region.
+        if (timed) left = std::min(left, kTimedChunkGranules);
+        granules += scan_cursor<kPolicy>(left);
+      } while ((granules < budget.granules) && (!timed || (elapsed_ns(start) < budget.ns)));
+    } catch (int) {
+      worklist_.print_trail(stderr, item);
+      abort();
+    } catch (std::bad_alloc const&) {
+      truncate();
+    }
+  }
+  if (done()) worklist_.clear();
+  step_pages_ = SparseRange();
+  step_pages_.combine_all(&step_page_ranges_);
+  stats_.traversal_ns += elapsed_ns(start) - (stats_.map_ns - map_ns);
+  return done();
+}
+
+void Mapper::rescan() {
+  // Reading a page that has been unmapped would fault, so drop those first.
+  uint64_t start = now_ticks();
+  SparseRange mapped = LoadCapMap::vmmap();
+  stats_.vmmap_ns += elapsed_ns(start);
+  if (include_from_vmmap_ && (mapped != include_)) {
+    include_ = mapped;
+    filter_stale_ = true;
+  }
+  size_t kept = 0;
+  for (auto const& page : pages_) {
+    if (mapped.includes(page.range)) pages_[kept++] = page;
+  }
+  stale_pages_ = pages_.size() - kept;
+  pages_.erase(pages_.begin() + kept, pages_.end());
+
+  update_self_ranges();
+  generation_++;
+  changed_pages_ = 0;
+  // Pages found by this rescan are appended to `pages_` by `drain()`, so only
+  // queue capabilities here.
+  for (auto& page : pages_) {
+    uint64_t hash = page.hash;
+    uint64_t caps = page.caps;
+    summarise_page(page.authority, &page);
+    if ((page.hash == hash) && (page.caps == caps)) continue;
+    page.generation = generation_;
+    changed_pages_++;
+    for_each_tagged(page.authority, page.range, [&](ptraddr_t addr, void* __capability found) {
+      worklist_.push(ScanItem{found, page.depth + 1, page.root, addr, ScanItem::kNoParent});
+    });
+  }
+  drain();
+}
+
+template <unsigned kPolicy>
+void Mapper::visit(ScanItem const& item) {
+  bool const track_depth = kPolicy & kScanTrackDepth;
+  void* __capability cap = item.cap;
+  uint64_t depth = item.depth;
+  if ((kPolicy & kScanLog) || (SCAN_LOG_VERBOSITY >= 1)) {
+    fprintf(stderr, "scan(%#lp, %" PRIu64 ")\n", cap, depth);
+  }
+  if (track_depth && (depth > max_seen_scan_depth_)) max_seen_scan_depth_ = depth;
+
+  // Capabilities found by scanning a region are passed to the maps in batches,
+  // by `scan_cursor()`, so only roots (which were not found that way) are
+  // passed here.
+  if (item.parent == ScanItem::kNoParent) update_maps(&cap, 1);
+
+  if (!claim(item, track_depth, filter_, &scan_pieces_)) return;
+  // Record every claimed page, including any that are about to be skipped, so
+  // that `rescan()` notices if they gain capabilities later.
+  if (incremental_) record_pages(cap, item, scan_pieces_, generation_, &pages_);
+  if (skip_capability_free_pages_) {
+    drop_capability_free_pages(cap, &scan_pieces_, &page_pieces_, &page_status_);
+  }
+  cursor_.active = true;
+  cursor_.item = item;
+  cursor_.parent = worklist_.record(item);
+  cursor_.piece = 0;
+  cursor_.next = 0;
+}
+
+template <unsigned kPolicy>
+uint64_t Mapper::scan_cursor(uint64_t max_granules) {
+  static size_t const page_size = getpagesize();
+  size_t const granule = sizeof(void* __capability);
+  bool const track_depth = kPolicy & kScanTrackDepth;
+  ScanItem const& item = cursor_.item;
+  uint64_t depth = track_depth ? item.depth + 1 : 0;
+
+  uint64_t granules = 0;
+  uint64_t examined = 0;
+  bool const sampling = sample_interval_ > 1;
+  SparseRange::Cursor exact = exact_ranges_.cursor();
+  found_caps_.clear();
+  found_at_.clear();
+  // The scan is a two-stage pipeline. First, the granule loop only collects the
+  // candidates (and their addresses), so that it can keep the memory system
+  // busy. Then they are queued and passed to the maps in bulk.
+  uint64_t load_start = now_ticks();
+  auto collect = [&](ptraddr_t addr, void* __capability found) {
+    found_caps_.push_back(found);
+    found_at_.push_back(addr);
+  };
+  while ((cursor_.piece < scan_pieces_.size()) && (granules < max_granules)) {
+    Range piece = scan_pieces_[cursor_.piece].shrunk_to_alignment(granule);
+    if (cursor_.next < piece.base()) cursor_.next = piece.base();
+    if (piece.is_empty() || (cursor_.next > piece.last())) {
+      cursor_.piece++;
+      cursor_.next = 0;
+      continue;
+    }
+    uint64_t left = (piece.last() - cursor_.next) / granule + 1;
+    uint64_t count = std::min(left, max_granules - granules);
+    Range chunk = Range::from_base_length(cursor_.next, count * granule);
+    if (sampling) {
+      examined += for_each_sampled(item.cap, chunk, sample_interval_, &exact, &sample_state_,
+                                   &samples_, collect);
+    } else {
+      for_each_tagged(item.cap, chunk, collect);
+      examined += count;
+    }
+    step_page_ranges_.push_back(
+        Range::from_base_last(cheri_align_down(chunk.base(), page_size),
+                              cheri_align_up(chunk.last() + 1, page_size) - 1));
+    granules += count;
+    if (count == left) {
+      cursor_.piece++;
+      cursor_.next = 0;
+    } else {
+      cursor_.next += count * granule;
+    }
+  }
+  if (cursor_.piece >= scan_pieces_.size()) cursor_.active = false;
+  stats_.load_ns += elapsed_ns(load_start);
+
+  for (size_t i = 0; i < found_caps_.size(); i++) {
+    worklist_.push(ScanItem{found_caps_[i], depth, item.root, found_at_[i], cursor_.parent});
+  }
+  stats_.granules += examined;
+  stats_.tagged += found_caps_.size();
+  if (sampling) stats_.sample_population += granules;
+  // If a map throws here, the trail printed by `resume_with()` leads to the
+  // cursor's item, in which the offending capability was found.
+  update_maps(found_caps_.data(), found_caps_.size());
+  return granules;
+}
+
+bool Mapper::claim(ScanItem const& item, bool check_depth, ScanFilter const& filter,
+                   RangeVector* pieces) {
+  void* __capability cap = item.cap;
+  Range range = Range::from_cap(cap);
+
+  // Unsealers and sealed capabilities are handled before deduplication: the
+  // bounds of an unsealer are object types, and those of a sealed capability
+  // are its object's, so neither says anything about what has been scanned.
+  // An unsealer may also grant loads, so register it whether or not it is then
+  // scanned.
+  if (!cheri_is_sealed(cap) && (cheri_perms_get(cap) & CHERI_PERM_UNSEAL)) add_unsealer(cap);
+  if (!LoadCapMap::can_load_caps(cap)) {
+    if (cheri_is_sealed(cap)) {
+      stats_.rejected_sealed++;
+      // Sentries are only unsealed by branching to them.
+      if (!cheri_is_sentry(cap)) defer_sealed(item);
+    } else {
+      stats_.rejected_no_load_cap++;
+    }
+    return false;
+  }
+
+  // Anything inside the last claimed range has already been (or is being)
+  // scanned, so this catches sub-objects without a hash lookup.
+  if (last_claimed_.includes(range) || seen_.contains(cap)) {
+    dedup_hits_++;
+    stats_.rejected_mapped++;
+    return false;
+  }
+  dedup_misses_++;
+  if (check_depth && (item.depth >= max_scan_depth_)) {
+    // The memory is reachable, so it is mapped, but not scanned. It isn't added
+    // to `seen_` or `last_claimed_`, but that makes no difference: a later path
+    // to it (even a shorter one) finds it already in `load_cap_map_`, and the
+    // clip below leaves nothing to scan. Breadth-first scans (see `ScanOrder`)
+    // reach everything by a shortest path first.
+    stats_.rejected_depth++;
+    load_cap_map_.try_combine(cap);
+    return false;
+  }
+
+  pieces->clear();
+  filter.clip(range, load_cap_map_.sparse_range(), pieces);
+  if (pieces->empty()) {
+    if (load_cap_map_.sparse_range().includes(range)) {
+      stats_.rejected_mapped++;
+    } else {
+      stats_.rejected_excluded++;
+    }
+  }
+  load_cap_map_.try_combine(cap);
+  seen_.insert(cap);
+  last_claimed_ = range;
+  return true;
+}
+
+void Mapper::combine_maps(void* __capability const* caps, size_t count) {
+  for (size_t done = 0; done < count; done += kMapBatch) {
+    size_t batch = std::min(count - done, kMapBatch);
+    for (auto& map : maps_) map->try_combine_batch(caps + done, batch);
+  }
+}
+
+void Mapper::defer_sealed(ScanItem const& item) {
+  uint64_t otype = cheri_type_get(item.cap);
+  if (unsealable_.includes(otype)) {
+    for (auto unsealer : unsealers_) {
+      if (Range::from_cap(unsealer).includes(otype)) {
+        unseal(item, unsealer);
+        return;
       }
     }
   }
+  sealed_.add(item);
 }
 
+void Mapper::add_unsealer(void* __capability unsealer) {
+  Range otypes = Range::from_cap(unsealer);
+  if (otypes.is_empty() || unsealable_.includes(otypes)) return;
+  unsealers_.push_back(unsealer);
+  unsealable_.combine(otypes);
+  unsealing_.clear();
+  sealed_.take(otypes.base(), otypes.last(), &unsealing_);
+  for (auto const& item : unsealing_) unseal(item, unsealer);
+}
+
+void Mapper::unseal(ScanItem const& item, void* __capability unsealer) {
+  uint64_t otype = cheri_type_get(item.cap);
+  void* __capability cap = cheri_unseal(item.cap, cheri_address_set(unsealer, otype));
+  if (!cheri_tag_get(cap)) return;
+  stats_.unsealed++;
+  // Unsealed capabilities are not found in any scanned region, so (like roots)
+  // they are passed to the maps when they are visited.
+  worklist_.push(ScanItem{cap, item.depth, item.root, item.found_at, ScanItem::kNoParent});
+}
+
+void Mapper::update_maps(void* __capability const* caps, size_t count) {
+  if (count == 0) return;
+  uint64_t start = now_ticks();
+  combine_maps(caps, count);
+  stats_.map_ns += elapsed_ns(start);
+}
+
+ScanStats Mapper::stats() const {
+  ScanStats stats = stats_;
+  SparseRange const& ranges = load_cap_map_.sparse_range();
+  stats.range_combines = ranges.combine_count();
+  stats.range_removes = ranges.remove_count();
+  stats.range_parts = ranges.parts().size();
+  stats.include_parts = include_.parts().size();
+  auto add = [&](Map const& map) {
+    RangeSet const& ranges = map.ranges();
+    stats.maps.push_back(MapRangeStats{map.name(), ranges.size(), range_bytes(ranges)});
+  };
+  add(load_cap_map_);
+  for (size_t i = 0; i < user_map_count(); i++) {
+    Map const& map = user_map(i);
+    if (map.submap_count() == 0) add(map);
+    for (size_t j = 0; j < map.submap_count(); j++) add(map.submap(j));
+  }
+  stats.sealed_pending = sealed_.size();
+  stats.sample_interval = sample_interval_;
+  return stats;
+}
+
+// Instantiate the engine for every `ScanPolicy`, for `BasicStaticMapper`.
+template void Mapper::drain_with<kScanPolicyNone>();
+template void Mapper::drain_with<kScanTrackDepth>();
+template void Mapper::drain_with<kScanLog>();
+template void Mapper::drain_with<kScanTrackDepth | kScanLog>();
+template bool Mapper::resume_with<kScanPolicyNone>(StepBudget const&);
+template bool Mapper::resume_with<kScanTrackDepth>(StepBudget const&);
+template bool Mapper::resume_with<kScanLog>(StepBudget const&);
+template bool Mapper::resume_with<kScanTrackDepth | kScanLog>(StepBudget const&);
+
 void Mapper::print_json(FILE* stream) {
-  fprintf(stream, "\"capmap\": {\n");
+  JsonWriter out(stream);
+  print_json(&out);
+}
+
+void print_stats_json(JsonWriter* out, ScanStats const& stats) {
+  auto field = [&](char const* name, uint64_t value, char const* suffix) {
+    out->raw('"');
+    out->raw(name);
+    out->raw("\": ");
+    out->dec(value);
+    out->raw(suffix);
+  };
+  out->raw("    \"stats\": {\n");
+  out->raw("        \"granules\": { ");
+  field("loaded", stats.granules, ", ");
+  field("tagged", stats.tagged, ", ");
+  field("untagged", stats.untagged(), ", ");
+  field("unreadable", stats.unreadable, " },\n");
+  out->raw("        \"rejected\": { ");
+  field("sealed", stats.rejected_sealed, ", ");
+  field("no-load-cap", stats.rejected_no_load_cap, ", ");
+  field("excluded", stats.rejected_excluded, ", ");
+  field("mapped", stats.rejected_mapped, ", ");
+  field("depth", stats.rejected_depth, " },\n");
+  out->raw("        \"sealed\": { ");
+  field("unsealed", stats.unsealed, ", ");
+  field("pending", stats.sealed_pending, " },\n");
+  out->raw("        \"ranges\": { ");
+  field("combines", stats.range_combines, ", ");
+  field("removes", stats.range_removes, ", ");
+  field("parts", stats.range_parts, ", ");
+  field("include-parts", stats.include_parts, " },\n");
+  out->raw("        \"map-ranges\": {");
+  char const* sep = "\n";
+  for (auto const& map : stats.maps) {
+    out->raw(sep);
+    out->raw("            ");
+    out->string(map.name);
+    out->raw(": { ");
+    field("parts", map.parts, ", ");
+    field("bytes", map.bytes, " }");
+    sep = ",\n";
+  }
+  out->raw("\n        },\n");
+  out->raw("        \"time-ns\": { ");
+  field("vmmap", stats.vmmap_ns, ", ");
+  field("traversal", stats.traversal_ns, ", ");
+  field("load", stats.load_ns, ", ");
+  field("maps", stats.map_ns, ", ");
+  field("output", stats.output_ns, " },\n");
+  out->raw("        \"memory\": { ");
+  field("peak", stats.memory_peak, ", ");
+  field("coarsened", stats.coarsened_bytes, ", ");
+  field("gap", stats.coarsen_gap, ", ");
+  field("truncated", stats.truncated, " },\n");
+  out->raw("        \"sampling\": { ");
+  field("interval", stats.sample_interval, ", ");
+  field("population", stats.sample_population, " }\n");
+}
+
+void Mapper::print_json(JsonWriter* out) {
+  uint64_t start = now_ticks();
+  out->raw("\"capmap\": {\n");
 
   {
     char const* sep = "\n        ";
-    fprintf(stream, "    \"roots\": {");
+    out->raw("    \"roots\": {");
     for (auto const& name_cap : roots_) {
-      fprintf(stream, "%s\"%s\": \"", sep, name_cap.first);
-      print_raw_cap(stream, name_cap.second);
-      fprintf(stream, "\"");
+      out->raw(sep);
+      out->string(name_cap.first);
+      out->raw(": \"");
+      out->raw_cap(name_cap.second);
+      out->raw('"');
       sep = ",\n        ";
     }
-    fprintf(stream, "\n    }\n");
+    out->raw("\n    },\n");
   }
 
-  fprintf(stream, "    \"scan\": {\n");
-  fprintf(stream, "        \"include\": ");
-  include_.print_json(stream, "        ");
-  fprintf(stream, ",\n");
-  fprintf(stream, "        \"exclude\": ");
-  exclude_self_.print_json(stream, "        ");
-  fprintf(stream, ",\n");
-  fprintf(stream, "        \"depth\": %" PRIu64 "\n    },\n", max_seen_scan_depth());
+  out->raw("    \"scan\": {\n");
+  out->raw("        \"include\": ");
+  ::capmap::print_json(out, include_.parts(), "        ");
+  out->raw(",\n");
+  out->raw("        \"exclude\": ");
+  ::capmap::print_json(out, exclude_self_.parts(), "        ");
+  out->raw(",\n");
+  out->raw("        \"depth\": ");
+  out->dec(max_seen_scan_depth());
+  out->raw(",\n");
+  out->raw("        \"dedup\": { \"hits\": ");
+  out->dec(dedup_hits_);
+  out->raw(", \"misses\": ");
+  out->dec(dedup_misses_);
+  out->raw(" }\n    },\n");
+
+  out->raw("    \"maps\": {");
+  auto print_map = [&](Map const& map, char const* sep) {
+    out->raw(sep);
+    out->raw("        ");
+    out->string(map.name());
+    out->raw(": {\n");
+    out->raw("            \"address-space\": ");
+    out->string(map.address_space());
+    out->raw(",\n");
+    out->raw("            \"ranges\": ");
+    map.print_ranges_json(out, "            ");
+    out->raw("\n        }");
+  };
+  print_map(load_cap_map_, "\n");
+  for (size_t i = 0; i < user_map_count(); i++) {
+    Map const& map = user_map(i);
+    if (map.submap_count() == 0) print_map(map, ",\n");
+    for (size_t j = 0; j < map.submap_count(); j++) print_map(map.submap(j), ",\n");
+  }
+  out->raw("\n    },\n");
+
+  stats_.output_ns += elapsed_ns(start);
+  print_stats_json(out, this->stats());
+  out->raw("    }\n}\n");
+  out->flush();
+}
 
-  fprintf(stream, "    \"maps\": {\n");
-  fprintf(stream, "        \"%s\": {\n", load_cap_map_.name());
-  fprintf(stream, "            \"address-space\": \"%s\",\n", load_cap_map_.address_space());
-  fprintf(stream, "            \"ranges\": ");
-  ::capmap::print_json(stream, load_cap_map_.ranges(), "            ");
-  for (auto const& map : maps_) {
-    fprintf(stream, ",\n        \"%s\":\n", map->name());
-    fprintf(stream, "            \"address-space\": \"%s\",\n", map->address_space());
-    fprintf(stream, "            \"ranges\": ");
-    ::capmap::print_json(stream, map->ranges(), "            ");
+namespace {
+
+// The common `Map::try_combine_batch()` implementation for maps backed by a
+// single SparseRange: filter the whole batch, then merge it in one sweep.
+template <typename F>
+void combine_batch(SparseRange* ranges, RangeVector* scratch,
+                   void* __capability const* caps, size_t count, F&& filter) {
+  scratch->clear();
+  for (size_t i = 0; i < count; i++) {
+    Range range;
+    if (filter(caps[i], &range)) scratch->push_back(range);
   }
-  fprintf(stream, "\n        }\n    }\n}\n");
+  ranges->combine_all(scratch);
 }
 
-bool LoadCapMap::try_combine(void* __capability cap) {
+}  // namespace
+
+bool LoadCapMap::filter(void* __capability cap, Range* range) {
   if (!cheri_tag_get(cap)) return false;
-  // TODO: Track sealed caps and see if we can unseal them later.
+  // Sealed capabilities are kept by `Mapper`, and passed to the maps again if
+  // they can be unsealed.
   if (cheri_is_sealed(cap)) return false;
 
   size_t const perms = CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP;
   if ((cheri_perms_get(cap) & perms) != perms) return false;
 
-  ranges_.combine(Range::from_cap(cap));
+  *range = Range::from_cap(cap);
+  return true;
+}
+
+bool LoadCapMap::try_combine(void* __capability cap) {
+  Range range;
+  if (!filter(cap, &range)) return false;
+  ranges_.combine(range);
   return true;
 }
 
+void LoadCapMap::try_combine_batch(void* __capability const* caps, size_t count) {
+  combine_batch(&ranges_, &batch_, caps, count, filter);
+}
+
 bool LoadCapMap::includes_cap(ptraddr_t addr, ptraddr_t* cont) const {
-  // TODO: Abstract this in SparseRange somehow. This is just
-  // SparseRange::includes() with some extra logic using the intermediate value.
-  auto range = Range::from_base_length(addr, sizeof(void* __capability));
+  size_t const granule = sizeof(void* __capability);
+  auto range = Range::from_base_length(addr, granule);
   auto candidate = ranges_.parts().lower_bound(range);
   if ((candidate != ranges_.parts().end()) && candidate->includes(range)) {
-    // TODO: Advance better, to avoid redundant checks in large ranges.
-    *cont = addr + sizeof(void* __capability);
+    // Skip to the first granule that the covering part doesn't fully include.
+    // If the part reaches the top of the address space, there is none, and
+    // this wraps to 0.
+    *cont = (candidate->last() + 1) & ~static_cast<ptraddr_t>(granule - 1);
     return true;
   }
   return false;
 }
 
-SparseRange LoadCapMap::vmmap() {
-  pid_t pid = getpid();
-  int count;
-  kinfo_vmentry const* vm = kinfo_getvmmap(pid, &count);
-  SparseRange map;
-  for (int i = 0; i < count; i++) {
-    auto prot = vm[i].kve_protection;
-    if ((prot & KVME_PROT_READ) && (prot & KVME_PROT_READ_CAP)) {
-      map.combine(Range::from_base_limit(vm[i].kve_start, vm[i].kve_end));
-    }
-  }
-  return map;
-}
+SparseRange LoadCapMap::vmmap() { return VmMap::process_ranges(); }
 
-bool LoadMap::try_combine(void* __capability cap) {
+bool LoadMap::filter(void* __capability cap, Range* range) {
   if (!cheri_tag_get(cap)) return false;
   if (cheri_is_sealed(cap)) return false;
 
   if (cheri_perms_get(cap) & CHERI_PERM_LOAD) {
-    ranges_.combine(Range::from_cap(cap));
+    *range = Range::from_cap(cap);
     return true;
   }
   return false;
 }
 
-bool PermissionMap::try_combine(void* __capability cap) {
+bool LoadMap::try_combine(void* __capability cap) {
+  Range range;
+  if (!filter(cap, &range)) return false;
+  ranges_.combine(range);
+  return true;
+}
+
+void LoadMap::try_combine_batch(void* __capability const* caps, size_t count) {
+  combine_batch(&ranges_, &batch_, caps, count, filter);
+}
+
+bool PermissionMap::filter(void* __capability cap, Range* range) const {
   if (!cheri_tag_get(cap) || cheri_is_sealed(cap)) return false;
   if ((cheri_perms_get(cap) & perms_) != perms_) return false;  // match ALL perms
 
-  ranges_.combine(Range::from_cap(cap));
+  *range = Range::from_cap(cap);
   return true;
 }
 
-bool BranchMap::try_combine(void* __capability cap) {
+bool PermissionMap::try_combine(void* __capability cap) {
+  Range range;
+  if (!filter(cap, &range)) return false;
+  ranges_.combine(range);
+  return true;
+}
+
+void PermissionMap::try_combine_batch(void* __capability const* caps, size_t count) {
+  combine_batch(&ranges_, &batch_, caps, count,
+                [this](void* __capability cap, Range* range) { return filter(cap, range); });
+}
+
+bool BranchMap::filter(void* __capability cap, Range* range) {
   if (!cheri_tag_get(cap) || (cheri_is_sealed(cap) && !cheri_is_sentry(cap))) return false;
   if (!(cheri_perms_get(cap) & CHERI_PERM_EXECUTE)) return false;
 
   // If it's a sentry, we treat it as length 1.
   if (cheri_is_sentry(cap))
-    ranges_.combine(Range::from_base_length(cheri_address_get(cap), 1));
+    *range = Range::from_base_length(cheri_address_get(cap), 1);
   else
-    ranges_.combine(Range::from_cap(cap));
+    *range = Range::from_cap(cap);
+  return true;
+}
+
+bool BranchMap::try_combine(void* __capability cap) {
+  Range range;
+  if (!filter(cap, &range)) return false;
+  ranges_.combine(range);
+  return true;
+}
+
+void BranchMap::try_combine_batch(void* __capability const* caps, size_t count) {
+  combine_batch(&ranges_, &batch_, caps, count, filter);
+}
+
+bool PermissionComboMap::add(const char* name, cheri_perms_t perms) {
+  if (combinations_.size() >= kMaxCombinations) return false;
+  combinations_.push_back(Combination(name, addrsp_, perms));
+  for (auto& entry : cache_) entry.valid = false;
+  return true;
+}
+
+uint64_t PermissionComboMap::matches(void* __capability cap) {
+  if (!cheri_tag_get(cap) || cheri_is_sealed(cap)) return 0;
+  uint64_t perms = cheri_perms_get(cap);
+  // Real processes use few distinct permission masks, so this almost always
+  // hits.
+  CacheEntry& entry = cache_[(perms ^ (perms >> 7) ^ (perms >> 13)) % kCacheSize];
+  if (!entry.valid || (entry.perms != perms)) {
+    entry.perms = perms;
+    entry.matches = 0;
+    for (size_t i = 0; i < combinations_.size(); i++) {
+      uint64_t wanted = combinations_[i].perms_;
+      if ((perms & wanted) == wanted) entry.matches |= uint64_t(1) << i;  // match ALL perms
+    }
+    entry.valid = true;
+  }
+  return entry.matches;
+}
+
+bool PermissionComboMap::try_combine(void* __capability cap) {
+  uint64_t found = matches(cap);
+  if (found == 0) return false;
+  Range range = Range::from_cap(cap);
+  for (size_t i = 0; found != 0; i++, found >>= 1) {
+    if (found & 1) combinations_[i].ranges_.combine(range);
+  }
+  union_.combine(range);
+  return true;
+}
+
+void PermissionComboMap::try_combine_batch(void* __capability const* caps, size_t count) {
+  for (auto& combination : combinations_) combination.batch_.clear();
+  batch_.clear();
+  for (size_t i = 0; i < count; i++) {
+    uint64_t found = matches(caps[i]);
+    if (found == 0) continue;
+    Range range = Range::from_cap(caps[i]);
+    for (size_t c = 0; found != 0; c++, found >>= 1) {
+      if (found & 1) combinations_[c].batch_.push_back(range);
+    }
+    batch_.push_back(range);
+  }
+  for (auto& combination : combinations_) combination.ranges_.combine_all(&combination.batch_);
+  union_.combine_all(&batch_);
+}
+
+uint64_t PermissionComboMap::coarsen(uint64_t gap) {
+  uint64_t added = 0;
+  for (auto& combination : combinations_) added += combination.ranges_.coarsen(gap);
+  union_.coarsen(gap);
+  return added;
+}
+
+bool PermissionComboMap::Combination::try_combine(void* __capability cap) {
+  if (!cheri_tag_get(cap) || cheri_is_sealed(cap)) return false;
+  if ((cheri_perms_get(cap) & perms_) != perms_) return false;
+  ranges_.combine(Range::from_cap(cap));
+  return true;
+}
+
+bool ExecuteMap::filter(void* __capability cap, Range* range) {
+  if (!cheri_tag_get(cap) || (cheri_is_sealed(cap) && !cheri_is_sentry(cap))) return false;
+  if (!(cheri_perms_get(cap) & CHERI_PERM_EXECUTE)) return false;
+  // Unlike BranchMap, use the bounds of sentries too; they become PCC's bounds.
+  *range = Range::from_cap(cap);
   return true;
 }
 
+bool ExecuteMap::try_combine(void* __capability cap) {
+  Range range;
+  if (!filter(cap, &range)) return false;
+  index_.insert(range);
+  union_.combine(range);
+  return true;
+}
+
+void ExecuteMap::try_combine_batch(void* __capability const* caps, size_t count) {
+  batch_.clear();
+  for (size_t i = 0; i < count; i++) {
+    Range range;
+    if (filter(caps[i], &range)) {
+      index_.insert(range);
+      batch_.push_back(range);
+    }
+  }
+  union_.combine_all(&batch_);
+}
+
+void ExecuteMap::print_ranges_json(JsonWriter* out, char const* line_prefix) const {
+  JsonRangeStream stream(out, line_prefix, false);
+  for (auto range : index_) stream.add(range);
+  stream.finish();
+}
+
 bool PoisonMap::try_combine(void* __capability cap) {
   if (!cheri_tag_get(cap) || cheri_is_sealed(cap)) return false;
   if (!(cheri_perms_get(cap) & perms_)) return false;  // match ANY perms
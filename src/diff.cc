@@ -0,0 +1,449 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-diff.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "include/capmap-binary.h"
+
+namespace capmap {
+
+namespace {
+
+// Append the parts of `a` that are not in `b` to `*out`. Both must be sorted
+// and disjoint.
+void subtract(RangeView a, RangeView b, RangeVector* out) {
+  size_t j = 0;
+  for (Range range : a) {
+    // Skip the parts of `b` below `range`. The rest may reach later ranges of
+    // `a` too, so they are not skipped yet.
+    while ((j < b.size()) && (b[j].last() < range.base())) j++;
+    ptraddr_t base = range.base();
+    bool covered = false;
+    for (size_t k = j; (k < b.size()) && (b[k].base() <= range.last()); k++) {
+      if (b[k].base() > base) out->push_back(Range::from_base_last(base, b[k].base() - 1));
+      if (b[k].last() >= range.last()) {
+        covered = true;
+        break;
+      }
+      base = b[k].last() + 1;
+    }
+    if (!covered) out->push_back(Range::from_base_last(base, range.last()));
+  }
+}
+
+// Append the ranges of `a` that are not also ranges of `b` to `*out`. Both must
+// be sorted by base, then by last, with no duplicates.
+void exclude_bounds(RangeView a, RangeView b, RangeVector* out) {
+  auto by_base = [](Range x, Range y) {
+    return (x.base() != y.base()) ? (x.base() < y.base()) : (x.last() < y.last());
+  };
+  size_t j = 0;
+  for (Range range : a) {
+    while ((j < b.size()) && by_base(b[j], range)) j++;
+    if ((j == b.size()) || (b[j] != range)) out->push_back(range);
+  }
+}
+
+void compare(RangeView before, RangeView after, MapChange* change) {
+  // Maps that keep individual bounds are compared bound by bound; merged maps
+  // are compared address by address.
+  if (before.overlapping() || after.overlapping()) {
+    exclude_bounds(after, before, &change->added);
+    exclude_bounds(before, after, &change->removed);
+  } else {
+    subtract(after, before, &change->added);
+    subtract(before, after, &change->removed);
+  }
+}
+
+bool same_bits(binary::Root const& a, binary::Root const& b) {
+  return (a.tag == b.tag) && (a.high == b.high) && (a.low == b.low);
+}
+
+// The indices of `snapshot`'s roots, sorted by name, and then by index.
+ArenaVector<size_t> roots_by_name(BinarySnapshot const& snapshot) {
+  ArenaVector<size_t> order(snapshot.root_count());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    int cmp = strcmp(snapshot.root_name(a), snapshot.root_name(b));
+    return (cmp != 0) ? (cmp < 0) : (a < b);
+  });
+  return order;
+}
+
+void print_root(JsonWriter* out, binary::Root const& root) {
+  out->raw('"');
+  out->raw_cap_bits(root.tag, root.high, root.low);
+  out->raw('"');
+}
+
+void print_ranges(JsonWriter* out, RangeVector const& ranges, char const* line_prefix) {
+  JsonRangeStream stream(out, line_prefix, false);
+  for (auto range : ranges) stream.add(range);
+  stream.finish();
+}
+
+void pad(ByteWriter* out, size_t size) {
+  static char const zeros[binary::kAlign] = {};
+  out->raw(zeros, binary::aligned(size) - size);
+}
+
+}  // namespace
+
+void ScanDiff::compute(BinarySnapshot const& before, BinarySnapshot const& after) {
+  roots_.clear();
+  maps_.clear();
+  depth_before_ = before.config().max_seen_scan_depth;
+  depth_after_ = after.config().max_seen_scan_depth;
+  compare_roots(before, after);
+
+  ArenaVector<char> matched(before.map_count(), false);
+  auto add = [&](char const* name, char const* address_space, RangeView old_ranges,
+                 RangeView new_ranges) {
+    MapChange change = {name, address_space, old_ranges.overlapping() || new_ranges.overlapping(),
+                        {}, {}};
+    compare(old_ranges, new_ranges, &change);
+    if (!change.added.empty() || !change.removed.empty()) maps_.push_back(std::move(change));
+  };
+  for (size_t i = 0; i < after.map_count(); i++) {
+    char const* name = after.map_name(i);
+    char const* address_space = after.map_address_space(i);
+    RangeView old_ranges;
+    for (size_t j = 0; j < before.map_count(); j++) {
+      if (matched[j] || (strcmp(before.map_name(j), name) != 0) ||
+          (strcmp(before.map_address_space(j), address_space) != 0)) {
+        continue;
+      }
+      matched[j] = true;
+      old_ranges = before.map_ranges(j);
+      break;
+    }
+    add(name, address_space, old_ranges, after.map_ranges(i));
+  }
+  for (size_t j = 0; j < before.map_count(); j++) {
+    if (!matched[j]) {
+      add(before.map_name(j), before.map_address_space(j), before.map_ranges(j), RangeView());
+    }
+  }
+}
+
+void ScanDiff::compare_roots(BinarySnapshot const& before, BinarySnapshot const& after) {
+  ArenaVector<size_t> old_order = roots_by_name(before);
+  ArenaVector<size_t> new_order = roots_by_name(after);
+  size_t i = 0;
+  size_t j = 0;
+  while ((i < old_order.size()) || (j < new_order.size())) {
+    binary::Root const* old_root = (i < old_order.size()) ? &before.root(old_order[i]) : nullptr;
+    binary::Root const* new_root = (j < new_order.size()) ? &after.root(new_order[j]) : nullptr;
+    int cmp;
+    if (!old_root) {
+      cmp = 1;
+    } else if (!new_root) {
+      cmp = -1;
+    } else {
+      cmp = strcmp(before.root_name(old_order[i]), after.root_name(new_order[j]));
+    }
+    if (cmp < 0) {
+      roots_.push_back(RootChange{before.root_name(old_order[i++]), old_root, nullptr});
+    } else if (cmp > 0) {
+      roots_.push_back(RootChange{after.root_name(new_order[j++]), nullptr, new_root});
+    } else {
+      if (!same_bits(*old_root, *new_root)) {
+        roots_.push_back(RootChange{after.root_name(new_order[j]), old_root, new_root});
+      }
+      i++;
+      j++;
+    }
+  }
+}
+
+void ScanDiff::print_json(FILE* stream) const {
+  JsonWriter out(stream);
+  print_json(&out);
+}
+
+void ScanDiff::print_json(JsonWriter* out) const {
+  if (is_empty()) {
+    out->raw("\"capmap-diff\": {}\n");
+    out->flush();
+    return;
+  }
+  out->raw("\"capmap-diff\": {");
+  char const* sep = "\n";
+
+  if (!roots_.empty()) {
+    out->raw(sep);
+    out->raw("    \"roots\": {");
+    char const* kind_sep = "\n";
+    // Print the roots of one kind (added, removed or changed), if there are any.
+    auto print_kind = [&](char const* kind, bool has_before, bool has_after) {
+      char const* root_sep = nullptr;
+      for (auto const& change : roots_) {
+        bool matches = ((change.before != nullptr) == has_before) &&
+                       ((change.after != nullptr) == has_after);
+        if (!matches) continue;
+        if (root_sep == nullptr) {
+          out->raw(kind_sep);
+          out->raw("        \"");
+          out->raw(kind);
+          out->raw("\": {");
+          kind_sep = ",\n";
+          root_sep = "\n";
+        }
+        out->raw(root_sep);
+        out->raw("            ");
+        out->string(change.name);
+        out->raw(": ");
+        if (has_before && has_after) {
+          out->raw("{ \"before\": ");
+          print_root(out, *change.before);
+          out->raw(", \"after\": ");
+          print_root(out, *change.after);
+          out->raw(" }");
+        } else {
+          print_root(out, has_after ? *change.after : *change.before);
+        }
+        root_sep = ",\n";
+      }
+      if (root_sep != nullptr) out->raw("\n        }");
+    };
+    print_kind("added", false, true);
+    print_kind("removed", true, false);
+    print_kind("changed", true, true);
+    out->raw("\n    }");
+    sep = ",\n";
+  }
+
+  if (depth_before_ != depth_after_) {
+    out->raw(sep);
+    out->raw("    \"depth\": { \"before\": ");
+    out->dec(depth_before_);
+    out->raw(", \"after\": ");
+    out->dec(depth_after_);
+    out->raw(" }");
+    sep = ",\n";
+  }
+
+  if (!maps_.empty()) {
+    out->raw(sep);
+    out->raw("    \"maps\": {");
+    char const* map_sep = "\n";
+    for (auto const& change : maps_) {
+      out->raw(map_sep);
+      out->raw("        ");
+      out->string(change.name);
+      out->raw(": {\n");
+      out->raw("            \"address-space\": ");
+      out->string(change.address_space);
+      out->raw(",\n");
+      out->raw("            \"added\": ");
+      print_ranges(out, change.added, "            ");
+      out->raw(",\n");
+      out->raw("            \"removed\": ");
+      print_ranges(out, change.removed, "            ");
+      out->raw("\n        }");
+      map_sep = ",\n";
+    }
+    out->raw("\n    }");
+  }
+  out->raw("\n}\n");
+  out->flush();
+}
+
+bool ScanDiff::write_binary(FILE* stream) const {
+  ByteWriter out(stream);
+  return write_binary(&out);
+}
+
+bool ScanDiff::write_binary(ByteWriter* out) const {
+  ArenaVector<char> strings(1, '\0');
+  auto intern = [&](char const* str) -> uint64_t {
+    if ((str == nullptr) || (*str == '\0')) return 0;
+    uint64_t offset = strings.size();
+    strings.insert(strings.end(), str, str + strlen(str) + 1);
+    return offset;
+  };
+
+  ArenaVector<binary::Root> added;
+  ArenaVector<binary::Root> removed;
+  ArenaVector<binary::Root> changed;
+  ArenaVector<binary::Root> changed_before;
+  for (auto const& change : roots_) {
+    ArenaVector<binary::Root>* roots = &added;
+    if (change.before) roots = change.after ? &changed : &removed;
+    roots->push_back(change.after ? *change.after : *change.before);
+    roots->back().name = intern(change.name);
+    if (roots == &changed) {
+      changed_before.push_back(*change.before);
+      changed_before.back().name = roots->back().name;
+    }
+  }
+  uint64_t depth[2] = {depth_before_, depth_after_};
+
+  // Only non-empty sections are written, each with the data to write.
+  ArenaVector<binary::Section> sections;
+  ArenaVector<std::pair<void const*, size_t>> data;
+  auto add = [&](uint32_t kind, void const* ptr, size_t count, size_t size) -> binary::Section* {
+    if (count == 0) return nullptr;
+    sections.push_back(binary::Section{kind, 0, 0, count, 0, 0});
+    data.push_back(std::make_pair(ptr, count * size));
+    return &sections.back();
+  };
+  add(binary::kSectionRootsAdded, added.data(), added.size(), sizeof(binary::Root));
+  add(binary::kSectionRootsRemoved, removed.data(), removed.size(), sizeof(binary::Root));
+  add(binary::kSectionRootsChanged, changed.data(), changed.size(), sizeof(binary::Root));
+  add(binary::kSectionRootsChangedBefore, changed_before.data(), changed_before.size(),
+      sizeof(binary::Root));
+  add(binary::kSectionDepth, depth, (depth_before_ != depth_after_) ? 1 : 0, sizeof(depth));
+  for (auto const& change : maps_) {
+    uint32_t flags = change.overlapping ? static_cast<uint32_t>(binary::kSectionOverlapping) : 0;
+    uint64_t name = intern(change.name);
+    uint64_t address_space = intern(change.address_space);
+    auto add_ranges = [&](uint32_t kind, RangeVector const& ranges) {
+      binary::Section* section = add(kind, ranges.data(), ranges.size(), sizeof(Range));
+      if (section == nullptr) return;
+      section->flags = flags;
+      section->name = name;
+      section->address_space = address_space;
+    };
+    add_ranges(binary::kSectionMapAdded, change.added);
+    add_ranges(binary::kSectionMapRemoved, change.removed);
+  }
+  // Names are only needed if there is anything to name.
+  if (!sections.empty()) {
+    sections.insert(sections.begin(),
+                    binary::Section{binary::kSectionStrings, 0, 0, strings.size(), 0, 0});
+    data.insert(data.begin(), std::make_pair(strings.data(), strings.size()));
+  }
+
+  size_t table_size = sizeof(binary::Header) + sections.size() * sizeof(binary::Section);
+  size_t offset = binary::aligned(table_size);
+  for (size_t i = 0; i < sections.size(); i++) {
+    sections[i].offset = offset;
+    offset += binary::aligned(data[i].second);
+  }
+
+  binary::Header header;
+  memcpy(header.magic, binary::kDiffMagic, sizeof(header.magic));
+  header.version = binary::kVersion;
+  header.section_count = sections.size();
+  header.size = offset;
+  out->raw(&header, sizeof(header));
+  out->raw(sections.data(), sections.size() * sizeof(binary::Section));
+  pad(out, table_size);
+  for (auto const& bytes : data) {
+    out->raw(bytes.first, bytes.second);
+    pad(out, bytes.second);
+  }
+  return out->flush();
+}
+
+bool ScanDiff::read_binary(void const* data, size_t size) {
+  *this = ScanDiff();
+  if (parse_binary(data, size)) return true;
+  *this = ScanDiff();
+  return false;
+}
+
+bool ScanDiff::parse_binary(void const* data, size_t size) {
+  binary::Header const* header = binary::validate(data, size, binary::kDiffMagic);
+  if (header == nullptr) return false;
+  auto bytes = static_cast<char const*>(data);
+  binary::Section const* sections = binary::sections(header);
+
+  char const* strings = nullptr;
+  uint64_t strings_size = 0;
+  for (size_t i = 0; i < header->section_count; i++) {
+    if (sections[i].kind != binary::kSectionStrings) continue;
+    if (strings != nullptr) return false;
+    strings = bytes + sections[i].offset;
+    strings_size = sections[i].count;
+  }
+  if ((strings != nullptr) && ((strings_size == 0) || (strings[strings_size - 1] != '\0'))) {
+    return false;
+  }
+  auto name = [&](uint64_t offset, char const** out) {
+    if (offset >= strings_size) return false;
+    *out = strings + offset;
+    return true;
+  };
+
+  binary::Section const* changed = nullptr;
+  binary::Section const* changed_before = nullptr;
+  for (size_t i = 0; i < header->section_count; i++) {
+    binary::Section const& section = sections[i];
+    auto roots = reinterpret_cast<binary::Root const*>(bytes + section.offset);
+    auto ranges = reinterpret_cast<Range const*>(bytes + section.offset);
+    switch (section.kind) {
+      case binary::kSectionRootsAdded:
+      case binary::kSectionRootsRemoved:
+        for (size_t r = 0; r < section.count; r++) {
+          bool added = section.kind == binary::kSectionRootsAdded;
+          RootChange change = {nullptr, added ? nullptr : &roots[r], added ? &roots[r] : nullptr};
+          if (!name(roots[r].name, &change.name)) return false;
+          roots_.push_back(change);
+        }
+        break;
+      case binary::kSectionRootsChanged:
+        if (changed != nullptr) return false;
+        changed = &section;
+        break;
+      case binary::kSectionRootsChangedBefore:
+        if (changed_before != nullptr) return false;
+        changed_before = &section;
+        break;
+      case binary::kSectionDepth:
+        if (section.count != 1) return false;
+        memcpy(&depth_before_, bytes + section.offset, sizeof(depth_before_));
+        memcpy(&depth_after_, bytes + section.offset + sizeof(depth_before_), sizeof(depth_after_));
+        break;
+      case binary::kSectionMapAdded:
+      case binary::kSectionMapRemoved: {
+        // A map's removed ranges follow its added ones, with the same names.
+        bool same = (section.kind == binary::kSectionMapRemoved) && (i > 0) &&
+                    (sections[i - 1].kind == binary::kSectionMapAdded) &&
+                    (sections[i - 1].name == section.name) &&
+                    (sections[i - 1].address_space == section.address_space);
+        if (!same) {
+          maps_.emplace_back();
+          MapChange& change = maps_.back();
+          if (!name(section.name, &change.name) ||
+              !name(section.address_space, &change.address_space)) {
+            return false;
+          }
+          change.overlapping = section.flags & binary::kSectionOverlapping;
+        }
+        RangeVector& out =
+            (section.kind == binary::kSectionMapAdded) ? maps_.back().added : maps_.back().removed;
+        out.assign(ranges, ranges + section.count);
+        break;
+      }
+    }
+  }
+
+  // Changed roots need both values.
+  if ((changed == nullptr) != (changed_before == nullptr)) return false;
+  if (changed != nullptr) {
+    if (changed->count != changed_before->count) return false;
+    auto after = reinterpret_cast<binary::Root const*>(bytes + changed->offset);
+    auto before = reinterpret_cast<binary::Root const*>(bytes + changed_before->offset);
+    for (size_t r = 0; r < changed->count; r++) {
+      RootChange change = {nullptr, &before[r], &after[r]};
+      if (!name(after[r].name, &change.name)) return false;
+      roots_.push_back(change);
+    }
+  }
+  std::stable_sort(roots_.begin(), roots_.end(), [](RootChange const& a, RootChange const& b) {
+    return strcmp(a.name, b.name) < 0;
+  });
+  return true;
+}
+
+}  // namespace capmap
@@ -0,0 +1,137 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-json.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace capmap {
+
+void JsonWriter::raw(char const* str) { raw(str, strlen(str)); }
+
+void JsonWriter::string(char const* str) {
+  static char const digits[] = "0123456789abcdef";
+  raw('"');
+  for (; *str; str++) {
+    unsigned char c = *str;
+    if ((c == '"') || (c == '\\')) {
+      raw('\\');
+      raw(c);
+    } else if (c < 0x20) {
+      raw("\\u00");
+      raw(digits[c >> 4]);
+      raw(digits[c & 0xf]);
+    } else {
+      raw(c);
+    }
+  }
+  raw('"');
+}
+
+void JsonWriter::hex(uint64_t value) {
+  static char const digits[] = "0123456789abcdef";
+  char text[16];
+  size_t n = 0;
+  do {
+    text[n++] = digits[value & 0xf];
+    value >>= 4;
+  } while (value != 0);
+  while (n > 0) raw(text[--n]);
+}
+
+void JsonWriter::dec(uint64_t value) {
+  char text[20];
+  size_t n = 0;
+  do {
+    text[n++] = '0' + (value % 10);
+    value /= 10;
+  } while (value != 0);
+  while (n > 0) raw(text[--n]);
+}
+
+void JsonWriter::range(Range range) {
+  raw("{ \"base\": 0x");
+  hex(range.base());
+  raw(", \"last\": 0x");
+  hex(range.last());
+  raw(" }");
+}
+
+void JsonWriter::raw_cap(void* __capability cap) {
+  uint64_t parts[2];
+  static_assert(sizeof(parts) == sizeof(cap), "Expected 128-bit capability");
+  memcpy(parts, &cap, sizeof(parts));
+  raw_cap_bits(cheri_tag_get(cap), parts[1], parts[0]);
+}
+
+void JsonWriter::raw_cap_bits(bool tag, uint64_t high, uint64_t low) {
+  raw("0x");
+  dec(tag);
+  raw(':');
+  hex(high);
+  raw(':');
+  hex(low);
+}
+
+void JsonRangeStream::add(Range range) {
+  if (range.is_empty()) return;
+  if (has_pending_) {
+    // Coalesce if `range` overlaps or is adjacent to the pending range.
+    bool touches = (pending_.last() == UINT64_MAX) || (range.base() <= pending_.last() + 1);
+    if (coalesce_ && touches) {
+      if (range.last() > pending_.last()) {
+        pending_ = Range::from_base_last(pending_.base(), range.last());
+      }
+      return;
+    }
+    emit(pending_);
+  }
+  pending_ = range;
+  has_pending_ = true;
+}
+
+void JsonRangeStream::finish() {
+  if (has_pending_) emit(pending_);
+  has_pending_ = false;
+  switch (count_) {
+    case 0:
+      out_->raw("[]");
+      return;
+    case 1:
+      out_->raw("[ ");
+      out_->range(first_);
+      out_->raw(" ]");
+      return;
+  }
+  out_->raw('\n');
+  out_->raw(line_prefix_);
+  out_->raw(']');
+}
+
+void JsonRangeStream::emit(Range range) {
+  if (count_ == 0) {
+    first_ = range;
+  } else {
+    if (count_ == 1) {
+      out_->raw("[\n");
+      out_->raw(line_prefix_);
+      out_->raw("    ");
+      out_->range(first_);
+    }
+    out_->raw(",\n");
+    out_->raw(line_prefix_);
+    out_->raw("    ");
+    out_->range(range);
+  }
+  count_++;
+}
+
+void print_json(JsonWriter* out, RangeSet const& ranges, char const* line_prefix) {
+  // Some maps keep overlapping ranges distinct, so print them as they are.
+  JsonRangeStream stream(out, line_prefix, false);
+  for (auto const part : ranges) stream.add(part);
+  stream.finish();
+}
+
+}  // namespace capmap
@@ -0,0 +1,116 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "include/capmap.h"
+#include "src/scan.h"
+
+namespace capmap {
+
+#ifdef MINCORE_CAPSTORE
+
+bool can_probe_capability_free_pages() { return true; }
+
+void drop_capability_free_pages(void* __capability cap, RangeVector* pieces,
+                                RangeVector* kept, ArenaVector<char>* status) {
+  static size_t const page_size = getpagesize();
+  kept->clear();
+  for (auto piece : *pieces) {
+    Range pages = piece.shrunk_to_alignment(page_size);
+    size_t count = pages.length().second / page_size;
+    if (pages.is_empty() || pages.length().first || (count == 0)) {
+      kept->push_back(piece);
+      continue;
+    }
+    status->resize(count);
+#ifdef __CHERI_PURE_CAPABILITY__
+    void* addr = cheri_address_set(cap, pages.base());
+#else
+    void* addr = reinterpret_cast<void*>(pages.base());
+#endif
+    if (mincore(addr, count * page_size, status->data()) != 0) {
+      kept->push_back(piece);
+      continue;
+    }
+
+    // Keep everything except resident pages with no record of capability
+    // stores. Non-resident pages might have been swapped out, so we can't tell.
+    ptraddr_t base = piece.base();
+    for (size_t i = 0; i < count; i++) {
+      char flags = (*status)[i];
+      if ((flags & MINCORE_INCORE) && !(flags & MINCORE_CAPSTORE)) {
+        ptraddr_t page = pages.base() + i * page_size;
+        if (base < page) kept->push_back(Range::from_base_limit(base, page));
+        base = page + page_size;
+      }
+    }
+    if (base <= piece.last()) kept->push_back(Range::from_base_last(base, piece.last()));
+  }
+  pieces->swap(*kept);
+}
+
+#else
+
+bool can_probe_capability_free_pages() { return false; }
+
+void drop_capability_free_pages(void* __capability cap, RangeVector* pieces,
+                                RangeVector* kept, ArenaVector<char>* status) {
+  (void)cap;
+  (void)pieces;
+  (void)kept;
+  (void)status;
+}
+
+#endif
+
+void summarise_page(void* __capability cap, PageRecord* page) {
+  // A simple multiplicative hash over each granule's raw bits and tag. It only
+  // needs to detect changes between scans of the same process.
+  uint64_t hash = 0;
+  uint64_t caps = 0;
+  Range range = page->range.shrunk_to_alignment(sizeof(void* __capability));
+  if (!range.is_empty()) {
+    ptraddr_t last = cheri_align_down(range.last(), sizeof(void* __capability));
+    for (ptraddr_t addr = range.base(); addr <= last; addr += sizeof(void* __capability)) {
+      void* __capability granule;
+      uint64_t lo, hi;
+      asm("ldr %w[granule], [%w[addr]]\n"
+          "ldr %x[lo], [%w[addr]]\n"
+          "ldr %x[hi], [%w[addr], #8]\n"
+          : [granule] "=&r"(granule), [lo] "=&r"(lo), [hi] "=&r"(hi)
+          : [addr] "r"(cheri_address_set(cap, addr)));
+      bool tag = cheri_tag_get(granule);
+      caps += tag;
+      hash = (hash ^ lo) * 0x100000001b3;
+      hash = (hash ^ hi) * 0x100000001b3;
+      hash = (hash ^ tag) * 0x100000001b3;
+    }
+  }
+  page->hash = hash;
+  page->caps = caps;
+}
+
+void record_pages(void* __capability cap, ScanItem const& item, RangeVector const& pieces,
+                  uint64_t generation, ArenaVector<PageRecord>* pages) {
+  static size_t const page_size = getpagesize();
+  for (auto piece : pieces) {
+    ptraddr_t base = piece.base();
+    while (true) {
+      ptraddr_t page_last = cheri_align_down(base, page_size) + (page_size - 1);
+      ptraddr_t last = std::min(page_last, piece.last());
+      PageRecord page = {Range::from_base_last(base, last), cap, item.root, item.depth, 0, 0,
+                         generation};
+      summarise_page(cap, &page);
+      pages->push_back(page);
+      if (last == piece.last()) break;
+      base = last + 1;
+    }
+  }
+}
+
+}  // namespace capmap
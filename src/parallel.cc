@@ -0,0 +1,395 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <pthread.h>
+#include <pthread_np.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "include/capmap.h"
+#include "src/scan.h"
+
+namespace capmap {
+
+namespace {
+
+struct Worker {
+  size_t id;
+
+  // Pending capabilities. The owner works from the back, and thieves steal
+  // from the front, where the oldest (and usually largest) sub-graphs are.
+  std::mutex lock;
+  std::deque<ScanItem, ArenaAllocator<ScanItem>> pending;
+
+  // Dereferenced capabilities, as in `Worklist::record()`.
+  ArenaVector<ScanItem> trail;
+  // Capabilities waiting to be passed to the user maps. These are flushed
+  // together once there are at least `kMapBatch`, to amortise the cost of
+  // taking the maps lock, but each segment (the capabilities found in one
+  // region, or a single root) is passed to the maps separately, so that any
+  // failure can be attributed to the right item.
+  ArenaVector<void* __capability> batch;
+  ArenaVector<std::pair<size_t, ScanItem>> segments;
+  // Scratch space for the capability being visited.
+  RangeVector pieces;
+  RangeVector page_pieces;
+  ArenaVector<char> page_status;
+  ArenaVector<ScanItem> found;
+  // Summaries for incremental scans, merged into `Mapper::pages_` at the end.
+  ArenaVector<PageRecord> pages;
+
+  // The last range this worker claimed. Like `Mapper::last_claimed_`, this
+  // catches sub-objects without a lookup, but without taking any lock.
+  Range last_claimed;
+
+  uint64_t max_depth = 0;
+  // Counts for `ScanStats` (and `Mapper::dedup_hits()`), merged at the end.
+  uint64_t granules = 0;
+  uint64_t tagged = 0;
+  uint64_t dedup_hits = 0;
+  Range stack;
+  std::thread thread;
+};
+
+// One shard of the capabilities visited during a parallel scan.
+struct SeenShard {
+  std::mutex lock;
+  SeenSet seen;
+};
+
+size_t const kSeenShards = 16;
+
+size_t seen_shard_of(void* __capability cap) {
+  // The top bits of a multiplicative hash are the best mixed.
+  return (static_cast<uint64_t>(cheri_base_get(cap)) * 0x9e3779b97f4a7c15) >> 60;
+}
+static_assert(kSeenShards == 16, "seen_shard_of() yields four bits");
+
+}  // namespace
+
+// The state of a multi-threaded `Mapper::drain()`.
+class ParallelScan {
+ public:
+  ParallelScan(Mapper& mapper, size_t threads) : mapper_(mapper) {
+    for (size_t i = 0; i < threads; i++) {
+      workers_.push_back(std::make_unique<Worker>());
+      workers_.back()->id = i;
+    }
+  }
+
+  void run();
+
+ private:
+  void work(Worker& self);
+  void visit(Worker& self, ScanItem const& item);
+  bool pop(Worker& self, ScanItem* item);
+  bool steal(Worker& self, ScanItem* item);
+  bool first_visit(Worker& self, void* __capability cap);
+  void posted(size_t count);
+  bool wait_for_work(uint64_t ticket);
+  void wake_all();
+  void flush(Worker& self);
+  void fail(ScanItem const& item);
+  void print_trail(FILE* stream, ScanItem const& item) const;
+
+  // Parent indices encode both the worker and its trail index.
+  size_t encode_parent(Worker const& self) const {
+    return (self.trail.size() - 1) * workers_.size() + self.id;
+  }
+  ScanItem const& decode_parent(size_t parent) const {
+    return workers_[parent % workers_.size()]->trail[parent / workers_.size()];
+  }
+
+  Mapper& mapper_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // `include_` minus `exclude_self_` and the workers' own memory.
+  ScanFilter filter_;
+
+  // Workers register their stacks, then wait for the filter to be built.
+  std::mutex start_lock_;
+  std::condition_variable start_cv_;
+  size_t ready_ = 0;
+  bool started_ = false;
+
+  // Every capability visited by this scan, sharded by base, so that repeat
+  // visits (by far the most common outcome) are rejected without taking
+  // `claim_lock_`. `Mapper::seen_` is still updated, for later scans.
+  SeenShard seen_[kSeenShards];
+  // Protects `mapper_.load_cap_map_`, which records the regions that have been
+  // claimed for scanning, and the other state used by `Mapper::claim()`,
+  // including its `ScanStats` counters.
+  std::mutex claim_lock_;
+  // Protects `mapper_.maps_` (and the map timings in `mapper_.stats_`).
+  std::mutex maps_lock_;
+
+  // The number of pushed items that have not yet been fully visited.
+  std::atomic<size_t> pending_{0};
+
+  // Workers without any work wait on `idle_cv_` until more is posted, the
+  // scan fails, or `pending_` falls to zero. `posted_` counts pushes, so that a
+  // worker can tell whether any arrived since it last looked, and `idle_`
+  // counts the waiters, so that pushes only notify when someone is waiting.
+  std::mutex idle_lock_;
+  std::condition_variable idle_cv_;
+  std::atomic<uint64_t> posted_{0};
+  std::atomic<size_t> idle_{0};
+
+  std::mutex fail_lock_;
+  std::atomic<bool> failed_{false};
+  ScanItem failure_ = {};
+};
+
+void ParallelScan::run() {
+  for (auto& worker : workers_) {
+    Worker* self = worker.get();
+    self->thread = std::thread([this, self] { work(*self); });
+  }
+
+  {
+    std::unique_lock<std::mutex> guard(start_lock_);
+    start_cv_.wait(guard, [&] { return ready_ == workers_.size(); });
+
+    SparseRange exclude = mapper_.exclude_self_;
+    exclude.combine(Range::from_object(this));
+    for (auto const& worker : workers_) {
+      exclude.combine(Range::from_object(worker.get()));
+      exclude.combine(worker->stack);
+    }
+    filter_.rebuild(mapper_.include_, exclude);
+
+    size_t next = 0;
+    while (!mapper_.worklist_.empty()) {
+      workers_[next++ % workers_.size()]->pending.push_back(mapper_.worklist_.pop());
+    }
+    pending_ = next;
+    started_ = true;
+  }
+  start_cv_.notify_all();
+
+  for (auto& worker : workers_) {
+    worker->thread.join();
+    if (worker->max_depth > mapper_.max_seen_scan_depth_) {
+      mapper_.max_seen_scan_depth_ = worker->max_depth;
+    }
+    mapper_.pages_.insert(mapper_.pages_.end(), worker->pages.begin(), worker->pages.end());
+    mapper_.stats_.granules += worker->granules;
+    mapper_.stats_.tagged += worker->tagged;
+    mapper_.stats_.rejected_mapped += worker->dedup_hits;
+    mapper_.dedup_hits_ += worker->dedup_hits;
+  }
+  mapper_.worklist_.clear();
+
+  if (failed_) {
+    print_trail(stderr, failure_);
+    abort();
+  }
+}
+
+void ParallelScan::work(Worker& self) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (pthread_attr_get_np(pthread_self(), &attr) == 0) {
+    void* addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+      self.stack = Range::from_base_length(address_of(addr), size);
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  {
+    std::unique_lock<std::mutex> guard(start_lock_);
+    ready_++;
+    start_cv_.notify_all();
+    start_cv_.wait(guard, [&] { return started_; });
+  }
+
+  ScanItem item;
+  while (!failed_.load(std::memory_order_relaxed)) {
+    // Read before looking for work, so that anything posted after the search
+    // fails is noticed by `wait_for_work()`.
+    uint64_t ticket = posted_.load();
+    if (pop(self, &item) || steal(self, &item)) {
+      visit(self, item);
+      if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) wake_all();
+    } else if (!wait_for_work(ticket)) {
+      break;
+    }
+  }
+  flush(self);
+}
+
+bool ParallelScan::wait_for_work(uint64_t ticket) {
+  std::unique_lock<std::mutex> guard(idle_lock_);
+  idle_++;
+  idle_cv_.wait(guard, [&] {
+    return failed_.load(std::memory_order_relaxed) || (pending_.load() == 0) ||
+           (posted_.load() != ticket);
+  });
+  idle_--;
+  return !failed_.load(std::memory_order_relaxed) && (pending_.load() != 0);
+}
+
+void ParallelScan::posted(size_t count) {
+  // Pairs with `wait_for_work()`: either the waiter sees the new ticket, or
+  // this sees the waiter (and its lock orders the notification after its
+  // check).
+  posted_.fetch_add(1);
+  if (idle_.load() == 0) return;
+  std::lock_guard<std::mutex> guard(idle_lock_);
+  if (count > 1) {
+    idle_cv_.notify_all();
+  } else {
+    idle_cv_.notify_one();
+  }
+}
+
+void ParallelScan::wake_all() {
+  std::lock_guard<std::mutex> guard(idle_lock_);
+  idle_cv_.notify_all();
+}
+
+bool ParallelScan::first_visit(Worker& self, void* __capability cap) {
+  Range range = Range::from_cap(cap);
+  if (self.last_claimed.includes(range)) return false;
+  SeenShard& shard = seen_[seen_shard_of(cap)];
+  std::lock_guard<std::mutex> guard(shard.lock);
+  return shard.seen.insert(cap);
+}
+
+void ParallelScan::visit(Worker& self, ScanItem const& item) {
+  void* __capability cap = item.cap;
+  if (item.depth > self.max_depth) self.max_depth = item.depth;
+
+  if (item.parent == ScanItem::kNoParent) {
+    self.batch.push_back(cap);
+    self.segments.push_back(std::make_pair(self.batch.size(), item));
+  }
+
+  // Whatever `Mapper::claim()` decides the first time, a repeat visit to a
+  // capability that can load capabilities finds nothing new: even one rejected
+  // for its depth is then already in `load_cap_map_`. Repeats are counted as
+  // `Mapper::claim()` counts them. Other capabilities (sealed ones, and
+  // unsealers) are always passed to `Mapper::claim()`, as it handles them
+  // before deduplicating.
+  if (LoadCapMap::can_load_caps(cap) && !first_visit(self, cap)) {
+    self.dedup_hits++;
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(claim_lock_);
+    bool claimed = mapper_.claim(item, true, filter_, &self.pieces);
+    // Claiming an unsealer can unseal capabilities found earlier, which the
+    // mapper queues on its own worklist.
+    size_t unsealed = mapper_.worklist_.size();
+    if (unsealed > 0) {
+      {
+        std::lock_guard<std::mutex> pending_guard(self.lock);
+        pending_.fetch_add(unsealed, std::memory_order_acq_rel);
+        while (!mapper_.worklist_.empty()) self.pending.push_back(mapper_.worklist_.pop());
+      }
+      posted(unsealed);
+    }
+    if (!claimed) return;
+    self.last_claimed = Range::from_cap(cap);
+  }
+  // As in `Mapper::visit()`, record pages before skipping any.
+  if (mapper_.incremental_) {
+    record_pages(cap, item, self.pieces, mapper_.generation_, &self.pages);
+  }
+  if (mapper_.skip_capability_free_pages_) {
+    drop_capability_free_pages(cap, &self.pieces, &self.page_pieces, &self.page_status);
+  }
+  self.trail.push_back(item);
+  size_t parent = encode_parent(self);
+  self.found.clear();
+  for (auto piece : self.pieces) {
+    self.granules += granules_in(piece);
+    for_each_tagged(cap, piece, [&](ptraddr_t addr, void* __capability found) {
+      self.found.push_back(ScanItem{found, item.depth + 1, item.root, addr, parent});
+    });
+  }
+  self.tagged += self.found.size();
+  if (self.found.empty()) return;
+
+  for (auto const& found : self.found) self.batch.push_back(found.cap);
+  self.segments.push_back(std::make_pair(self.batch.size(), item));
+  if (self.batch.size() >= kMapBatch) flush(self);
+
+  pending_.fetch_add(self.found.size(), std::memory_order_acq_rel);
+  {
+    std::lock_guard<std::mutex> guard(self.lock);
+    self.pending.insert(self.pending.end(), self.found.begin(), self.found.end());
+  }
+  posted(self.found.size());
+}
+
+bool ParallelScan::pop(Worker& self, ScanItem* item) {
+  std::lock_guard<std::mutex> guard(self.lock);
+  if (self.pending.empty()) return false;
+  *item = self.pending.back();
+  self.pending.pop_back();
+  return true;
+}
+
+bool ParallelScan::steal(Worker& self, ScanItem* item) {
+  for (size_t i = 1; i < workers_.size(); i++) {
+    Worker& victim = *workers_[(self.id + i) % workers_.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.pending.empty()) {
+      *item = victim.pending.front();
+      victim.pending.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ParallelScan::flush(Worker& self) {
+  std::lock_guard<std::mutex> guard(maps_lock_);
+  size_t start = 0;
+  for (auto const& segment : self.segments) {
+    try {
+      mapper_.update_maps(self.batch.data() + start, segment.first - start);
+    } catch (int) {
+      // Only `PoisonMap` throws, and only to abort the scan. For found
+      // capabilities, the trail leads to the region that they were found in.
+      fail(segment.second);
+      break;
+    }
+    start = segment.first;
+  }
+  self.batch.clear();
+  self.segments.clear();
+}
+
+void ParallelScan::fail(ScanItem const& item) {
+  std::lock_guard<std::mutex> guard(fail_lock_);
+  if (!failed_) {
+    failure_ = item;
+    failed_ = true;
+  }
+  wake_all();
+}
+
+void ParallelScan::print_trail(FILE* stream, ScanItem const& item) const {
+  print_scan_trail(stream, item,
+                   [this](size_t parent) -> ScanItem const& { return decode_parent(parent); });
+}
+
+void Mapper::drain_parallel() {
+  ParallelScan scan(*this, threads_);
+  scan.run();
+}
+
+}  // namespace capmap
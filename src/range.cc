@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <limits>
 #include <utility>
 
@@ -60,6 +61,7 @@ bool SparseRange::includes(Range other) const {
 
 void SparseRange::combine(Range other) {
   if (other.is_empty()) return;
+  combines_++;
   if (ranges_.empty()) {
     ranges_.insert(other);
     return;
@@ -98,12 +100,45 @@ void SparseRange::combine(Range other) {
     }
   }
 
-  ranges_.erase(repl_start, repl_end);
-  ranges_.insert(other);
+  if (repl_start == repl_end) {
+    ranges_.insert(repl_end, other);
+    return;
+  }
+  // Reuse the last replaced part, which ends at or before `other` but after
+  // everything before it, so that combining never allocates once it has
+  // started changing the set. This keeps the set intact if allocation fails.
+  auto last = repl_end;
+  --last;
+  replace_part(last, other);
+  ranges_.erase(repl_start, last);
+}
+
+void SparseRange::combine_all(RangeVector* ranges) {
+  auto end = std::remove_if(ranges->begin(), ranges->end(),
+                            [](Range const& range) { return range.is_empty(); });
+  std::sort(ranges->begin(), end,
+            [](Range const& a, Range const& b) { return a.base() < b.base(); });
+  // Coalesce overlapping or adjacent ranges, so that the remainder are disjoint
+  // and non-adjacent, as SparseRange requires.
+  if (end != ranges->begin()) {
+    auto out = ranges->begin();
+    for (auto it = out + 1; it != end; ++it) {
+      if (!out->try_combine(*it)) *++out = *it;
+    }
+    end = out + 1;
+  }
+  ranges->erase(end, ranges->end());
+#if CAPMAP_FLAT_RANGE_SET
+  combines_ += ranges->size();
+  ranges_.unite(ranges->data(), ranges->data() + ranges->size());
+#else
+  for (auto range : *ranges) combine(range);
+#endif
 }
 
 void SparseRange::remove(Range other) {
   if (other.is_empty()) return;
+  removes_++;
   if (ranges_.empty()) return;
 
   // Find the first and last ranges that overlap `other` (if any do).
@@ -143,29 +178,326 @@ void SparseRange::remove(Range other) {
     h = Range::from_base_last(other.last() + 1, repl_last->last());
   }
 
-  ranges_.erase(repl_start, repl_end);
-  if (!l.is_empty()) ranges_.insert(l);
-  if (!h.is_empty()) ranges_.insert(h);
+  // As in `combine()`, reuse the outermost parts for whatever remains of them,
+  // so that nothing is allocated after the set starts changing. Only splitting
+  // one part in two needs a new part, so that is inserted first.
+  if ((repl_start == repl_last) && !l.is_empty() && !h.is_empty()) {
+    ranges_.insert(repl_start, l);
+    // Inserting may have moved the parts (in a `FlatRangeSet`).
+    replace_part(ranges_.lower_bound(h), h);
+    return;
+  }
+  auto erase_start = repl_start;
+  auto erase_end = repl_end;
+  if (!l.is_empty()) replace_part(erase_start++, l);
+  if (!h.is_empty()) {
+    replace_part(repl_last, h);
+    erase_end = repl_last;
+  }
+  ranges_.erase(erase_start, erase_end);
 }
 
-void print_json(FILE* stream, std::set<Range> const& ranges, char const* line_prefix) {
-  switch (ranges.size()) {
-    case 0:
-      fprintf(stream, "[]");
-      return;
-    case 1:
-      fprintf(stream, "[ { \"base\": 0x%zx, \"last\": 0x%zx } ]", ranges.begin()->base(),
-              ranges.begin()->last());
-      return;
+Range const* SparseRange::Cursor::seek(ptraddr_t addr) {
+  // Parts are sorted by `last()`, so skip those that end before `addr`. Short
+  // steps are the common case; a long jump is a single look-up instead.
+  int steps = 0;
+  while ((part_ != parts_->end()) && (part_->last() < addr)) {
+    if (++steps > kMaxSteps) {
+      part_ = parts_->lower_bound(Range::from_base_last(addr, addr));
+      break;
+    }
+    ++part_;
   }
-  fprintf(stream, "[");
-  char const* sep = "\n";
-  for (auto const part : ranges) {
-    fprintf(stream, "%s%s    { \"base\": 0x%zx, \"last\": 0x%zx }", sep, line_prefix, part.base(),
-            part.last());
-    sep = ",\n";
+  if ((part_ != parts_->end()) && (part_->base() <= addr)) return &*part_;
+  return nullptr;
+}
+
+std::pair<bool, ptraddr_t> SparseRange::Cursor::next_included(ptraddr_t addr) {
+  seek(addr);
+  if (part_ == parts_->end()) return std::make_pair(false, 0);
+  return std::make_pair(true, std::max(addr, part_->base()));
+}
+
+std::pair<bool, ptraddr_t> SparseRange::Cursor::next_excluded(ptraddr_t addr) {
+  Range const* part = seek(addr);
+  if (part == nullptr) return std::make_pair(true, addr);
+  // Parts are never adjacent, so the address after a part is excluded.
+  if (part->last() == UINT64_MAX) return std::make_pair(false, 0);
+  return std::make_pair(true, part->last() + 1);
+}
+
+namespace {
+
+// Helpers for building a RangeSet in address order. Appending at `end()` is
+// constant-time for both RangeSet implementations.
+void reserve_parts(RangeSet* set, size_t count) {
+#if CAPMAP_FLAT_RANGE_SET
+  set->reserve(count);
+#else
+  (void)set;
+  (void)count;
+#endif
+}
+
+void append(RangeSet* set, Range range) { set->insert(set->end(), range); }
+
+}  // namespace
+
+void SparseRange::unite(SparseRange const& other) {
+  if ((&other == this) || other.is_empty()) return;
+  if (prefer_per_part(other)) {
+    for (auto range : other.ranges_) combine(range);
+    return;
+  }
+  combines_ += other.ranges_.size();
+  RangeSet out;
+  reserve_parts(&out, ranges_.size() + other.ranges_.size());
+  auto a = ranges_.begin();
+  auto b = other.ranges_.begin();
+  bool has_pending = false;
+  Range pending;
+  while ((a != ranges_.end()) || (b != other.ranges_.end())) {
+    // Take whichever part starts first. Parts of one set are disjoint, so this
+    // visits all parts in order of base (and of last).
+    bool take_a = (b == other.ranges_.end()) || ((a != ranges_.end()) && (a->base() < b->base()));
+    Range next = take_a ? *a++ : *b++;
+    if (!has_pending) {
+      pending = next;
+      has_pending = true;
+    } else if (!pending.try_combine(next)) {
+      append(&out, pending);
+      pending = next;
+    }
+  }
+  if (has_pending) append(&out, pending);
+  ranges_ = std::move(out);
+}
+
+void SparseRange::unite(SparseRange&& other) {
+  if (is_empty() && (&other != this)) {
+    combines_ += other.ranges_.size();
+    ranges_ = std::move(other.ranges_);
+    return;
+  }
+  unite(static_cast<SparseRange const&>(other));
+}
+
+void SparseRange::subtract(SparseRange const& other) {
+  if (is_empty() || other.is_empty()) return;
+  if (&other == this) {
+    removes_ += ranges_.size();
+    ranges_.clear();
+    return;
+  }
+  if (prefer_per_part(other)) {
+    for (auto range : other.ranges_) remove(range);
+    return;
+  }
+  removes_ += other.ranges_.size();
+  RangeSet out;
+  reserve_parts(&out, ranges_.size() + other.ranges_.size());
+  auto b = other.ranges_.begin();
+  for (Range part : ranges_) {
+    // Skip removals that end before this part.
+    while ((b != other.ranges_.end()) && (b->last() < part.base())) ++b;
+    // Emit the gaps between the removals that overlap it. The last of these
+    // may overlap the next part too, so don't advance past it.
+    auto hole = b;
+    ptraddr_t base = part.base();
+    bool done = false;
+    for (; (hole != other.ranges_.end()) && (hole->base() <= part.last()); ++hole) {
+      if (hole->base() > base) append(&out, Range::from_base_last(base, hole->base() - 1));
+      if (hole->last() >= part.last()) {
+        done = true;
+        break;
+      }
+      base = hole->last() + 1;
+    }
+    if (!done) append(&out, Range::from_base_last(base, part.last()));
+    b = hole;
   }
-  fprintf(stream, "\n%s]", line_prefix);
+  ranges_ = std::move(out);
+}
+
+void SparseRange::intersect(SparseRange const& other) {
+  if (&other == this) return;
+  RangeSet out;
+  reserve_parts(&out, ranges_.size() + other.ranges_.size());
+  auto a = ranges_.begin();
+  auto b = other.ranges_.begin();
+  while ((a != ranges_.end()) && (b != other.ranges_.end())) {
+    ptraddr_t base = std::max(a->base(), b->base());
+    ptraddr_t last = std::min(a->last(), b->last());
+    if (base <= last) append(&out, Range::from_base_last(base, last));
+    // Advance whichever part ends first; the other might overlap more parts.
+    if (a->last() < b->last()) {
+      ++a;
+    } else {
+      ++b;
+    }
+  }
+  ranges_ = std::move(out);
+}
+
+void SparseRange::clip(Range range) {
+  if (range.is_empty()) {
+    ranges_.clear();
+    return;
+  }
+  if (range.base() > 0) remove(Range::from_base_last(0, range.base() - 1));
+  if (range.last() < UINT64_MAX) remove(Range::from_base_last(range.last() + 1, UINT64_MAX));
+}
+
+uint64_t SparseRange::coarsen(uint64_t gap) {
+  if ((gap == 0) || (ranges_.size() < 2)) return 0;
+  uint64_t added = 0;
+  RangeSet out;
+  reserve_parts(&out, ranges_.size());
+  auto it = ranges_.begin();
+  Range pending = *it++;
+  for (; it != ranges_.end(); ++it) {
+    // Parts are never adjacent, so there is at least one byte between them.
+    uint64_t between = it->base() - pending.last() - 1;
+    if (between < gap) {
+      added += between;
+      pending = Range::from_base_last(pending.base(), it->last());
+    } else {
+      append(&out, pending);
+      pending = *it;
+    }
+  }
+  append(&out, pending);
+  if (added > 0) ranges_ = std::move(out);
+  return added;
+}
+
+void FlatRangeSet::unite(const_iterator first, const_iterator last) {
+  size_t count = last - first;
+  if ((count == 0) || (first == begin())) return;  // Nothing to do, or uniting with ourselves.
+  reserve(size_ + count);
+
+  // Merge from the back, so that nothing is overwritten before it is read. Any
+  // of our own parts left over at the end are already in place.
+  Range* out = data_ + size_ + count;
+  Range const* ours = data_ + size_;
+  while (last != first) {
+    if ((ours != data_) && (*(last - 1) < *(ours - 1))) {
+      *--out = *--ours;
+    } else {
+      *--out = *--last;
+    }
+  }
+  size_ += count;
+
+  // Coalesce in place. Parts are sorted by `last()`, so a part can only absorb
+  // the parts already kept immediately before it.
+  size_t kept = 0;
+  for (size_t i = 0; i < size_; i++) {
+    Range range = data_[i];
+    while ((kept > 0) && range.try_combine(data_[kept - 1])) kept--;
+    data_[kept++] = range;
+  }
+  size_ = kept;
+}
+
+void ScanFilter::clip(Range range, SparseRange const& done, RangeVector* out) const {
+  if (range.is_empty()) return;
+  auto const& parts = ranges_.parts();
+  auto const& done_parts = done.parts();
+
+  // Visit each filter part that overlaps `range`, starting with the first one
+  // that ends on or after `range.base()`.
+  auto part = parts.lower_bound(Range::from_base_last(range.base(), range.base()));
+  for (; (part != parts.end()) && (part->base() <= range.last()); ++part) {
+    ptraddr_t base = std::max(part->base(), range.base());
+    ptraddr_t last = std::min(part->last(), range.last());
+
+    // Emit the gaps between the `done` parts over [base,last].
+    auto seen = done_parts.lower_bound(Range::from_base_last(base, base));
+    while (true) {
+      if ((seen == done_parts.end()) || (seen->base() > last)) {
+        out->push_back(Range::from_base_last(base, last));
+        break;
+      }
+      if (seen->base() > base) out->push_back(Range::from_base_last(base, seen->base() - 1));
+      if (seen->last() >= last) break;
+      base = seen->last() + 1;
+      ++seen;
+    }
+  }
+}
+
+void RangeIndex::settle() const {
+  if (pending_.empty()) return;
+  auto by_base = [](Range a, Range b) {
+    return (a.base() != b.base()) ? (a.base() < b.base()) : (a.last() < b.last());
+  };
+  std::sort(pending_.begin(), pending_.end(), by_base);
+  pending_.erase(std::unique(pending_.begin(), pending_.end()), pending_.end());
+
+  // Merge from the back (like `FlatRangeSet::unite()`), so that nothing is
+  // allocated except to grow `sorted_`.
+  size_t sorted = sorted_.size();
+  sorted_.resize(sorted + pending_.size());
+  Range* out = sorted_.data() + sorted_.size();
+  Range const* ours = sorted_.data() + sorted;
+  Range const* theirs = pending_.data() + pending_.size();
+  while (theirs != pending_.data()) {
+    if ((ours != sorted_.data()) && by_base(*(theirs - 1), *(ours - 1))) {
+      *--out = *--ours;
+    } else {
+      *--out = *--theirs;
+    }
+  }
+  pending_.clear();
+  sorted_.erase(std::unique(sorted_.begin(), sorted_.end()), sorted_.end());
+
+  max_last_.resize(sorted_.size());
+  ptraddr_t max_last = 0;
+  for (size_t i = 0; i < sorted_.size(); i++) {
+    max_last = std::max(max_last, sorted_[i].last());
+    max_last_[i] = max_last;
+  }
+
+  // The tree has a node for each non-empty half, down to single ranges, so
+  // twice the next power of two is enough.
+  size_t nodes = 2;
+  while (nodes < 2 * sorted_.size()) nodes *= 2;
+  tops_.assign(nodes, static_cast<size_t>(kNoRange));
+  ArenaVector<char> taken(sorted_.size(), 0);
+  if (!sorted_.empty()) build(1, 0, sorted_.size(), &taken);
+}
+
+void RangeIndex::build(size_t node, size_t lo, size_t hi, ArenaVector<char>* taken) const {
+  size_t top = kNoRange;
+  for (size_t i = lo; i < hi; i++) {
+    if ((*taken)[i]) continue;
+    if ((top == kNoRange) || (sorted_[i].last() > sorted_[top].last())) top = i;
+  }
+  // If every range here is held by an ancestor, then so are all of those below.
+  if (top == kNoRange) return;
+  (*taken)[top] = 1;
+  tops_[node] = top;
+  if (hi - lo < 2) return;
+  size_t mid = lo + (hi - lo) / 2;
+  build(2 * node, lo, mid, taken);
+  build(2 * node + 1, mid, hi, taken);
+}
+
+bool RangeIndex::overlaps(Range range) const {
+  if (range.is_empty()) return false;
+  settle();
+  // Every range starting at or before `range.last()` is a candidate, and one of
+  // them overlaps `range` if any reaches `range.base()`.
+  auto by_base = [](ptraddr_t addr, Range const& r) { return addr < r.base(); };
+  size_t i =
+      std::upper_bound(sorted_.begin(), sorted_.end(), range.last(), by_base) - sorted_.begin();
+  return (i > 0) && (max_last_[i - 1] >= range.base());
+}
+
+void print_json(FILE* stream, RangeSet const& ranges, char const* line_prefix) {
+  JsonWriter out(stream);
+  print_json(&out, ranges, line_prefix);
 }
 
 }  // namespace capmap
@@ -0,0 +1,266 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-remote.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// The debugging interface for capabilities is only present in CheriBSD, and
+// rebuilding capabilities from their bits needs DDC.
+#if !defined(__CHERI_PURE_CAPABILITY__) && defined(PIOD_READ_CHERI_CAP) && defined(PT_GETCAPREGS)
+#define CAPMAP_REMOTE 1
+#include <machine/reg.h>
+#else
+#define CAPMAP_REMOTE 0
+#endif
+
+#include "include/capmap.h"
+#include "src/scan.h"
+
+namespace capmap {
+
+#if CAPMAP_REMOTE
+
+namespace {
+
+// `PIOD_READ_CHERI_CAP` returns each granule as a tag byte, followed by the
+// capability's bits.
+size_t const kRecordBytes = 1 + sizeof(void* __capability);
+
+// The number of capability registers in `struct capreg`, which are followed by
+// a bit mask of their tags.
+size_t const kCapRegs = offsetof(struct capreg, tagmask) / sizeof(void* __capability);
+
+char const* register_name(size_t i) {
+  static char names[kCapRegs][16];
+  static bool init = [] {
+    for (size_t r = 0; r < kCapRegs; r++) snprintf(names[r], sizeof(names[r]), "capreg[%zu]", r);
+    return true;
+  }();
+  (void)init;
+  return names[i];
+}
+
+// Rebuild `bits` (copied from the target) as a valid capability. Returns null,
+// and sets `*sealed`, if it is sealed with an object type that can't be
+// restored.
+void* __capability rebuild(unsigned char const* bits, bool* sealed) {
+  void* __capability raw;
+  memcpy(&raw, bits, sizeof(raw));
+  *sealed = false;
+  bool sentry = cheri_is_sentry(raw);
+  if (cheri_is_sealed(raw) && !sentry) {
+    *sealed = true;
+    return nullptr;
+  }
+  void* __capability cap = cheri_cap_build(cheri_ddc_get(), reinterpret_cast<__uintcap_t>(raw));
+  if (!cheri_tag_get(cap)) return nullptr;
+  return sentry ? cheri_sentry_create(cap) : cap;
+}
+
+}  // namespace
+
+bool RemoteTarget::supported() { return true; }
+
+bool RemoteTarget::attach() {
+  if (attached_) return true;
+  if (ptrace(PT_ATTACH, pid_, nullptr, 0) != 0) return false;
+  int status;
+  pid_t result;
+  do {
+    result = waitpid(pid_, &status, 0);
+  } while ((result < 0) && (errno == EINTR));
+  if ((result != pid_) || !WIFSTOPPED(status)) {
+    ptrace(PT_DETACH, pid_, reinterpret_cast<caddr_t>(1), 0);
+    return false;
+  }
+  attached_ = true;
+  if (!vmmap_.refresh()) {
+    detach();
+    return false;
+  }
+  return true;
+}
+
+void RemoteTarget::detach() {
+  if (!attached_) return;
+  ptrace(PT_DETACH, pid_, reinterpret_cast<caddr_t>(1), 0);
+  attached_ = false;
+}
+
+bool RemoteTarget::read_caps(ptraddr_t addr, size_t count, void* __capability* caps,
+                             uint64_t* sealed) {
+  ArenaVector<unsigned char>& records = records_;
+  records.resize(count * kRecordBytes);
+  struct ptrace_io_desc io;
+  io.piod_op = PIOD_READ_CHERI_CAP;
+  io.piod_offs = reinterpret_cast<void*>(addr);
+  io.piod_addr = records.data();
+  io.piod_len = records.size();
+  if ((ptrace(PT_IO, pid_, reinterpret_cast<caddr_t>(&io), 0) != 0) ||
+      (io.piod_len != records.size())) {
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    unsigned char const* record = &records[i * kRecordBytes];
+    caps[i] = nullptr;
+    if (record[0] == 0) continue;
+    bool is_sealed;
+    caps[i] = rebuild(record + 1, &is_sealed);
+    if (is_sealed) (*sealed)++;
+  }
+  return true;
+}
+
+bool RemoteTarget::read_roots(ArenaVector<std::pair<char const*, void* __capability>>* roots) {
+  int threads = ptrace(PT_GETNUMLWPS, pid_, nullptr, 0);
+  if (threads <= 0) return false;
+  ArenaVector<lwpid_t> lwps(threads);
+  threads = ptrace(PT_GETLWPLIST, pid_, reinterpret_cast<caddr_t>(lwps.data()), threads);
+  if (threads <= 0) return false;
+  for (int t = 0; t < threads; t++) {
+    struct capreg regs;
+    if (ptrace(PT_GETCAPREGS, lwps[t], reinterpret_cast<caddr_t>(&regs), 0) != 0) return false;
+    auto bits = reinterpret_cast<unsigned char const*>(&regs);
+    for (size_t r = 0; r < kCapRegs; r++) {
+      if (!(regs.tagmask[r / 8] & (1u << (r % 8)))) continue;
+      bool sealed;
+      void* __capability cap = rebuild(bits + r * sizeof(void* __capability), &sealed);
+      if (cap) roots->push_back(std::make_pair(register_name(r), cap));
+    }
+  }
+  return true;
+}
+
+// The state of a `scan_remote()`. This uses `Mapper`'s claim and map logic,
+// but loads memory through `RemoteTarget`.
+class RemoteScan {
+ public:
+  RemoteScan(Mapper& mapper, RemoteTarget& target) : mapper_(mapper), target_(target) {}
+
+  bool run();
+
+ private:
+  void visit(ScanItem const& item);
+  // Read `count` granules from `addr`, queueing the capabilities found in
+  // them. Memory that can't be read is counted and skipped.
+  void read(ptraddr_t addr, size_t count, ScanItem const& item, size_t parent);
+
+  Mapper& mapper_;
+  RemoteTarget& target_;
+  // The target's memory is not ours, so nothing is excluded for the mapper.
+  ScanFilter filter_;
+  RangeVector pieces_;
+  ArenaVector<void* __capability> granules_;
+  ArenaVector<void* __capability> found_;
+};
+
+bool RemoteScan::run() {
+  ArenaVector<std::pair<char const*, void* __capability>> roots;
+  if (!target_.read_roots(&roots)) return false;
+  for (auto const& root : roots) mapper_.add_root(root.second, root.first);
+  filter_.rebuild(mapper_.include_, SparseRange());
+
+  uint64_t start = now_ticks();
+  uint64_t map_ns = mapper_.stats_.map_ns;
+  ScanItem item = {};
+  try {
+    while (!mapper_.worklist_.empty()) {
+      item = mapper_.worklist_.pop();
+      visit(item);
+    }
+  } catch (int) {
+    mapper_.worklist_.print_trail(stderr, item);
+    abort();
+  }
+  mapper_.worklist_.clear();
+  mapper_.stats_.traversal_ns += elapsed_ns(start) - (mapper_.stats_.map_ns - map_ns);
+  return true;
+}
+
+void RemoteScan::visit(ScanItem const& item) {
+  void* __capability cap = item.cap;
+  if (item.depth > mapper_.max_seen_scan_depth_) mapper_.max_seen_scan_depth_ = item.depth;
+  if (item.parent == ScanItem::kNoParent) mapper_.update_maps(&cap, 1);
+  if (!mapper_.claim(item, true, filter_, &pieces_)) return;
+
+  size_t parent = mapper_.worklist_.record(item);
+  found_.clear();
+  for (Range piece : pieces_) {
+    piece.shrink_to_alignment(sizeof(void* __capability));
+    if (piece.is_empty()) continue;
+    ptraddr_t next = piece.base();
+    uint64_t left = granules_in(piece);
+    while (left > 0) {
+      size_t count = std::min<uint64_t>(left, RemoteTarget::kReadGranules);
+      read(next, count, item, parent);
+      next += count * sizeof(void* __capability);
+      left -= count;
+    }
+  }
+  mapper_.stats_.tagged += found_.size();
+  mapper_.update_maps(found_.data(), found_.size());
+}
+
+void RemoteScan::read(ptraddr_t addr, size_t count, ScanItem const& item, size_t parent) {
+  size_t const granule = sizeof(void* __capability);
+  granules_.resize(count);
+  if (!target_.read_caps(addr, count, granules_.data(), &mapper_.stats_.rejected_sealed)) {
+    // The target's map may have changed, or part of it may be unreadable (for
+    // example, a guard page). Retry page by page, so that only the unreadable
+    // pages are lost, then carry on with the rest of the scan.
+    size_t const page = getpagesize();
+    size_t const page_granules = page / granule;
+    ptraddr_t page_end = (addr | (page - 1)) + 1;
+    size_t first = std::min<size_t>(count, (page_end - addr) / granule);
+    if (first == count) {
+      mapper_.stats_.unreadable += count;
+      return;
+    }
+    for (size_t done = 0; done < count;) {
+      size_t part = (done == 0) ? first : std::min(count - done, page_granules);
+      read(addr + done * granule, part, item, parent);
+      done += part;
+    }
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (!granules_[i]) continue;
+    ptraddr_t at = addr + i * granule;
+    mapper_.worklist_.push(ScanItem{granules_[i], item.depth + 1, item.root, at, parent});
+    found_.push_back(granules_[i]);
+  }
+  mapper_.stats_.granules += count;
+}
+
+bool scan_remote(Mapper* mapper, RemoteTarget* target) {
+  if (!target->attached()) return false;
+  RemoteScan scan(*mapper, *target);
+  return scan.run();
+}
+
+#else  // !CAPMAP_REMOTE
+
+bool RemoteTarget::supported() { return false; }
+bool RemoteTarget::attach() { return false; }
+void RemoteTarget::detach() {}
+bool RemoteTarget::read_caps(ptraddr_t, size_t, void* __capability*, uint64_t*) { return false; }
+bool RemoteTarget::read_roots(ArenaVector<std::pair<char const*, void* __capability>>*) {
+  return false;
+}
+bool scan_remote(Mapper*, RemoteTarget*) { return false; }
+
+#endif  // CAPMAP_REMOTE
+
+}  // namespace capmap
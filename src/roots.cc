@@ -0,0 +1,96 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-roots.h"
+
+#include <link.h>
+
+#include "include/capmap-vmmap.h"
+#include "include/capmap.h"
+#include "src/scan.h"
+
+namespace capmap {
+
+namespace {
+
+// The authority for globals and TLS in `info`'s object.
+void* __capability object_authority(dl_phdr_info const* info) {
+#ifdef __CHERI_PURE_CAPABILITY__
+  // `dlpi_addr` is only an address, so it can't authorise anything. The
+  // run-time linker derives `dlpi_phdr` from its capability for the object's
+  // mapping, so use that, with its address and bounds adjusted for each range
+  // by `derive()`. If it doesn't cover a range, the result is untagged, and the
+  // range is skipped rather than reported with a forged capability.
+  return const_cast<void*>(static_cast<void const*>(info->dlpi_phdr));
+#else
+  (void)info;
+  return cheri_ddc_get();
+#endif
+}
+
+struct Discovery {
+  RootList* roots;
+  unsigned sources;
+  size_t found;
+
+  void add(char const* name, void* __capability cap) {
+    if (!cheri_tag_get(cap)) return;
+    roots->push_back(NamedRoot{name, cap});
+    found++;
+  }
+};
+
+int visit_object(dl_phdr_info* info, size_t size, void* data) {
+  (void)size;
+  auto discovery = static_cast<Discovery*>(data);
+  // The main program has no name.
+  char const* name = (info->dlpi_name[0] != '\0') ? info->dlpi_name : "globals";
+  void* __capability authority = object_authority(info);
+  ptraddr_t base = static_cast<ptraddr_t>(info->dlpi_addr);
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    auto const& phdr = info->dlpi_phdr[i];
+    if (phdr.p_memsz == 0) continue;
+    if ((discovery->sources & kRootGlobals) && (phdr.p_type == PT_LOAD) &&
+        (phdr.p_flags & PF_W)) {
+      Range range = Range::from_base_length(base + phdr.p_vaddr, phdr.p_memsz);
+      discovery->add(name, derive(authority, range));
+    }
+    if ((discovery->sources & kRootTls) && (phdr.p_type == PT_TLS) &&
+        (info->dlpi_tls_data != nullptr)) {
+      // `dlpi_tls_data` is the calling thread's block for this object. In
+      // purecap, it is itself a suitable authority.
+#ifdef __CHERI_PURE_CAPABILITY__
+      void* __capability tls_authority = info->dlpi_tls_data;
+#else
+      void* __capability tls_authority = authority;
+#endif
+      Range range = Range::from_base_length(address_of(info->dlpi_tls_data), phdr.p_memsz);
+      discovery->add("tls", derive(tls_authority, range));
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+size_t discover_roots(RootList* roots, unsigned sources) {
+  Discovery discovery = {roots, sources, 0};
+  if (sources & (kRootGlobals | kRootTls)) dl_iterate_phdr(visit_object, &discovery);
+
+  if (sources & kRootStacks) {
+#ifdef __CHERI_PURE_CAPABILITY__
+    // Only the caller's stack can be derived from its stack capability.
+    void* __capability authority = __builtin_cheri_stack_get();
+#else
+    void* __capability authority = cheri_ddc_get();
+#endif
+    VmMap vmmap = VmMap::process();
+    for (auto const& entry : vmmap.entries()) {
+      if (!(entry.kinds & kVmStack) || !entry.can_load_caps()) continue;
+      discovery.add("stack", derive(authority, entry.range));
+    }
+  }
+  return discovery.found;
+}
+
+}  // namespace capmap
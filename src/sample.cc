@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-sample.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "src/scan.h"
+
+namespace capmap {
+
+namespace {
+
+// The 95% confidence interval for a proportion, given `tagged` successes in
+// `examined` trials, by Wilson's score method.
+void wilson_interval(uint64_t tagged, uint64_t examined, double* low, double* high) {
+  double const z = 1.96;
+  double n = static_cast<double>(examined);
+  double p = static_cast<double>(tagged) / n;
+  double scale = 1.0 + z * z / n;
+  double centre = p + z * z / (2.0 * n);
+  double spread = z * sqrt(p * (1.0 - p) / n + z * z / (4.0 * n * n));
+  *low = std::max(0.0, (centre - spread) / scale);
+  *high = std::min(1.0, (centre + spread) / scale);
+}
+
+// `count` capabilities in `population` granules, per million granules.
+uint64_t ppm(uint64_t count, uint64_t population) {
+  if (population == 0) return 0;
+  return static_cast<uint64_t>(static_cast<double>(count) * 1e6 / static_cast<double>(population));
+}
+
+void print_estimate(JsonWriter* out, MapEstimate const& estimate, char const* indent) {
+  auto print_bounds = [&](char const* name, Estimate const& value, char const* suffix) {
+    out->raw(indent);
+    out->raw('"');
+    out->raw(name);
+    out->raw("\": { \"estimate\": ");
+    out->dec(value.value);
+    out->raw(", \"low\": ");
+    out->dec(value.low);
+    out->raw(", \"high\": ");
+    out->dec(value.high);
+    out->raw(" }");
+    out->raw(suffix);
+  };
+  out->raw(indent);
+  out->raw("\"bytes\": ");
+  out->dec(estimate.bytes);
+  out->raw(",\n");
+  out->raw(indent);
+  out->raw("\"granules\": { \"population\": ");
+  out->dec(estimate.population);
+  out->raw(", \"examined\": ");
+  out->dec(estimate.examined);
+  out->raw(", \"tagged\": ");
+  out->dec(estimate.tagged);
+  out->raw(" },\n");
+  print_bounds("capabilities", estimate.capabilities, ",\n");
+  print_bounds("density-ppm", estimate.density_ppm, "\n");
+}
+
+}  // namespace
+
+void SampleEstimate::compute(Mapper const& mapper) {
+  interval_ = mapper.sample_interval();
+  samples_.clear();
+  samples_.insert(samples_.end(), mapper.samples().begin(), mapper.samples().end());
+  std::sort(samples_.begin(), samples_.end(), [](SampleRecord const& a, SampleRecord const& b) {
+    return a.range.base() < b.range.base();
+  });
+
+  total_ = estimate("scanned", "", nullptr);
+  total_.bytes = total_.population * sizeof(void* __capability);
+  maps_.clear();
+  auto add = [&](Map const& map) {
+    maps_.push_back(estimate(map.name(), map.address_space(), &map.ranges()));
+  };
+  add(mapper.load_cap_map_);
+  for (size_t i = 0; i < mapper.user_map_count(); i++) {
+    Map const& map = mapper.user_map(i);
+    if (map.submap_count() == 0) add(map);
+    for (size_t j = 0; j < map.submap_count(); j++) add(map.submap(j));
+  }
+}
+
+MapEstimate SampleEstimate::estimate(char const* name, char const* address_space,
+                                     RangeSet const* ranges) const {
+  uint64_t exact_tagged = 0;
+  uint64_t sampled_population = 0;
+  uint64_t sampled_examined = 0;
+  uint64_t sampled_tagged = 0;
+  MapEstimate result = MapEstimate();
+  result.name = name;
+  result.address_space = address_space;
+  result.bytes = (ranges == nullptr) ? 0 : range_bytes(*ranges);
+
+  // Both the samples and the ranges are sorted, so a single pass finds the
+  // samples that overlap the map.
+  RangeSet::const_iterator next;
+  if (ranges != nullptr) next = ranges->begin();
+  for (auto const& sample : samples_) {
+    if (ranges != nullptr) {
+      while ((next != ranges->end()) && (next->last() < sample.range.base())) ++next;
+      if ((next == ranges->end()) || (next->base() > sample.range.last())) continue;
+    }
+    uint64_t population = granules_in(sample.range);
+    result.population += population;
+    result.examined += sample.examined;
+    result.tagged += sample.tagged;
+    if (sample.exact) {
+      exact_tagged += sample.tagged;
+    } else {
+      sampled_population += population;
+      sampled_examined += sample.examined;
+      sampled_tagged += sample.tagged;
+    }
+  }
+
+  // Capabilities that were found are certain, as are granules examined without
+  // finding one.
+  Estimate& caps = result.capabilities;
+  caps.low = exact_tagged + sampled_tagged;
+  caps.high = exact_tagged + sampled_population - (sampled_examined - sampled_tagged);
+  caps.value = caps.low;
+  if (sampled_examined > 0) {
+    double low, high;
+    wilson_interval(sampled_tagged, sampled_examined, &low, &high);
+    double population = static_cast<double>(sampled_population);
+    double share = static_cast<double>(sampled_tagged) / static_cast<double>(sampled_examined);
+    caps.value = exact_tagged + static_cast<uint64_t>(share * population + 0.5);
+    caps.low = std::max(caps.low, exact_tagged + static_cast<uint64_t>(floor(low * population)));
+    caps.high = std::min(caps.high, exact_tagged + static_cast<uint64_t>(ceil(high * population)));
+    caps.value = std::min(std::max(caps.value, caps.low), caps.high);
+  }
+  result.density_ppm.value = ppm(caps.value, result.population);
+  result.density_ppm.low = ppm(caps.low, result.population);
+  result.density_ppm.high = ppm(caps.high, result.population);
+  return result;
+}
+
+SparseRange SampleEstimate::dense_ranges(uint64_t density_ppm) const {
+  RangeVector dense;
+  for (auto const& sample : samples_) {
+    if (sample.examined == 0) continue;
+    if (ppm(sample.tagged, sample.examined) >= density_ppm) dense.push_back(sample.range);
+  }
+  SparseRange result;
+  result.combine_all(&dense);
+  return result;
+}
+
+void SampleEstimate::print_json(FILE* stream) const {
+  JsonWriter out(stream);
+  print_json(&out);
+}
+
+void SampleEstimate::print_json(JsonWriter* out) const {
+  out->raw("\"capmap-estimate\": {\n");
+  out->raw("    \"interval\": ");
+  out->dec(interval_);
+  out->raw(",\n");
+  out->raw("    \"scanned\": {\n");
+  print_estimate(out, total_, "        ");
+  out->raw("    },\n");
+  out->raw("    \"maps\": {");
+  char const* sep = "\n";
+  for (auto const& map : maps_) {
+    out->raw(sep);
+    out->raw("        ");
+    out->string(map.name);
+    out->raw(": {\n");
+    out->raw("            \"address-space\": ");
+    out->string(map.address_space);
+    out->raw(",\n");
+    print_estimate(out, map, "            ");
+    out->raw("        }");
+    sep = ",\n";
+  }
+  out->raw("\n    }\n}\n");
+  out->flush();
+}
+
+}  // namespace capmap
@@ -0,0 +1,308 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+// Scan internals shared by the library's scanning engines. This is not part of
+// the public API.
+
+#ifndef CAPMAP_SRC_SCAN_H_
+#define CAPMAP_SRC_SCAN_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "include/capmap.h"
+
+#if __has_feature(capabilities)
+#include <cheriintrin.h>
+#else
+#error "scan.h requires capabilities"
+#endif
+
+// If greater than zero, print scan-related debug message to stderr.
+// This can help to diagnose why something is or isn't being found, but it
+// occurs before coalescing and redundancy checks, so is very verbose.
+#define SCAN_LOG_VERBOSITY 0
+
+#if SCAN_LOG_VERBOSITY > 0
+#define SCAN_LOG(verbosity, ...)             \
+  do {                                       \
+    if ((verbosity) <= SCAN_LOG_VERBOSITY) { \
+      fprintf(stderr, __VA_ARGS__);          \
+    }                                        \
+  } while (0)
+#else
+#define SCAN_LOG(...)
+#endif
+
+// If non-zero, use Morello's LDCT (CLoadTags) to skip untagged memory during
+// scans, so that full capability loads are only issued for tagged granules.
+//
+// LDCT is not available to EL0 on every platform, so this is disabled by
+// default.
+#ifndef CAPMAP_LOAD_TAGS
+#define CAPMAP_LOAD_TAGS 0
+#endif
+
+namespace capmap {
+
+#if CAPMAP_LOAD_TAGS
+// LDCT loads the tags for this many capability granules at once. The address
+// must be aligned to the size of the block.
+static size_t const kTagBlockGranules = 4;
+static size_t const kTagBlockBytes = kTagBlockGranules * sizeof(void* __capability);
+
+// Return the tags of the block of granules at `addr`, with bit N holding the
+// tag of the Nth granule.
+//
+// In purecap code, `authority` must permit loading capabilities from the block.
+// Hybrid code uses DDC, since LDCT has no alternate-base (capability) form in
+// A64.
+static inline uint64_t load_tags(void* __capability authority, ptraddr_t addr) {
+  uint64_t tags;
+#ifdef __CHERI_PURE_CAPABILITY__
+  asm("ldct %x[tags], [%w[addr]]\n"
+      : [tags] "=r"(tags)
+      : [addr] "r"(cheri_address_set(authority, addr)));
+#else
+  (void)authority;
+  asm("ldct %x[tags], [%x[addr]]\n" : [tags] "=r"(tags) : [addr] "r"(addr));
+#endif
+  return tags;
+}
+#endif
+
+// Steps with a time budget scan at most this many granules (a 4 KiB page's
+// worth) between checks of the clock.
+static uint64_t const kTimedChunkGranules = 4096 / sizeof(void* __capability);
+
+// Capabilities are passed to user maps (through `Map::try_combine_batch()`) in
+// batches of at most this many.
+static size_t const kMapBatch = 256;
+
+// The address of an ordinary (C++) pointer, in either ABI.
+static inline ptraddr_t address_of(void const* ptr) {
+#ifdef __CHERI_PURE_CAPABILITY__
+  return cheri_address_get(ptr);
+#else
+  return reinterpret_cast<ptraddr_t>(ptr);
+#endif
+}
+
+// Return a capability for `range`, derived from `authority`. Setting bounds
+// beyond those of `authority` clears the tag, so the result is untagged if
+// `authority` does not cover `range`. Ranges that are empty, or too long for
+// their length to be represented (i.e. the whole address space), give nullptr.
+static inline void* __capability derive(void* __capability authority, Range range) {
+  auto length = range.length();
+  if (range.is_empty() || length.first) return nullptr;
+  return cheri_bounds_set(cheri_address_set(authority, range.base()), length.second);
+}
+
+// Read the generic timer's virtual count, which the kernel makes readable at
+// EL0. This is much cheaper than `clock_gettime()`, so it is used for
+// `ScanStats` timings.
+static inline uint64_t now_ticks() {
+  uint64_t ticks;
+  asm volatile("isb\n"
+               "mrs %x[ticks], cntvct_el0\n"
+               : [ticks] "=r"(ticks));
+  return ticks;
+}
+
+// The number of nanoseconds since `start` (from `now_ticks()`).
+static inline uint64_t elapsed_ns(uint64_t start) {
+  uint64_t freq;
+  asm("mrs %x[freq], cntfrq_el0\n" : [freq] "=r"(freq));
+  if (freq == 0) return 0;
+  uint64_t ticks = now_ticks() - start;
+  return (ticks / freq) * 1000000000 + (ticks % freq) * 1000000000 / freq;
+}
+
+// The number of capability-aligned granules that `for_each_tagged()` examines
+// in `range`.
+static inline uint64_t granules_in(Range range) {
+  range.shrink_to_alignment(sizeof(void* __capability));
+  if (range.is_empty()) return 0;
+  return (range.last() - range.base()) / sizeof(void* __capability) + 1;
+}
+
+// The number of bytes in `ranges`, or UINT64_MAX if that does not fit.
+template <typename Ranges>
+static inline uint64_t range_bytes(Ranges const& ranges) {
+  uint64_t bytes = 0;
+  for (Range range : ranges) {
+    auto length = range.length();
+    if (length.first || (length.second > UINT64_MAX - bytes)) return UINT64_MAX;
+    bytes += length.second;
+  }
+  return bytes;
+}
+
+// True if the kernel can report which pages have never had capabilities stored
+// to them.
+bool can_probe_capability_free_pages();
+
+// Remove pages that the kernel reports have never had a capability stored to
+// them from `*pieces`, which must be sorted, and lie within the bounds of `cap`.
+//
+// Only pages entirely within a piece are checked, so partial pages (and any
+// pages that cannot be checked) are left for the granule loop. `*kept` and
+// `*status` are scratch space, kept by the caller to avoid reallocation.
+void drop_capability_free_pages(void* __capability cap, RangeVector* pieces,
+                                RangeVector* kept, ArenaVector<char>* status);
+
+// Write the "stats" block of `Mapper::print_json()`, which binary snapshots
+// reproduce too.
+void print_stats_json(JsonWriter* out, ScanStats const& stats);
+
+// Summarise the contents of `range` (read through `cap`) for `PageRecord`,
+// setting `hash` and `caps`.
+void summarise_page(void* __capability cap, PageRecord* page);
+
+// Split each of `pieces` (scanned through `cap`, found as `item`) at page
+// boundaries, and append a summary of each part to `*pages`.
+void record_pages(void* __capability cap, ScanItem const& item, RangeVector const& pieces,
+                  uint64_t generation, ArenaVector<PageRecord>* pages);
+
+// Granules are loaded a cache line at a time, and lines are prefetched this
+// far ahead of the loads. Both are tuned for Morello's 64-byte lines; see
+// `make bench`.
+static size_t const kLineGranules = 4;
+static size_t const kLineBytes = kLineGranules * sizeof(void* __capability);
+static size_t const kPrefetchBytes = 8 * kLineBytes;
+
+// Load the granule at `addr` through `cap`, whether or not it is tagged.
+static inline void* __capability load_granule(void* __capability cap, ptraddr_t addr) {
+  void* __capability candidate_cap;
+  asm("ldr %w[candidate], [%w[addr]]\n"
+      : [candidate] "=r"(candidate_cap)
+      : [addr] "r"(cheri_address_set(cap, addr)));
+  return candidate_cap;
+}
+
+// Hint that the line at `addr` will be read soon. Prefetches never fault, so
+// `addr` need not be within the bounds of `cap`. As with `load_tags()`, hybrid
+// code uses DDC.
+static inline void prefetch_line(void* __capability cap, ptraddr_t addr) {
+#ifdef __CHERI_PURE_CAPABILITY__
+  __builtin_prefetch(cheri_address_set(cap, addr), 0, 0);
+#else
+  (void)cap;
+  __builtin_prefetch(reinterpret_cast<void const*>(addr), 0, 0);
+#endif
+}
+
+// Load every capability-aligned granule in `range` through `cap` (which must
+// permit loading capabilities from it), and call `found(addr, candidate)` for
+// each one that holds a valid capability.
+//
+// Whole lines are loaded before any of their tags are tested, so the loads do
+// not wait on one another (or on `found`), and lines further on are prefetched
+// meanwhile. `found` should do as little as possible; `Mapper` only collects
+// the candidates, and queues them afterwards.
+template <typename F>
+static inline void for_each_tagged(void* __capability cap, Range range, F&& found) {
+  auto report = [&](ptraddr_t addr, void* __capability candidate_cap) {
+    if (cheri_tag_get(candidate_cap)) {
+      SCAN_LOG(2, "Found at %zx: %#lp\n", addr, candidate_cap);
+      found(addr, candidate_cap);
+    } else {
+      SCAN_LOG(2, "No cap at %zx.\n", addr);
+    }
+  };
+  auto probe = [&](ptraddr_t addr) { report(addr, load_granule(cap, addr)); };
+
+  range.shrink_to_alignment(sizeof(void* __capability));
+  ptraddr_t last = cheri_align_down(range.last(), sizeof(void* __capability));
+  ptraddr_t next = range.base();
+#if CAPMAP_LOAD_TAGS
+  // Probe granules individually up to the first aligned tag block, then load
+  // whole blocks of tags, and only load the capabilities that are actually
+  // tagged. Any partial block at the end is handled below.
+  for (; (next <= last) && ((next % kTagBlockBytes) != 0); next += sizeof(void* __capability)) {
+    probe(next);
+  }
+  for (; (next <= last) && ((last - next) >= (kTagBlockBytes - sizeof(void* __capability)));
+       next += kTagBlockBytes) {
+    if ((last - next) >= kPrefetchBytes) prefetch_line(cap, next + kPrefetchBytes);
+    for (uint64_t tags = load_tags(cap, next); tags != 0; tags &= tags - 1) {
+      probe(next + __builtin_ctzll(tags) * sizeof(void* __capability));
+    }
+  }
+#endif
+  // Load whole lines, then any granules left over one at a time.
+  for (; (next <= last) && ((last - next) >= (kLineBytes - sizeof(void* __capability)));
+       next += kLineBytes) {
+    if ((last - next) >= kPrefetchBytes) prefetch_line(cap, next + kPrefetchBytes);
+    void* __capability line[kLineGranules];
+    for (size_t i = 0; i < kLineGranules; i++) {
+      line[i] = load_granule(cap, next + i * sizeof(void* __capability));
+    }
+    for (size_t i = 0; i < kLineGranules; i++) {
+      report(next + i * sizeof(void* __capability), line[i]);
+    }
+  }
+  for (; next <= last; next += sizeof(void* __capability)) probe(next);
+}
+
+// Advance `*state`, and return the next pseudo-random number (from SplitMix64).
+static inline uint64_t next_random(uint64_t* state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+// As `for_each_tagged()`, but examine only one granule in every `interval`, in
+// a systematic sample of each page of `range`, starting at an offset chosen
+// from `*state`. Pages that `*exact` includes any of are examined in full.
+//
+// A `SampleRecord` is appended to `*records` for each page. Returns the number
+// of granules examined.
+template <typename F>
+static inline uint64_t for_each_sampled(void* __capability cap, Range range, uint32_t interval,
+                                        SparseRange::Cursor* exact, uint64_t* state,
+                                        ArenaVector<SampleRecord>* records, F&& found) {
+  static size_t const page_size = getpagesize();
+  size_t const granule = sizeof(void* __capability);
+  range.shrink_to_alignment(granule);
+  if (range.is_empty()) return 0;
+
+  uint64_t examined = 0;
+  ptraddr_t base = range.base();
+  while (true) {
+    ptraddr_t last = std::min(cheri_align_down(base, page_size) + (page_size - 1), range.last());
+    SampleRecord record{Range::from_base_last(base, last), 0, 0, false};
+    auto count = [&](ptraddr_t addr, void* __capability candidate) {
+      record.tagged++;
+      found(addr, candidate);
+    };
+    auto next_exact = exact->next_included(base);
+    if (next_exact.first && (next_exact.second <= last)) {
+      record.exact = true;
+      record.examined = granules_in(record.range);
+      for_each_tagged(cap, record.range, count);
+    } else {
+      // `span` is at most a page, so the offsets can't overflow.
+      uint64_t span = last - base + 1;
+      uint64_t stride = uint64_t(interval) * granule;
+      for (uint64_t offset = (next_random(state) % interval) * granule; offset < span;
+           offset += stride) {
+        record.examined++;
+        for_each_tagged(cap, Range::from_base_length(base + offset, granule), count);
+      }
+    }
+    examined += record.examined;
+    records->push_back(record);
+    if (last == range.last()) break;
+    base = last + 1;
+  }
+  return examined;
+}
+
+}  // namespace capmap
+#endif
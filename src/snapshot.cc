@@ -0,0 +1,116 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-snapshot.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "include/capmap.h"
+
+namespace capmap {
+
+ForkedScan::~ForkedScan() {
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+  if (pid_ >= 0) kill(pid_, SIGKILL);
+  reap();
+}
+
+bool ForkedScan::start(Mapper* mapper, Roots const& roots) {
+  return spawn(mapper, &roots, nullptr, nullptr, nullptr);
+}
+
+bool ForkedScan::start(Mapper* mapper, void* __capability cap, char const* name) {
+  return spawn(mapper, nullptr, nullptr, cap, name);
+}
+
+bool ForkedScan::start(Mapper* mapper, RootList const& roots) {
+  return spawn(mapper, nullptr, &roots, nullptr, nullptr);
+}
+
+bool ForkedScan::spawn(Mapper* mapper, Roots const* roots, RootList const* batch,
+                       void* __capability cap, char const* name) {
+  if (pid_ >= 0) return false;
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  // Make sure that the child doesn't inherit (and later flush) buffered output.
+  fflush(nullptr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    // The child: scan the frozen image, write the result, and exit without
+    // running the parent's atexit handlers or destructors.
+    close(fds[0]);
+    if (roots) {
+      mapper->scan(*roots);
+    } else if (batch) {
+      mapper->scan(*batch);
+    } else {
+      mapper->scan(cap, name);
+    }
+    bool ok;
+    {
+      JsonWriter out(fds[1]);
+      mapper->print_json(&out);
+      ok = out.flush();
+    }
+    close(fds[1]);
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fds[1]);
+  fd_ = fds[0];
+  pid_ = pid;
+  return true;
+}
+
+bool ForkedScan::finish(FILE* out) {
+  if (pid_ < 0) return false;
+  bool ok = true;
+  char buffer[4096];
+  while (fd_ >= 0) {
+    ssize_t n = read(fd_, buffer, sizeof(buffer));
+    if (n > 0) {
+      if (fwrite(buffer, 1, n, out) != static_cast<size_t>(n)) ok = false;
+    } else if ((n < 0) && (errno == EINTR)) {
+      continue;
+    } else {
+      ok = ok && (n == 0);
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+  fflush(out);
+  return reap() && ok;
+}
+
+bool ForkedScan::reap() {
+  if (pid_ < 0) return false;
+  int status;
+  pid_t result;
+  do {
+    result = waitpid(pid_, &status, 0);
+  } while ((result < 0) && (errno == EINTR));
+  pid_ = -1;
+  return (result >= 0) && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+bool snapshot_scan_and_print_json(FILE* stream) {
+  Roots roots = get_roots();
+  Mapper mapper;
+  ForkedScan scan;
+  if (!scan.start(&mapper, roots)) return false;
+  return scan.finish(stream);
+}
+
+}  // namespace capmap
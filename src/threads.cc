@@ -0,0 +1,212 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-threads.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// BSD headers for listing and signalling threads.
+#include <sys/sysctl.h>
+#include <sys/thr.h>
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "include/capmap.h"
+#include "scan.h"
+
+namespace capmap {
+
+namespace {
+
+// The capture in progress, if any. Signal handlers find it here.
+std::atomic<ThreadCapture*> active{nullptr};
+// The number of signal handlers that might be using `active`.
+std::atomic<size_t> busy{0};
+
+std::mutex install_lock;
+int installed_signal = 0;
+
+}  // namespace
+
+ThreadCapture::ThreadCapture(size_t max_threads, int signal)
+    : signal_(signal), max_threads_(max_threads) {
+  threads_.reserve(max_threads_);
+  // Leave room for the caller's own thread.
+  procs_size_ = (max_threads_ + 1) * sizeof(kinfo_proc);
+  procs_ = Arena::get().allocate(procs_size_, alignof(kinfo_proc));
+}
+
+ThreadCapture::~ThreadCapture() {
+  release();
+  Arena::get().deallocate(procs_, procs_size_, alignof(kinfo_proc));
+}
+
+void ThreadCapture::handle(int signal, siginfo_t* info, void* context) {
+  (void)signal;
+  (void)info;
+  int saved_errno = errno;
+  busy++;
+  ThreadCapture* self = active.load();
+  bool accepted = false;
+  if (self != nullptr) {
+    if (self->accepting_) {
+      long tid;
+      thr_self(&tid);
+      for (auto& thread : self->threads_) {
+        if ((thread.tid == tid) && !thread.captured) {
+          self->capture(&thread, context);
+          accepted = true;
+          break;
+        }
+      }
+    }
+    if (accepted) {
+      self->waiting_++;
+      self->responded_++;
+    }
+  }
+  busy--;
+  if (accepted) {
+    // Wait for `release()`, keeping the registers (and the stack above this
+    // frame) as they are. `release()` waits for `waiting_`, so `self` is valid
+    // until then.
+    char byte;
+    while ((read(self->wait_fds_[0], &byte, 1) < 0) && (errno == EINTR)) {
+    }
+    self->waiting_--;
+  }
+  errno = saved_errno;
+}
+
+void ThreadCapture::capture(ThreadRoots* thread, void* context) {
+#ifdef __CHERI_PURE_CAPABILITY__
+  // Both of these are already bounded capabilities.
+  void* __capability context_authority = context;
+  void* __capability stack_authority = __builtin_cheri_stack_get();
+#else
+  void* __capability context_authority = cheri_ddc_get();
+  void* __capability stack_authority = cheri_ddc_get();
+#endif
+  Range context_range = Range::from_base_length(address_of(context), sizeof(ucontext_t));
+  thread->context = derive(context_authority, context_range);
+
+  // Everything below this frame is dead, so the live stack starts here.
+  char here;
+  ptraddr_t sp = address_of(&here) & ~static_cast<ptraddr_t>(sizeof(void* __capability) - 1);
+  VmEntry const* entry = vmmap_.find(sp);
+  if (entry != nullptr) {
+    thread->stack = derive(stack_authority, Range::from_base_last(sp, entry->range.last()));
+  }
+  thread->captured = true;
+}
+
+bool ThreadCapture::stop(uint64_t timeout_ns) {
+  if (stopped_) return false;
+  ThreadCapture* expected = nullptr;
+  if (!active.compare_exchange_strong(expected, this)) return false;
+
+  // List the threads, and prepare everything that the handlers need, before
+  // stopping anything.
+  threads_.clear();
+  captured_ = 0;
+  pause_ns_ = 0;
+  stopped_ns_ = 0;
+  responded_ = 0;
+  int mib[4] = {CTL_KERN, KERN_PROC, KERN_PROC_PID | KERN_PROC_INC_THREAD, getpid()};
+  size_t size = procs_size_;
+  if ((sysctl(mib, 4, procs_, &size, nullptr, 0) != 0) && (errno != ENOMEM)) {
+    active = nullptr;
+    return false;
+  }
+  // If there are more than `max_threads` threads, the kernel fills the buffer,
+  // and reports ENOMEM; capture as many as fit.
+  auto procs = static_cast<kinfo_proc const*>(procs_);
+  size_t count = size / sizeof(kinfo_proc);
+  long self_tid;
+  thr_self(&self_tid);
+  for (size_t i = 0; (i < count) && (threads_.size() < max_threads_); i++) {
+    if (procs[i].ki_tid == self_tid) continue;
+    ThreadRoots thread = {};
+    thread.tid = procs[i].ki_tid;
+    snprintf(thread.context_name, sizeof(thread.context_name), "thread %ld context", thread.tid);
+    snprintf(thread.stack_name, sizeof(thread.stack_name), "thread %ld stack", thread.tid);
+    threads_.push_back(thread);
+  }
+  vmmap_ = VmMap::process();
+  if (pipe(wait_fds_) != 0) {
+    active = nullptr;
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(install_lock);
+    if (installed_signal != signal_) {
+      struct sigaction action = {};
+      action.sa_sigaction = handle;
+      action.sa_flags = SA_SIGINFO | SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(signal_, &action, nullptr);
+      installed_signal = signal_;
+    }
+  }
+
+  // Signal every thread at once, then wait for them to respond.
+  stopped_ = true;
+  accepting_ = true;
+  start_ticks_ = now_ticks();
+  size_t signalled = 0;
+  for (auto const& thread : threads_) {
+    if (thr_kill(thread.tid, signal_) == 0) signalled++;
+  }
+  while ((responded_ < signalled) && (elapsed_ns(start_ticks_) < timeout_ns)) {
+    std::this_thread::yield();
+  }
+  // Stop accepting late responders, and wait for any handler that has already
+  // started to finish updating `threads_`.
+  accepting_ = false;
+  while (busy > 0) std::this_thread::yield();
+  pause_ns_ = elapsed_ns(start_ticks_);
+  captured_ = responded_;
+  return true;
+}
+
+void ThreadCapture::release() {
+  if (!stopped_) return;
+  // Each captured thread reads exactly one byte.
+  for (size_t i = 0; i < captured_; i++) {
+    char byte = 0;
+    while ((write(wait_fds_[1], &byte, 1) < 0) && (errno == EINTR)) {
+    }
+  }
+  stopped_ns_ = elapsed_ns(start_ticks_);
+  // Handlers that start from now on ignore this capture. Wait for them, and
+  // for the released threads to stop using the pipe, before closing it.
+  active = nullptr;
+  while ((busy > 0) || (waiting_ > 0)) std::this_thread::yield();
+  close(wait_fds_[0]);
+  close(wait_fds_[1]);
+  wait_fds_[0] = wait_fds_[1] = -1;
+  stopped_ = false;
+}
+
+void ThreadCapture::append_roots(RootList* roots) const {
+  for (auto const& thread : threads_) {
+    if (!thread.captured) continue;
+    if (cheri_tag_get(thread.context)) {
+      roots->push_back(NamedRoot{thread.context_name, thread.context});
+    }
+    if (cheri_tag_get(thread.stack)) roots->push_back(NamedRoot{thread.stack_name, thread.stack});
+  }
+}
+
+}  // namespace capmap
@@ -0,0 +1,147 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-vmmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// BSD headers for kinfo_getvmmap.
+#include <libutil.h>
+#include <sys/sysctl.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+
+namespace capmap {
+
+namespace {
+
+unsigned classify(kinfo_vmentry const& vm) {
+  bool file = vm.kve_type == KVME_TYPE_VNODE;
+  unsigned backing = file ? kVmFile : kVmAnonymous;
+  if ((vm.kve_type == KVME_TYPE_GUARD) || !(vm.kve_protection & KVME_PROT_READ)) {
+    return kVmGuard | backing;
+  }
+  if (vm.kve_flags & KVME_FLAG_GROWS_DOWN) return kVmStack | backing;
+  if (file) return ((vm.kve_protection & KVME_PROT_EXEC) ? kVmText : kVmData) | backing;
+  switch (vm.kve_type) {
+    case KVME_TYPE_DEFAULT:
+    case KVME_TYPE_SWAP:
+      return kVmHeap | backing;
+    default:
+      return kVmOther | backing;
+  }
+}
+
+}  // namespace
+
+bool VmEntry::can_load_caps() const {
+  return (protection & KVME_PROT_READ) && (protection & KVME_PROT_READ_CAP);
+}
+
+namespace {
+
+std::mutex process_lock;
+
+VmMap& process_map() {
+  static VmMap* map = new VmMap();
+  map->refresh_if_changed();
+  return *map;
+}
+
+}  // namespace
+
+VmMap VmMap::process() {
+  std::lock_guard<std::mutex> guard(process_lock);
+  return process_map();
+}
+
+SparseRange VmMap::process_ranges(unsigned kinds, bool load_caps_only) {
+  std::lock_guard<std::mutex> guard(process_lock);
+  return process_map().ranges(kinds, load_caps_only);
+}
+
+VmMap& VmMap::operator=(VmMap const& other) {
+  if (this == &other) return *this;
+  pid_ = other.pid_;
+  mapped_bytes_ = other.mapped_bytes_;
+  generation_ = other.generation_;
+  // Paths point into `paths_`, so rebase them onto the copy.
+  paths_ = other.paths_;
+  entries_ = other.entries_;
+  for (auto& entry : entries_) entry.path = paths_.data() + (entry.path - other.paths_.data());
+  return *this;
+}
+
+size_t VmMap::mapped_bytes() const {
+  // Unlike KERN_PROC_VMMAP (even when only asked for its size), this doesn't
+  // walk the map or look up any paths: the kernel keeps a running total.
+  int mib[4] = {CTL_KERN, KERN_PROC, KERN_PROC_PID, (pid_ == 0) ? getpid() : pid_};
+  kinfo_proc proc;
+  size_t size = sizeof(proc);
+  if ((sysctl(mib, 4, &proc, &size, nullptr, 0) != 0) || (size != sizeof(proc))) return 0;
+  return proc.ki_size;
+}
+
+bool VmMap::refresh_if_changed() {
+  size_t bytes = mapped_bytes();
+  if ((generation_ > 0) && (bytes != 0) && (bytes == mapped_bytes_)) return false;
+  refresh();
+  return true;
+}
+
+bool VmMap::refresh() {
+  entries_.clear();
+  paths_.clear();
+  generation_++;
+  mapped_bytes_ = mapped_bytes();
+
+  int count;
+  kinfo_vmentry* vm = kinfo_getvmmap((pid_ == 0) ? getpid() : pid_, &count);
+  if (vm == nullptr) return false;
+
+  // Reserve space for every path first, so that entries can point into it.
+  size_t path_bytes = 1;
+  for (int i = 0; i < count; i++) path_bytes += strlen(vm[i].kve_path) + 1;
+  paths_.reserve(path_bytes);
+  paths_.push_back('\0');
+  char const* empty = paths_.data();
+
+  entries_.reserve(count);
+  for (int i = 0; i < count; i++) {
+    char const* path = empty;
+    if (vm[i].kve_path[0] != '\0') {
+      path = paths_.data() + paths_.size();
+      paths_.insert(paths_.end(), vm[i].kve_path, vm[i].kve_path + strlen(vm[i].kve_path) + 1);
+    }
+    entries_.push_back(VmEntry{Range::from_base_limit(vm[i].kve_start, vm[i].kve_end),
+                               vm[i].kve_protection, classify(vm[i]), path});
+  }
+  free(vm);
+  return true;
+}
+
+VmEntry const* VmMap::find(ptraddr_t addr) const {
+  // The kernel reports entries in address order.
+  auto by_base = [](ptraddr_t addr, VmEntry const& e) { return addr < e.range.base(); };
+  auto it = std::upper_bound(entries_.begin(), entries_.end(), addr, by_base);
+  if (it == entries_.begin()) return nullptr;
+  --it;
+  return it->range.includes(addr) ? &*it : nullptr;
+}
+
+SparseRange VmMap::ranges(unsigned kinds, bool load_caps_only) const {
+  SparseRange map;
+  for (auto const& entry : entries_) {
+    if (!(entry.kinds & kinds)) continue;
+    if (load_caps_only && !entry.can_load_caps()) continue;
+    map.combine(entry.range);
+  }
+  return map;
+}
+
+}  // namespace capmap
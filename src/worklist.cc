@@ -0,0 +1,84 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-worklist.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace capmap {
+
+void Worklist::print_trail(FILE* stream, ScanItem const& item) const {
+  print_scan_trail(stream, item,
+                   [this](size_t parent) -> ScanItem const& { return trail_[parent]; });
+}
+
+SeenSet::Key SeenSet::key_of(void* __capability cap) {
+  // `cheri_type_get()` distinguishes unsealed capabilities and sentries too.
+  return Key{cheri_base_get(cap), cheri_length_get(cap), cheri_perms_get(cap),
+             static_cast<uint64_t>(cheri_type_get(cap)), true};
+}
+
+size_t SeenSet::hash(Key const& key) {
+  uint64_t h = key.base * 0x9e3779b97f4a7c15;
+  h ^= (key.length + (h << 6) + (h >> 2)) * 0xc2b2ae3d27d4eb4f;
+  h ^= (key.perms + (h << 6) + (h >> 2)) * 0x165667b19e3779f9;
+  h ^= key.otype + (h << 6) + (h >> 2);
+  return h ^ (h >> 32);
+}
+
+size_t SeenSet::find(Key const& key) const {
+  size_t mask = slots_.size() - 1;
+  size_t i = hash(key) & mask;
+  while (slots_[i].used && !(slots_[i] == key)) i = (i + 1) & mask;
+  return i;
+}
+
+bool SeenSet::contains(void* __capability cap) const {
+  if (size_ == 0) return false;
+  return slots_[find(key_of(cap))].used;
+}
+
+bool SeenSet::insert(void* __capability cap) {
+  // Keep the load factor at or below one half, so probe sequences stay short.
+  if ((size_ + 1) * 2 > slots_.size()) grow();
+  Key key = key_of(cap);
+  size_t i = find(key);
+  if (slots_[i].used) return false;
+  slots_[i] = key;
+  size_++;
+  return true;
+}
+
+void SeenSet::grow() {
+  ArenaVector<Key> old;
+  old.swap(slots_);
+  slots_.resize(old.empty() ? 64 : old.size() * 2, Key{0, 0, 0, 0, false});
+  for (auto const& key : old) {
+    if (key.used) slots_[find(key)] = key;
+  }
+}
+
+void SealedIndex::add(ScanItem const& item) {
+  entries_.push_back(Entry{static_cast<uint64_t>(cheri_type_get(item.cap)), item});
+}
+
+void SealedIndex::take(uint64_t first, uint64_t last, ArenaVector<ScanItem>* out) {
+  auto by_otype = [](Entry const& a, Entry const& b) { return a.otype < b.otype; };
+  // `std::sort()` (unlike `std::inplace_merge()`) needs no temporary buffer
+  // outside the arena.
+  if (sorted_ < entries_.size()) {
+    std::sort(entries_.begin(), entries_.end(), by_otype);
+    sorted_ = entries_.size();
+  }
+  auto begin = std::lower_bound(entries_.begin(), entries_.end(), first,
+                                [](Entry const& e, uint64_t otype) { return e.otype < otype; });
+  auto end = std::upper_bound(begin, entries_.end(), last,
+                              [](uint64_t otype, Entry const& e) { return otype < e.otype; });
+  for (auto it = begin; it != end; ++it) out->push_back(it->item);
+  entries_.erase(begin, end);
+  sorted_ = entries_.size();
+}
+
+}  // namespace capmap
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include "include/capmap-writer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace capmap {
+
+bool ByteWriter::flush() {
+  write_out(buffer_, used_);
+  used_ = 0;
+  if (stream_ && ok_) ok_ = fflush(stream_) == 0;
+  return ok_;
+}
+
+void ByteWriter::write_out(char const* data, size_t size) {
+  if (!ok_ || (size == 0)) return;
+  if (sink_) {
+    ok_ = sink_(context_, data, size);
+    return;
+  }
+  if (stream_) {
+    ok_ = fwrite(data, 1, size, stream_) == size;
+    return;
+  }
+  while (size > 0) {
+    ssize_t written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      ok_ = false;
+      return;
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+void ByteWriter::raw(void const* data, size_t size) {
+  auto bytes = static_cast<char const*>(data);
+  while (size > 0) {
+    if (used_ == kBufferSize) flush();
+    size_t n = std::min(size, kBufferSize - used_);
+    memcpy(buffer_ + used_, bytes, n);
+    used_ += n;
+    bytes += n;
+    size -= n;
+  }
+}
+
+}  // namespace capmap
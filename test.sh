@@ -22,6 +22,14 @@ if [ -z "${NORUN+norun}" ]; then
                   cd $REMOTEDIR;
                   ./test-morello-purecap;
                   ./test-morello-hybrid;
+                  ./test-flat-morello-purecap;
+                  ./test-flat-morello-hybrid;
+                  if [ -z \"${NOLDCT+noldct}\" ]; then
+                    ./test-load-tags-morello-purecap;
+                    ./test-load-tags-morello-hybrid;
+                  else
+                    echo \"Skipping LDCT tests because NOLDCT is set.\";
+                  fi;
                   echo -n \"Running example-default-morello-purecap... \";
                   ./example-default-morello-purecap > /dev/null;
                   echo \"Ok\";
@@ -0,0 +1,108 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdint.h>
+
+#include "include/capmap-arena.h"
+#include "include/capmap-range.h"
+#include "tests.h"
+
+using capmap::Arena;
+using capmap::Range;
+using capmap::SparseRange;
+
+TEST(arena_allocate) {
+  Arena& arena = Arena::get();
+  size_t live = arena.live();
+  uint64_t generation = arena.generation();
+
+  void* small = arena.allocate(24, 8);
+  void* big = arena.allocate(3 << 20, 16);
+  if (options().verbose()) {
+    printf("Arena: [%#zx, %#zx), small: %p, big: %p\n", arena.base(), arena.limit(), small, big);
+  }
+  TRY(arena.live() == live + 2);
+  // Usage is counted by size class, so it is at least what was asked for.
+  size_t bytes = arena.bytes();
+  TRY(bytes >= 24 + (3 << 20));
+  if (arena.limit() > arena.base()) {
+    TRY(arena.contains(small));
+    TRY(arena.contains(big));
+  }
+  TRY((reinterpret_cast<uintptr_t>(small) % 16) == 0);
+
+  // Freed blocks are reused for the same size class.
+  arena.deallocate(small, 24);
+  void* again = arena.allocate(32, 16);
+  if (arena.limit() > arena.base()) TRY(again == small);
+  arena.deallocate(again, 32);
+  arena.deallocate(big, 3 << 20);
+
+  TRY(arena.live() == live);
+  TRY(arena.bytes() <= bytes - (3 << 20));
+  // If nothing else was live, the arena was rewound.
+  if (live == 0) TRY(arena.generation() > generation);
+}
+
+TEST(arena_reuse) {
+  Arena& arena = Arena::get();
+  bool const reserved = arena.limit() > arena.base();
+
+  // Over-aligned blocks are still full class blocks, so reusing one for a
+  // larger request in the same class is safe.
+  void* aligned = arena.allocate(24, 256);
+  TRY((reinterpret_cast<uintptr_t>(aligned) % 256) == 0);
+  arena.deallocate(aligned, 24, 256);
+  void* again = arena.allocate(256, 16);
+  if (reserved) TRY(again == aligned);
+  arena.deallocate(again, 256);
+
+  // Large blocks are reused too.
+  void* big = arena.allocate(3 << 20, 16);
+  arena.deallocate(big, 3 << 20);
+  void* big_again = arena.allocate(3 << 20, 16);
+  if (reserved) TRY(big_again == big);
+
+  // Blocks that don't fit in the arena are reported, so that they can be
+  // excluded from scans.
+  if (reserved) {
+    size_t size = (arena.limit() - arena.base()) + 16;
+    void* fallback = arena.allocate(size, 16);
+    TRY(!arena.contains(fallback));
+    auto blocks = arena.fallback_blocks();
+    TRY(blocks.size() == 1);
+    TRY(blocks[0].first == static_cast<ptraddr_t>(reinterpret_cast<uintptr_t>(fallback)));
+    TRY(blocks[0].second == size);
+    arena.deallocate(fallback, size);
+    TRY(arena.fallback_blocks().empty());
+  }
+  arena.deallocate(big_again, 3 << 20);
+}
+
+TEST(arena_reuse_alignment) {
+  // A class block made for a weakly-aligned request is aligned to its class
+  // anyway, so it can be reused for a request with a stricter alignment.
+  Arena& arena = Arena::get();
+  void* before = arena.allocate(16, 16);
+  void* block = arena.allocate(64, 16);
+  TRY((reinterpret_cast<uintptr_t>(block) % 64) == 0);
+  arena.deallocate(block, 64, 16);
+  void* again = arena.allocate(64, 64);
+  TRY((reinterpret_cast<uintptr_t>(again) % 64) == 0);
+  arena.deallocate(again, 64, 64);
+  arena.deallocate(before, 16, 16);
+}
+
+TEST(arena_sparse_range) {
+  // SparseRange parts come from the arena, so they can be excluded with it.
+  Arena& arena = Arena::get();
+  size_t live = arena.live();
+  {
+    SparseRange sr;
+    for (ptraddr_t i = 0; i < 100; i++) sr.combine(Range::from_base_length(i * 16, 8));
+    TRY(sr.parts().size() == 100);
+    TRY(arena.live() > live);
+    if (arena.limit() > arena.base()) TRY(arena.contains(&*sr.parts().begin()));
+  }
+  TRY(arena.live() == live);
+}
@@ -0,0 +1,150 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "include/capmap-binary.h"
+#include "include/capmap.h"
+#include "tests.h"
+
+using capmap::BinarySnapshot;
+using capmap::Mapper;
+using capmap::Range;
+using capmap::RangeView;
+using capmap::SparseRange;
+using capmap::tests::capture;
+
+namespace {
+
+// A data capability for `obj`. Execute permission is removed (in case DDC has
+// it), so that only the test's code capabilities appear in an `ExecuteMap`.
+template <typename T>
+void* __capability data_cap(T* obj) {
+  return cheri_perms_and(capmap::tests::cap(obj), ~static_cast<cheri_perms_t>(CHERI_PERM_EXECUTE));
+}
+
+// Everything before the "stats" block, whose output times differ between
+// runs.
+std::string before_stats(std::string const& json) { return json.substr(0, json.find("\"stats\"")); }
+
+bool same_ranges(RangeView view, capmap::RangeSet const& ranges) {
+  if (view.size() != ranges.size()) return false;
+  return std::equal(ranges.begin(), ranges.end(), view.begin());
+}
+
+}  // namespace
+
+TEST(binary_round_trip) {
+  // A heap buffer, and some overlapping executable capabilities (without
+  // LoadCap, so that they aren't scanned), so that the snapshot has both
+  // merged and overlapping maps.
+  void* buffer = calloc(1, 256);
+  void* __capability pcc = cheri_perms_and(cheri_pcc_get(), CHERI_PERM_LOAD | CHERI_PERM_EXECUTE);
+  ptraddr_t base = cheri_base_get(pcc);
+  void* __capability caps[3] = {
+      data_cap(static_cast<char(*)[256]>(buffer)),
+      cheri_bounds_set(cheri_address_set(pcc, base + 0x100), 0x200),
+      cheri_bounds_set(cheri_address_set(pcc, base + 0x200), 0x200),
+  };
+
+  Mapper mapper;
+  mapper.maps()->push_back(std::make_unique<capmap::ExecuteMap>());
+  mapper.scan(data_cap(&caps), "caps");
+
+  char path[] = "/tmp/capmap-binary-XXXXXX";
+  int fd = mkstemp(path);
+  TRY(fd >= 0);
+  FILE* file = fdopen(fd, "w");
+  TRY(file != nullptr);
+  TRY(mapper.write_binary(file));
+  fclose(file);
+
+  BinarySnapshot snapshot;
+  TRY(snapshot.open(path));
+  unlink(path);
+
+  TRY(snapshot.root_count() == 1);
+  TRY(strcmp(snapshot.root_name(0), "caps") == 0);
+  TRY(snapshot.root(0).tag == 1);
+  TRY(snapshot.config().max_seen_scan_depth == mapper.max_seen_scan_depth());
+  TRY(snapshot.config().dedup_misses == mapper.dedup_misses());
+  // Each counter is stored in its own slot, so check several.
+  TRY(snapshot.stats().granules == mapper.stats().granules);
+  TRY(snapshot.stats().tagged == mapper.stats().tagged);
+  TRY(snapshot.stats().rejected_no_load_cap == mapper.stats().rejected_no_load_cap);
+  TRY(snapshot.stats().range_parts == mapper.stats().range_parts);
+  TRY(snapshot.stats().sample_interval == 1);
+  // Map sizes come from the maps, with overlapping ranges merged.
+  capmap::ScanStats stats = snapshot.stats();
+  TRY(stats.maps.size() == 2);
+  TRY(stats.maps[0].parts == mapper.stats().maps[0].parts);
+  TRY(stats.maps[0].bytes == mapper.stats().maps[0].bytes);
+  TRY(strcmp(stats.maps[1].name, "execute") == 0);
+  TRY(stats.maps[1].parts == 1);
+  TRY(stats.maps[1].bytes == 0x300);
+  TRY(mapper.stats().maps[1].bytes == 0x300);
+  TRY(same_ranges(snapshot.include(), mapper.include()->parts()));
+
+  TRY(snapshot.map_count() == 2);
+  TRY(strcmp(snapshot.map_name(0), mapper.load_cap_map().name()) == 0);
+  TRY(!snapshot.map_ranges(0).overlapping());
+  TRY(same_ranges(snapshot.map_ranges(0), mapper.load_cap_map().ranges()));
+  TRY(snapshot.map_ranges(0).includes(cheri_base_get(caps[0])));
+  TRY(!snapshot.map_ranges(0).includes(base + 0x100));
+
+  RangeView execute = snapshot.map_ranges(1);
+  TRY(strcmp(snapshot.map_name(1), "execute") == 0);
+  TRY(execute.overlapping());
+  TRY(execute.size() == 2);
+  TRY(execute.includes(base + 0x3ff));
+  TRY(!execute.includes(base + 0x400));
+  TRY(execute.overlaps(Range::from_base_length(base, 0x101)));
+  TRY(!execute.overlaps(Range::from_base_length(base, 0x100)));
+  TRY(execute.to_sparse_range() == SparseRange(Range::from_base_length(base + 0x100, 0x300)));
+
+  // Asking for a map that isn't there is safe.
+  TRY(snapshot.map_name(2) == nullptr);
+  TRY(snapshot.map_address_space(2) == nullptr);
+  TRY(snapshot.map_ranges(2).is_empty());
+
+  std::string expected = capture([&](FILE* stream) { mapper.print_json(stream); });
+  std::string actual = capture([&](FILE* stream) { snapshot.print_json(stream); });
+  if (options().verbose()) printf("%s", actual.c_str());
+  TRY(before_stats(actual) == before_stats(expected));
+  TRY(actual.find("\"stats\"") != std::string::npos);
+  free(buffer);
+}
+
+TEST(binary_rejects_invalid) {
+  Mapper mapper;
+  void* __capability slot = nullptr;
+  mapper.scan(data_cap(&slot), "slot");
+  std::string data = capture([&](FILE* stream) { mapper.write_binary(stream); });
+  TRY(data.size() > sizeof(capmap::binary::Header));
+
+  // malloc() provides the 16-byte alignment that snapshots need.
+  char* copy = static_cast<char*>(malloc(data.size()));
+  memcpy(copy, data.data(), data.size());
+  BinarySnapshot snapshot;
+  TRY(snapshot.open(copy, data.size()));
+  TRY(snapshot.root_count() == 1);
+  TRY(!snapshot.open(copy, data.size() - 1));
+  TRY(!snapshot.open(copy + 16, data.size() - 16));
+
+  auto header = reinterpret_cast<capmap::binary::Header*>(copy);
+  header->version++;
+  TRY(!snapshot.open(copy, data.size()));
+  header->version--;
+  header->magic[0] = 'X';
+  TRY(!snapshot.open(copy, data.size()));
+  TRY(!snapshot.is_open());
+  free(copy);
+}
@@ -0,0 +1,169 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "include/capmap-binary.h"
+#include "include/capmap-diff.h"
+#include "include/capmap.h"
+#include "tests.h"
+
+using capmap::BinarySnapshot;
+using capmap::Mapper;
+using capmap::Range;
+using capmap::ScanDiff;
+using capmap::SparseRange;
+using capmap::tests::cap;
+using capmap::tests::capture;
+
+namespace {
+
+typedef void* __capability Slots[2];
+
+}  // namespace
+
+TEST(diff_unchanged) {
+  // In the steady state, rescanning finds nothing new, and the diff is (almost)
+  // nothing.
+  void* buffer = calloc(1, 64);
+  Slots* holder = static_cast<Slots*>(calloc(1, sizeof(Slots)));
+  (*holder)[0] = cap(static_cast<char(*)[64]>(buffer));
+
+  Mapper mapper;
+  mapper.set_incremental(true);
+  mapper.scan(cap(holder), "holder");
+  BinarySnapshot snapshots[2];
+  TRY(snapshots[0].capture(&mapper));
+  mapper.rescan();
+  TRY(snapshots[1].capture(&mapper));
+
+  ScanDiff diff;
+  diff.compute(snapshots[0], snapshots[1]);
+  TRY(diff.is_empty());
+  std::string json = capture([&](FILE* stream) { diff.print_json(stream); });
+  TRY(json == "\"capmap-diff\": {}\n");
+  std::string data = capture([&](FILE* stream) { diff.write_binary(stream); });
+  TRY(data.size() == capmap::binary::aligned(sizeof(capmap::binary::Header)));
+  TRY(memcmp(data.data(), capmap::binary::kDiffMagic, sizeof(capmap::binary::kDiffMagic)) == 0);
+  free(holder);
+  free(buffer);
+}
+
+TEST(diff_changes) {
+  void* buffers[3];
+  for (auto& buffer : buffers) buffer = calloc(1, 64);
+  Slots* holder = static_cast<Slots*>(calloc(1, sizeof(Slots)));
+  (*holder)[0] = cap(static_cast<char(*)[64]>(buffers[0]));
+
+  Mapper before;
+  before.scan(cap(holder), "holder");
+  BinarySnapshot old_snapshot;
+  TRY(old_snapshot.capture(&before));
+
+  // Add a chain of two more buffers, and another root.
+  (*holder)[1] = cap(static_cast<char(*)[64]>(buffers[1]));
+  *static_cast<void* __capability*>(buffers[1]) = cap(static_cast<char(*)[64]>(buffers[2]));
+  Mapper after;
+  after.scan(cap(holder), "holder");
+  after.scan(cap(static_cast<char(*)[64]>(buffers[2])), "extra");
+  BinarySnapshot new_snapshot;
+  TRY(new_snapshot.capture(&after));
+
+  ScanDiff diff;
+  diff.compute(old_snapshot, new_snapshot);
+  if (options().verbose()) diff.print_json(stdout);
+  TRY(!diff.is_empty());
+
+  TRY(diff.roots().size() == 1);
+  TRY(strcmp(diff.roots()[0].name, "extra") == 0);
+  TRY(diff.roots()[0].before == nullptr);
+  TRY(diff.roots()[0].after != nullptr);
+
+  TRY(diff.depth_before() == 1);
+  TRY(diff.depth_after() == 2);
+
+  TRY(diff.maps().size() == 1);
+  auto const& change = diff.maps()[0];
+  TRY(strcmp(change.name, after.load_cap_map().name()) == 0);
+  TRY(change.removed.empty());
+  SparseRange added;
+  for (auto range : change.added) added.combine(range);
+  TRY(added.includes(Range::from_cap(cap(static_cast<char(*)[64]>(buffers[1])))));
+  TRY(added.includes(Range::from_cap(cap(static_cast<char(*)[64]>(buffers[2])))));
+  TRY(!added.overlaps(Range::from_cap(cap(static_cast<char(*)[64]>(buffers[0])))));
+
+  // The reverse diff removes what this one added.
+  ScanDiff reverse;
+  reverse.compute(new_snapshot, old_snapshot);
+  TRY(reverse.maps().size() == 1);
+  TRY(reverse.maps()[0].added.empty());
+  TRY(reverse.maps()[0].removed == change.added);
+  TRY(reverse.roots()[0].after == nullptr);
+
+  free(holder);
+  for (auto buffer : buffers) free(buffer);
+}
+
+TEST(diff_binary_round_trip) {
+  void* buffers[2];
+  for (auto& buffer : buffers) buffer = calloc(1, 64);
+  Slots* holder = static_cast<Slots*>(calloc(1, sizeof(Slots)));
+
+  // A root that moves, one that disappears, one that appears, and a map that
+  // both grows and shrinks.
+  Mapper before;
+  before.scan(cap(holder), "holder");
+  before.scan(cap(static_cast<char(*)[64]>(buffers[0])), "moved");
+  before.scan(cap(static_cast<char(*)[64]>(buffers[0])), "gone");
+  BinarySnapshot old_snapshot;
+  TRY(old_snapshot.capture(&before));
+  Mapper after;
+  after.scan(cap(holder), "holder");
+  after.scan(cap(static_cast<char(*)[64]>(buffers[1])), "moved");
+  after.scan(cap(static_cast<char(*)[32]>(buffers[1])), "new");
+  BinarySnapshot new_snapshot;
+  TRY(new_snapshot.capture(&after));
+
+  ScanDiff diff;
+  diff.compute(old_snapshot, new_snapshot);
+  TRY(diff.roots().size() == 3);
+  TRY(diff.maps().size() == 1);
+  TRY(!diff.maps()[0].added.empty() && !diff.maps()[0].removed.empty());
+
+  std::string data = capture([&](FILE* stream) { diff.write_binary(stream); });
+  // malloc() provides the 16-byte alignment that diffs need.
+  char* copy = static_cast<char*>(malloc(data.size()));
+  memcpy(copy, data.data(), data.size());
+  ScanDiff read;
+  TRY(read.read_binary(copy, data.size()));
+  std::string expected = capture([&](FILE* stream) { diff.print_json(stream); });
+  std::string actual = capture([&](FILE* stream) { read.print_json(stream); });
+  if (options().verbose()) printf("%s", actual.c_str());
+  TRY(actual == expected);
+  TRY(read.maps()[0].removed == diff.maps()[0].removed);
+
+  // Truncated diffs, and snapshots, are rejected.
+  TRY(!read.read_binary(copy, data.size() - 1));
+  TRY(read.is_empty());
+  std::string snapshot = capture([&](FILE* stream) { after.write_binary(stream); });
+  char* snapshot_copy = static_cast<char*>(malloc(snapshot.size()));
+  memcpy(snapshot_copy, snapshot.data(), snapshot.size());
+  TRY(!read.read_binary(snapshot_copy, snapshot.size()));
+
+  // An empty diff reads back as empty.
+  ScanDiff empty;
+  std::string header = capture([&](FILE* stream) { empty.write_binary(stream); });
+  memcpy(copy, header.data(), header.size());
+  TRY(read.read_binary(copy, header.size()));
+  TRY(read.is_empty());
+
+  free(snapshot_copy);
+  free(copy);
+  free(holder);
+  for (auto buffer : buffers) free(buffer);
+}
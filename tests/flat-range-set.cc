@@ -0,0 +1,122 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdlib.h>
+
+#include <set>
+#include <utility>
+
+#include "include/capmap-range.h"
+#include "tests.h"
+
+using capmap::FlatRangeSet;
+using capmap::Range;
+using capmap::SparseRange;
+
+static bool same(FlatRangeSet const& flat, std::set<Range> const& set) {
+  if (flat.size() != set.size()) return false;
+  auto it = set.begin();
+  for (auto range : flat) {
+    if (range != *it++) return false;
+  }
+  return true;
+}
+
+TEST(flat_range_set_empty) {
+  FlatRangeSet flat;
+  TRY(flat.empty());
+  TRY(flat.size() == 0);
+  TRY(flat.begin() == flat.end());
+  TRY(flat.lower_bound(Range::full_64bit()) == flat.end());
+  TRY(flat.count(Range::full_64bit()) == 0);
+}
+
+TEST(flat_range_set_grow_copy_move) {
+  // Grow well past the inline capacity, then check that copies and moves are
+  // independent of the original.
+  FlatRangeSet flat;
+  for (ptraddr_t i = 0; i < 42; i++) {
+    TRY(flat.insert(Range::from_base_last(i * 10, i * 10 + 4)).second);
+  }
+  TRY(flat.size() == 42);
+  TRY(!flat.insert(Range::from_base_last(100, 104)).second);
+
+  FlatRangeSet copy = flat;
+  TRY(copy == flat);
+  copy.erase(copy.begin());
+  TRY(copy != flat);
+  TRY(copy.size() == 41);
+
+  FlatRangeSet moved = std::move(copy);
+  TRY(moved.size() == 41);
+  TRY(copy.empty());
+
+  FlatRangeSet small;
+  small.insert(Range::from_base_last(1, 2));
+  FlatRangeSet small_moved = std::move(small);
+  TRY(small_moved.size() == 1);
+  TRY(*small_moved.begin() == Range::from_base_last(1, 2));
+  TRY(small.empty());
+}
+
+TEST(flat_range_set_fuzz) {
+  // Compare against std::set<Range>, which has the same ordering.
+  FlatRangeSet flat;
+  std::set<Range> set;
+  for (int i = 0; i < 4096; i++) {
+    ptraddr_t last = (ptraddr_t)mrand48() % 256;
+    Range r = Range::from_base_last(last / 2, last);
+    switch (mrand48() % 4) {
+      case 0:
+      case 1:
+        TRY(flat.insert(r).second == set.insert(r).second);
+        break;
+      case 2: {
+        auto hint = flat.lower_bound(r);
+        flat.insert(hint, r);
+        set.insert(r);
+        break;
+      }
+      case 3: {
+        auto it = flat.lower_bound(r);
+        auto end = it;
+        for (int n = mrand48() % 3; (n > 0) && (end != flat.end()); n--) end++;
+        auto set_it = set.lower_bound(r);
+        auto set_end = set_it;
+        for (auto e = it; e != end; e++) set_end++;
+        flat.erase(it, end);
+        set.erase(set_it, set_end);
+        break;
+      }
+    }
+    TRY(same(flat, set));
+    TRY(flat.count(r) == set.count(r));
+  }
+}
+
+TEST(flat_range_set_unite_fuzz) {
+  // `unite()` should match combining each part individually.
+  for (int i = 0; i < 256; i++) {
+    SparseRange a;
+    SparseRange b;
+    for (int n = mrand48() % 16; n > 0; n--) {
+      size_t base = (size_t)mrand48() % 256;
+      a.combine(Range::from_base_length(base, 1 + (size_t)mrand48() % 16));
+    }
+    for (int n = mrand48() % 16; n > 0; n--) {
+      size_t base = (size_t)mrand48() % 256;
+      b.combine(Range::from_base_length(base, 1 + (size_t)mrand48() % 16));
+    }
+    FlatRangeSet flat;
+    for (auto range : a.parts()) flat.insert(range);
+    FlatRangeSet other;
+    for (auto range : b.parts()) other.insert(range);
+    flat.unite(other.begin(), other.end());
+
+    SparseRange expected = a;
+    for (auto range : b.parts()) expected.combine(range);
+    TRY(flat.size() == expected.parts().size());
+    auto it = flat.begin();
+    for (auto range : expected.parts()) TRY(*it++ == range);
+  }
+}
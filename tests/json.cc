@@ -0,0 +1,132 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "include/capmap-json.h"
+#include "tests.h"
+
+using capmap::JsonRangeStream;
+using capmap::JsonWriter;
+using capmap::Range;
+using capmap::SparseRange;
+using capmap::tests::contents;
+
+TEST(json_writer_format) {
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  {
+    JsonWriter out(file);
+    out.hex(0);
+    out.raw(' ');
+    out.hex(0xdeadbeef0123);
+    out.raw(' ');
+    out.dec(0);
+    out.raw(' ');
+    out.dec(UINT64_MAX);
+    out.raw(' ');
+    out.string("a\"b\\c\n");
+    out.raw(' ');
+    out.range(Range::from_base_last(0x10, 0x1f));
+    TRY(out.flush());
+  }
+  std::string text = contents(file);
+  if (options().verbose()) printf("%s\n", text.c_str());
+  TRY(text ==
+      "0 deadbeef0123 0 18446744073709551615 \"a\\\"b\\\\c\\u000a\" "
+      "{ \"base\": 0x10, \"last\": 0x1f }");
+  fclose(file);
+}
+
+TEST(json_writer_large) {
+  // Output larger than the buffer must be flushed intact, and in order.
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  fprintf(file, "start:");
+  size_t const count = JsonWriter::kBufferSize;
+  {
+    JsonWriter out(file);
+    for (size_t i = 0; i < count; i++) out.hex(i % 16);
+  }
+  std::string text = contents(file);
+  TRY(text.size() == count + strlen("start:"));
+  TRY(text.compare(0, 6, "start:") == 0);
+  for (size_t i = 0; i < count; i++) TRY(text[i + 6] == "0123456789abcdef"[i % 16]);
+  fclose(file);
+}
+
+TEST(json_writer_sink) {
+  // A sink receives the output as it is produced, a buffer at a time.
+  struct Pieces {
+    std::string text;
+    size_t count = 0;
+  } pieces;
+  auto sink = [](void* context, char const* data, size_t size) {
+    auto pieces = static_cast<Pieces*>(context);
+    if (size > JsonWriter::kBufferSize) return false;
+    pieces->text.append(data, size);
+    pieces->count++;
+    return true;
+  };
+  size_t const count = 3 * JsonWriter::kBufferSize;
+  {
+    JsonWriter out(sink, &pieces);
+    for (size_t i = 0; i < count; i++) out.hex(i % 16);
+    // Full buffers are passed on without waiting for a flush.
+    TRY(pieces.count >= 2);
+    TRY(out.flush());
+  }
+  TRY(pieces.count == 3);
+  TRY(pieces.text.size() == count);
+  for (size_t i = 0; i < count; i++) TRY(pieces.text[i] == "0123456789abcdef"[i % 16]);
+
+  // A failing sink stops the output.
+  auto failing = [](void*, char const*, size_t) { return false; };
+  JsonWriter out(failing, nullptr);
+  out.raw("x");
+  TRY(!out.flush());
+  TRY(!out.ok());
+}
+
+TEST(json_range_stream) {
+  // Ranges are coalesced as they are added, and printed like `print_json()`.
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  SparseRange expected;
+  {
+    JsonWriter out(file);
+    JsonRangeStream stream(&out, "  ");
+    for (ptraddr_t base = 0; base < 100; base += 10) {
+      Range range = Range::from_base_length(base, ((base % 20) == 0) ? 10 : 5);
+      stream.add(range);
+      expected.combine(range);
+    }
+    stream.finish();
+  }
+  std::string streamed = contents(file);
+  fclose(file);
+
+  file = tmpfile();
+  TRY(file != nullptr);
+  expected.print_json(file, "  ");
+  std::string printed = contents(file);
+  fclose(file);
+
+  if (options().verbose()) printf("%s\n%s\n", streamed.c_str(), printed.c_str());
+  TRY(streamed == printed);
+  TRY(expected.parts().size() == 5);
+}
+
+TEST(json_print_small) {
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  SparseRange empty;
+  empty.print_json(file);
+  SparseRange one(Range::from_base_last(0x1000, 0x1fff));
+  one.print_json(file);
+  TRY(contents(file) == "[][ { \"base\": 0x1000, \"last\": 0x1fff } ]");
+  fclose(file);
+}
@@ -0,0 +1,92 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "include/capmap-range.h"
+#include "tests.h"
+
+using capmap::Range;
+using capmap::RangeIndex;
+
+TEST(range_index_empty) {
+  RangeIndex index;
+  TRY(index.is_empty());
+  TRY(index.size() == 0);
+  TRY(index.begin() == index.end());
+  TRY(index.count_containing(0) == 0);
+  TRY(!index.overlaps(Range::full_64bit()));
+  index.insert(Range());
+  TRY(index.is_empty());
+}
+
+TEST(range_index_overlapping) {
+  RangeIndex index;
+  index.insert(Range::from_base_last(0x1000, 0x1fff));
+  index.insert(Range::from_base_last(0x1800, 0x27ff));
+  index.insert(Range::from_base_last(0x1000, 0x1fff));  // Duplicate.
+  index.insert(Range::from_base_last(0x1000, 0x10ff));  // Nested.
+  index.insert(Range::from_base_last(0x4000, 0x4fff));  // Disjoint.
+  TRY(index.size() == 4);
+  TRY(index.insert_count() == 5);
+
+  // Ordered by base, then by last.
+  std::vector<Range> expected = {
+      Range::from_base_last(0x1000, 0x10ff), Range::from_base_last(0x1000, 0x1fff),
+      Range::from_base_last(0x1800, 0x27ff), Range::from_base_last(0x4000, 0x4fff)};
+  TRY(std::equal(index.begin(), index.end(), expected.begin(), expected.end()));
+
+  TRY(index.count_containing(0x0fff) == 0);
+  TRY(index.count_containing(0x1000) == 2);
+  TRY(index.count_containing(0x1100) == 1);
+  TRY(index.count_containing(0x1800) == 2);
+  TRY(index.count_containing(0x2000) == 1);
+  TRY(index.count_containing(0x3000) == 0);
+  TRY(index.count_containing(0x4fff) == 1);
+
+  // A long range early in the index must still be found after later ones.
+  index.insert(Range::from_base_last(0x0000, 0xffff));
+  TRY(index.count_containing(0x3000) == 1);
+  TRY(index.count_containing(0x4000) == 2);
+
+  TRY(index.overlaps(Range::from_base_last(0x5000, 0x5fff)));
+  TRY(!index.overlaps(Range::from_base_last(0x10000, 0x10fff)));
+}
+
+TEST(range_index_random) {
+  // Compare stabbing and overlap queries against a brute-force search, over
+  // enough insertions to exercise several batched merges.
+  srand(42);
+  RangeIndex index;
+  std::set<std::pair<ptraddr_t, ptraddr_t>> all;
+  for (int i = 0; i < 2000; i++) {
+    ptraddr_t base = rand() % 4096;
+    ptraddr_t last = base + rand() % 256;
+    // A few wide ranges, like the PCC bounds of a whole object, cover many of
+    // the others.
+    if (i % 500 == 0) last = base + 3000;
+    index.insert(Range::from_base_last(base, last));
+    all.insert(std::make_pair(base, last));
+  }
+  TRY(index.size() == all.size());
+  for (ptraddr_t addr = 0; addr < 4096 + 256; addr += 7) {
+    size_t expected = 0;
+    for (auto const& range : all) expected += (range.first <= addr) && (addr <= range.second);
+    size_t found = 0;
+    index.for_each_containing(addr, [&](Range range) { found += range.includes(addr); });
+    TRY(found == expected);
+    TRY(index.count_containing(addr) == expected);
+
+    Range query = Range::from_base_length(addr, 3);
+    bool overlaps = false;
+    for (auto const& range : all) {
+      overlaps |= (range.first <= query.last()) && (query.base() <= range.second);
+    }
+    TRY(index.overlaps(query) == overlaps);
+  }
+}
@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "include/capmap-remote.h"
+#include "include/capmap.h"
+#include "tests.h"
+
+using capmap::Mapper;
+using capmap::Range;
+using capmap::RemoteTarget;
+
+namespace {
+
+// The child inherits `holder` (and the buffer it points to), then waits to be
+// scanned from outside.
+__attribute__((used)) void* __capability holder;
+char buffer[4096];
+
+// Kill the child however the test ends.
+struct ChildGuard {
+  pid_t pid;
+  ~ChildGuard() {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+  }
+};
+
+}  // namespace
+
+TEST(remote_scan_child) {
+  if (!RemoteTarget::supported()) {
+    printf("Remote scanning is not supported in this build.\n");
+    return;
+  }
+
+  holder = cheri_bounds_set(cheri_address_set(cheri_ddc_get(), reinterpret_cast<ptraddr_t>(buffer)),
+                            sizeof(buffer));
+  // Two pages, the second of which the child unmaps, so that it can't be read.
+  size_t const page = getpagesize();
+  auto pages = static_cast<char*>(
+      mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0));
+  TRY(pages != MAP_FAILED);
+  int ready[2];
+  TRY(pipe(ready) == 0);
+  pid_t pid = fork();
+  TRY(pid >= 0);
+  if (pid == 0) {
+    munmap(pages + page, page);
+    close(ready[0]);
+    char c = 'r';
+    if (write(ready[1], &c, 1) != 1) _exit(1);
+    while (true) pause();
+  }
+  ChildGuard guard{pid};
+  close(ready[1]);
+  char c;
+  TRY(read(ready[0], &c, 1) == 1);
+  close(ready[0]);
+
+  RemoteTarget target(pid);
+  if (!target.attach()) {
+    printf("Could not attach to the child (is debugging permitted?).\n");
+    return;
+  }
+  TRY(!target.vmmap().entries().empty());
+  // In hybrid code, the child's DDC is a root, so everything is reachable.
+  Mapper mapper(target.ranges());
+  mapper.maps()->push_back(std::make_unique<capmap::LoadMap>());
+  TRY(capmap::scan_remote(&mapper, &target));
+  if (options().verbose()) mapper.print_json(stdout);
+  TRY(mapper.stats().granules > 0);
+  TRY(mapper.maps()->at(0)->ranges().size() > 0);
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&buffer)));
+  TRY(mapper.stats().unreadable == 0);
+
+  // Memory that can't be read is counted, and the rest of the scan goes on.
+  capmap::SparseRange include = target.ranges();
+  auto base = reinterpret_cast<ptraddr_t>(pages);
+  include.combine(Range::from_base_limit(base, base + 2 * page));
+  Mapper unreadable(include);
+  TRY(capmap::scan_remote(&unreadable, &target));
+  TRY(unreadable.stats().unreadable == page / sizeof(void* __capability));
+  TRY(unreadable.load_cap_map().sparse_range().includes(Range::from_object(&buffer)));
+  munmap(pages, 2 * page);
+}
@@ -3,9 +3,19 @@
 // SPDX-License-Identifier: Apache-2.0 OR MIT
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
 
 #include "include/capmap.h"
+#include "include/capmap-sample.h"
+#include "include/capmap-static.h"
 #include "tests.h"
 
 using capmap::Mapper;
@@ -256,6 +266,640 @@ TEST(scan_loop) {
   TRY(mapper.max_seen_scan_depth() == 2);
 }
 
+TEST(scan_long_list) {
+  // A list this long would exhaust the stack if each hop recursed.
+  typedef struct node {
+    struct node* __capability next;
+  } node_t;
+  size_t const length = 100000;
+  node_t* head = nullptr;
+  node_t* tail = nullptr;
+  for (size_t i = 0; i < length; i++) {
+    node_t* add = (node_t*)malloc(sizeof(node_t));
+    add->next = nullptr;
+    if (tail) tail->next = cap<node_t>(add);
+    if (!head) head = add;
+    tail = add;
+  }
+
+  Mapper mapper;
+  mapper.scan(cap(head), "head");
+
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(head)));
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(tail)));
+  TRY(mapper.max_seen_scan_depth() == (length - 1));
+
+  while (head) {
+#ifdef __CHERI_PURE_CAPABILITY__
+    node_t* next = head->next;
+#else
+    node_t* next = (node_t*)cheri_address_get(head->next);
+#endif
+    free(head);
+    head = next;
+  }
+}
+
+// Scan a graph where `b` can be reached through `&a` directly, or through
+// `&nested` then `&a`, and return the maximum depth seen.
+static uint64_t scan_diamond(capmap::ScanOrder order) {
+  void* __capability b[42] = {nullptr};
+  void* __capability a[42] = {cap(&b)};
+  void* __capability nested[42] = {cap(&a)};
+  void* __capability buffer[4] = {
+      cap(&a),
+      nullptr,
+      nullptr,
+      cap(&nested),
+  };
+
+  SparseRange sr;
+  sr.combine(Range::from_object(&buffer));
+  sr.combine(Range::from_object(&nested));
+  sr.combine(Range::from_object(&a));
+  Mapper mapper{sr};
+  mapper.set_scan_order(order);
+  mapper.scan(cap(&buffer), "&buffer");
+  if (!mapper.load_cap_map().sparse_range().includes(Range::from_object(&b))) return 0;
+  return mapper.max_seen_scan_depth();
+}
+
+TEST(scan_depth_first) {
+  Mapper mapper{SparseRange()};
+  TRY(mapper.scan_order() == capmap::ScanOrder::kDepthFirst);
+  // Depth 1: scan &buffer, find &a and &nested. The last one found is visited
+  //          first.
+  // Depth 2: scan &nested, find &a.
+  // Depth 3: scan &a, find &b.
+  TRY(scan_diamond(capmap::ScanOrder::kDepthFirst) == 3);
+}
+
+TEST(scan_breadth_first) {
+  // Depth 1: scan &buffer, find &a and &nested.
+  // Depth 2: scan &a, find &b, then scan &nested, find &a (already mapped).
+  TRY(scan_diamond(capmap::ScanOrder::kBreadthFirst) == 2);
+}
+
+struct TreeNode {
+  TreeNode* __capability children[2];
+};
+
+static TreeNode* make_tree(int depth) {
+  TreeNode* node = (TreeNode*)malloc(sizeof(TreeNode));
+  for (auto& child : node->children) {
+    child = (depth > 0) ? cap<TreeNode>(make_tree(depth - 1)) : nullptr;
+  }
+  return node;
+}
+
+static void free_tree(TreeNode* node) {
+  for (auto child : node->children) {
+#ifdef __CHERI_PURE_CAPABILITY__
+    if (child) free_tree(child);
+#else
+    if (child) free_tree((TreeNode*)cheri_address_get(child));
+#endif
+  }
+  free(node);
+}
+
+TEST(scan_parallel) {
+  // Multi-threaded scans should find the same ranges as single-threaded ones.
+  TreeNode* root = make_tree(12);
+
+  Mapper serial;
+  serial.maps()->push_back(std::make_unique<capmap::LoadMap>());
+  serial.scan(cap(root), "root");
+
+  Mapper parallel;
+  parallel.set_threads(4);
+  TRY(parallel.threads() == 4);
+  parallel.maps()->push_back(std::make_unique<capmap::LoadMap>());
+  parallel.scan(cap(root), "root");
+
+  if (options().verbose()) {
+    parallel.print_json(stdout);
+  }
+  TRY(serial.load_cap_map().sparse_range() == parallel.load_cap_map().sparse_range());
+  auto serial_load = dynamic_cast<capmap::LoadMap const*>(serial.maps()->at(0).get());
+  auto parallel_load = dynamic_cast<capmap::LoadMap const*>(parallel.maps()->at(0).get());
+  TRY(serial_load->sparse_range() == parallel_load->sparse_range());
+  TRY(serial.max_seen_scan_depth() == 12);
+  TRY(parallel.max_seen_scan_depth() == 12);
+
+  free_tree(root);
+}
+
+TEST(scan_skip_capability_free_pages) {
+  // Skipping pages without capability stores must not hide the ones with them.
+  struct alignas(65536) Pages {
+    char data[4 * 65536];
+    void* __capability target;
+  };
+  static Pages pages;
+  static int target = 42;
+  memset(pages.data, 0x5a, sizeof(pages.data));
+  pages.target = cap(&target);
+
+  Mapper mapper;
+  mapper.set_skip_capability_free_pages(true);
+  mapper.scan(cap(&pages), "pages");
+
+  if (options().verbose()) {
+    printf("Can skip: %s\n", Mapper::can_skip_capability_free_pages() ? "yes" : "no");
+    mapper.print_json(stdout);
+  }
+  TRY(mapper.max_seen_scan_depth() == 1);
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&target)));
+}
+
+TEST(scan_incremental) {
+  // `rescan()` should only re-walk changed pages, but still find new regions.
+  static int a = 1;
+  static int b = 2;
+  static void* __capability slots[4] = {};
+  slots[0] = cap(&a);
+
+  Mapper mapper;
+  mapper.set_incremental(true);
+  mapper.scan(cap(&slots), "slots");
+  TRY(!mapper.pages().empty());
+  TRY(!mapper.load_cap_map().sparse_range().includes(Range::from_object(&b)));
+
+  mapper.rescan();
+  TRY(mapper.generation() == 1);
+  TRY(mapper.changed_pages() == 0);
+
+  slots[3] = cap(&b);
+  mapper.rescan();
+  if (options().verbose()) {
+    mapper.print_json(stdout);
+  }
+  TRY(mapper.generation() == 2);
+  TRY(mapper.changed_pages() >= 1);
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&a)));
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&b)));
+  TRY(mapper.max_seen_scan_depth() == 1);
+}
+
+TEST(scan_incremental_unmapped) {
+  // Pages unmapped since the last scan are dropped by `rescan()`, not read.
+  size_t page = getpagesize();
+  size_t slots = page / sizeof(void* __capability);
+  void* mem = mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  TRY(mem != MAP_FAILED);
+  static int a = 1;
+  auto region = static_cast<void* __capability*>(mem);
+  region[0] = cap(&a);
+  region[slots] = cap(&a);
+#ifdef __CHERI_PURE_CAPABILITY__
+  void* __capability root = mem;
+#else
+  void* __capability root = cheri_address_set(cheri_ddc_get(), addr(mem));
+  root = cheri_bounds_set(root, 2 * page);
+#endif
+
+  Mapper mapper;
+  mapper.set_incremental(true);
+  mapper.scan(root, "region");
+  size_t recorded = mapper.pages().size();
+  TRY(recorded >= 2);
+
+  TRY(munmap(region + slots, page) == 0);
+  mapper.rescan();
+  TRY(mapper.stale_pages() == 1);
+  TRY(mapper.pages().size() == recorded - 1);
+  TRY(mapper.changed_pages() == 0);
+  TRY(!mapper.include()->overlaps(Range::from_base_length(addr(mem) + page, page)));
+  TRY(munmap(mem, page) == 0);
+}
+
+TEST(scan_incremental_skipped_pages) {
+  // A page skipped for having no capabilities must still be revisited by
+  // `rescan()` once it gains one.
+  struct alignas(65536) Pages {
+    void* __capability first;
+    char data[65536 - sizeof(void* __capability)];
+    void* __capability second;
+    char rest[65536 - sizeof(void* __capability)];
+  };
+  static Pages pages;
+  static int a = 1;
+  static int b = 2;
+  memset(&pages, 0, sizeof(pages));
+  pages.first = cap(&a);
+
+  Mapper mapper;
+  mapper.set_incremental(true);
+  mapper.set_skip_capability_free_pages(true);
+  mapper.scan(cap(&pages), "pages");
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&a)));
+  TRY(!mapper.load_cap_map().sparse_range().includes(Range::from_object(&b)));
+
+  pages.second = cap(&b);
+  mapper.rescan();
+  if (options().verbose()) mapper.print_json(stdout);
+  TRY(mapper.changed_pages() >= 1);
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&b)));
+}
+
+// A map that relies on the default `try_combine_batch()`.
+class CountingMap : public capmap::Map {
+ public:
+  virtual char const* name() const override { return "counting"; }
+  virtual char const* address_space() const override { return "virtual memory"; }
+  virtual capmap::RangeSet const& ranges() const override { return ranges_.parts(); }
+  virtual bool try_combine(void* __capability cap) override {
+    count_++;
+    ranges_.combine(Range::from_cap(cap));
+    return true;
+  }
+
+  size_t count() const { return count_; }
+
+ private:
+  SparseRange ranges_;
+  size_t count_ = 0;
+};
+
+TEST(scan_batched_maps) {
+  // Batched built-in maps, and unbatched custom maps, should see everything.
+  TreeNode* root = make_tree(8);
+
+  Mapper mapper;
+  mapper.maps()->push_back(std::make_unique<capmap::LoadMap>());
+  mapper.maps()->push_back(std::make_unique<CountingMap>());
+  mapper.scan(cap(root), "root");
+
+  auto load = dynamic_cast<capmap::LoadMap const*>(mapper.maps()->at(0).get());
+  auto counting = dynamic_cast<CountingMap const*>(mapper.maps()->at(1).get());
+  // One root, and two children for each of the 255 inner nodes.
+  TRY(counting->count() == 1 + 2 * 255);
+  TRY(load->sparse_range().includes(mapper.load_cap_map().sparse_range()));
+  TRY(load->ranges() == counting->ranges());
+
+  free_tree(root);
+}
+
+TEST(scan_static_mapper) {
+  // `StaticMapper` should find the same ranges as an equivalent `Mapper`.
+  TreeNode* root = make_tree(8);
+
+  Mapper dynamic;
+  dynamic.maps()->push_back(std::make_unique<capmap::LoadMap>());
+  dynamic.maps()->push_back(std::make_unique<CountingMap>());
+  dynamic.scan(cap(root), "root");
+
+  capmap::StaticMapper<capmap::LoadMap, CountingMap> fixed;
+  fixed.scan(cap(root), "root");
+  if (options().verbose()) {
+    fixed.print_json(stdout);
+  }
+  TRY(fixed.load_cap_map().sparse_range() == dynamic.load_cap_map().sparse_range());
+  TRY(fixed.map<0>().ranges() == dynamic.maps()->at(0)->ranges());
+  TRY(fixed.map<1>().count() == 1 + 2 * 255);
+  TRY(fixed.max_seen_scan_depth() == dynamic.max_seen_scan_depth());
+
+  // Unbatched maps share a single pass over each batch, but each still sees
+  // every capability.
+  capmap::StaticMapper<CountingMap, capmap::LoadMap, CountingMap> fused;
+  fused.scan(cap(root), "root");
+  TRY(fused.map<0>().count() == 1 + 2 * 255);
+  TRY(fused.map<2>().count() == 1 + 2 * 255);
+  TRY(fused.map<1>().ranges() == dynamic.maps()->at(0)->ranges());
+
+  // Without depth tracking, the same regions are found, but depth isn't reported.
+  capmap::BasicStaticMapper<capmap::kScanPolicyNone, capmap::LoadMap> untracked;
+  untracked.scan(cap(root), "root");
+  TRY(untracked.load_cap_map().sparse_range() == dynamic.load_cap_map().sparse_range());
+  TRY(untracked.max_seen_scan_depth() == 0);
+
+  // A depth limit is still enforced, by tracking depth after all.
+  Mapper shallow;
+  shallow.set_max_scan_depth(1);
+  shallow.scan(cap(root), "root");
+  capmap::BasicStaticMapper<capmap::kScanPolicyNone, capmap::LoadMap> limited;
+  limited.set_max_scan_depth(1);
+  limited.scan(cap(root), "root");
+  TRY(limited.load_cap_map().sparse_range() == shallow.load_cap_map().sparse_range());
+  TRY(limited.load_cap_map().sparse_range() != dynamic.load_cap_map().sparse_range());
+  TRY(limited.stats().rejected_depth == shallow.stats().rejected_depth);
+
+  free_tree(root);
+}
+
+TEST(scan_dedup) {
+  // Repeated capabilities should be skipped before any range work, but still
+  // be passed to the maps.
+  static int shared[4];
+  static void* __capability copies[64];
+  for (auto& copy : copies) copy = cap(&shared);
+
+  Mapper mapper;
+  mapper.maps()->push_back(std::make_unique<CountingMap>());
+  mapper.scan(cap(&copies), "copies");
+  if (options().verbose()) {
+    mapper.print_json(stdout);
+  }
+  auto counting = dynamic_cast<CountingMap const*>(mapper.maps()->at(0).get());
+  TRY(counting->count() == 1 + 64);
+  TRY(mapper.dedup_misses() == 2);
+  TRY(mapper.dedup_hits() == 63);
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&shared)));
+}
+
+TEST(scan_stats) {
+  // One root, 14 children, and 15 nodes of two granules each (with the leaves'
+  // children all null).
+  TreeNode* root = make_tree(3);
+  Mapper mapper;
+  mapper.scan(cap(root), "root");
+  capmap::ScanStats stats = mapper.stats();
+  TRY(stats.granules == 30);
+  TRY(stats.tagged == 14);
+  TRY(stats.untagged() == 16);
+  TRY(stats.rejected_mapped == 0);
+  TRY(stats.range_combines >= 15);
+  TRY(stats.range_parts >= 1);
+  TRY(stats.include_parts == mapper.include()->parts().size());
+  // Only `load_cap_map()`, which holds every node.
+  TRY(stats.maps.size() == 1);
+  TRY(strcmp(stats.maps[0].name, mapper.load_cap_map().name()) == 0);
+  TRY(stats.maps[0].parts == stats.range_parts);
+  TRY(stats.maps[0].bytes >= 15 * sizeof(TreeNode));
+
+  // Visiting the tree again finds nothing new.
+  mapper.scan(cap(root), "again");
+  TRY(mapper.stats().rejected_mapped == 1);
+  TRY(mapper.stats().granules == 30);
+
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  mapper.print_json(file);
+  long size = ftell(file);
+  TRY(size > 0);
+  std::string text(size, '\0');
+  rewind(file);
+  TRY(fread(&text[0], 1, size, file) == static_cast<size_t>(size));
+  fclose(file);
+  if (options().verbose()) printf("%s", text.c_str());
+  TRY(text.find("\"stats\": {") != std::string::npos);
+  TRY(text.find("\"tagged\": 14") != std::string::npos);
+  TRY(text.find("\"load\": ") != std::string::npos);
+  TRY(text.find("\"map-ranges\": {") != std::string::npos);
+  TRY(mapper.stats().output_ns > 0);
+
+  Mapper limited;
+  limited.set_max_scan_depth(1);
+  limited.scan(cap(root), "root");
+  TRY(limited.stats().rejected_depth == 2);
+
+  Mapper excluded{SparseRange()};
+  excluded.scan(cap(root), "root");
+  TRY(excluded.stats().rejected_excluded == 1);
+  TRY(excluded.stats().granules == 0);
+
+  Mapper load_only;
+  load_only.scan(map_load_only(), "load-only");
+  TRY(load_only.stats().rejected_no_load_cap == 1);
+
+  free_tree(root);
+}
+
+TEST(scan_unaligned_regions) {
+  // Scan every combination of a few granules trimmed from each end, so that
+  // regions start and end at each offset in a line (or, with
+  // `CAPMAP_LOAD_TAGS`, an LDCT block).
+  uint64_t target = 0;
+  alignas(64) void* __capability buffer[23] = {nullptr};
+  size_t const tagged[] = {0, 1, 3, 4, 7, 8, 9, 12, 15, 16, 20, 22};
+  for (size_t i : tagged) buffer[i] = cap(&target);
+
+  size_t const count = sizeof(buffer) / sizeof(buffer[0]);
+  for (size_t head = 0; head < 5; head++) {
+    for (size_t tail = 0; tail < 5; tail++) {
+      size_t expected = 0;
+      for (size_t i : tagged) expected += (i >= head) && (i < count - tail);
+      void* __capability region = cheri_address_set(cap(&buffer), addr(&buffer[head]));
+      region = cheri_bounds_set_exact(region, (count - head - tail) * sizeof(buffer[0]));
+
+      Mapper mapper{Range::from_object(&buffer)};
+      mapper.scan(region, "region");
+      TRY(mapper.stats().granules == count - head - tail);
+      TRY(mapper.stats().tagged == expected);
+    }
+  }
+}
+
+TEST(scan_memory_budget) {
+  // A list of nodes, kept apart so that each is a separate part of the map.
+  typedef struct node {
+    struct node* __capability next;
+    char padding[240];
+  } node_t;
+  size_t const length = 1000;
+  node_t* nodes[length];
+  for (size_t i = 0; i < length; i++) {
+    nodes[i] = (node_t*)calloc(2, sizeof(node_t));
+    if (i > 0) nodes[i - 1]->next = cap<node_t>(nodes[i]);
+  }
+
+  // A generous budget changes nothing, except that usage is sampled.
+  Mapper generous;
+  generous.set_memory_budget(SIZE_MAX);
+  generous.scan(cap(nodes[0]), "head");
+  TRY(!generous.truncated());
+  TRY(generous.stats().memory_peak > 0);
+  TRY(generous.stats().coarsened_bytes == 0);
+  TRY(generous.load_cap_map().sparse_range().includes(Range::from_object(nodes[length - 1])));
+
+  // A budget that can't be met coarsens the maps, then stops the scan, without
+  // throwing.
+  Mapper tight;
+  tight.set_memory_budget(1);
+  tight.scan(cap(nodes[0]), "head");
+  TRY(tight.truncated());
+  TRY(tight.done());
+  TRY(tight.stats().coarsen_gap > 0);
+  TRY(!tight.load_cap_map().sparse_range().includes(Range::from_object(nodes[length - 1])));
+
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  tight.print_json(file);
+  long size = ftell(file);
+  std::string text(size, '\0');
+  rewind(file);
+  TRY(fread(&text[0], 1, size, file) == static_cast<size_t>(size));
+  fclose(file);
+  if (options().verbose()) printf("%s", text.c_str());
+  TRY(text.find("\"truncated\": 1") != std::string::npos);
+
+  for (auto node : nodes) free(node);
+}
+
+TEST(scan_memory_budget_coarsens) {
+  // As in `scan_memory_budget`, but with a budget that coarsening can meet.
+  typedef struct node {
+    struct node* __capability next;
+    char padding[240];
+  } node_t;
+  size_t const length = 1000;
+  node_t* nodes[length];
+  for (size_t i = 0; i < length; i++) {
+    nodes[i] = (node_t*)calloc(2, sizeof(node_t));
+    if (i > 0) nodes[i - 1]->next = cap<node_t>(nodes[i]);
+  }
+
+  // Find how much an exact scan uses, and what it finds. The copy uses the
+  // standard allocator, so it doesn't count towards the second scan's usage.
+  size_t peak;
+  std::vector<Range> exact;
+  {
+    Mapper mapper;
+    auto load = new capmap::LoadMap();
+    mapper.maps()->emplace_back(load);
+    mapper.set_memory_budget(SIZE_MAX);
+    mapper.scan(cap(nodes[0]), "head");
+    peak = mapper.stats().memory_peak;
+    for (Range range : load->ranges()) exact.push_back(range);
+  }
+  TRY(exact.size() > 1);
+
+  // The user map is coarsened part-way through the scan, but the traversal
+  // itself stays exact, so everything is still found.
+  Mapper mapper;
+  auto coarse = new capmap::LoadMap();
+  mapper.maps()->emplace_back(coarse);
+  mapper.set_memory_budget(peak + peak / 8);
+  mapper.scan(cap(nodes[0]), "head");
+  TRY(!mapper.truncated());
+  TRY(mapper.stats().coarsened_bytes > 0);
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(nodes[length - 1])));
+  TRY(coarse->ranges().size() < exact.size());
+  for (Range range : exact) TRY(coarse->sparse_range().includes(range));
+
+  for (auto node : nodes) free(node);
+}
+
+TEST(scan_sampled) {
+  // Four pages full of capabilities (to a small leaf), and four without any.
+  size_t const slots = 1024;
+  typedef void* __capability Slots[slots];
+  typedef char Leaf[64];
+  Leaf* leaf = static_cast<Leaf*>(calloc(1, sizeof(Leaf)));
+  Slots* dense = static_cast<Slots*>(aligned_alloc(getpagesize(), sizeof(Slots)));
+  Slots* empty = static_cast<Slots*>(aligned_alloc(getpagesize(), sizeof(Slots)));
+  for (auto& slot : *dense) slot = cap(leaf);
+  memset(empty, 0, sizeof(Slots));
+
+  Mapper sampled;
+  sampled.set_sample_interval(16, 42);
+  sampled.scan(cap(dense), "dense");
+  sampled.scan(cap(empty), "empty");
+  capmap::ScanStats stats = sampled.stats();
+  TRY(stats.sample_interval == 16);
+  TRY(stats.sample_population >= 2 * slots);
+  TRY(stats.granules < stats.sample_population / 8);
+  TRY(sampled.load_cap_map().sparse_range().includes(Range::from_object(leaf)));
+
+  capmap::SampleEstimate estimate;
+  estimate.compute(sampled);
+  if (options().verbose()) estimate.print_json(stdout);
+  auto const& caps = estimate.total().capabilities;
+  TRY(caps.low <= slots);
+  TRY(caps.high >= slots);
+  TRY(caps.low <= caps.value && caps.value <= caps.high);
+  TRY(estimate.maps().size() == 1);
+  TRY(estimate.maps()[0].population == estimate.total().population);
+  TRY(estimate.maps()[0].bytes >= 2 * sizeof(Slots) + sizeof(Leaf));
+  TRY(estimate.maps()[0].bytes == stats.maps[0].bytes);
+
+  SparseRange hot = estimate.dense_ranges(500000);
+  TRY(hot.includes(Range::from_object(dense)));
+  TRY(!hot.overlaps(Range::from_object(empty)));
+
+  // Scanning the dense pages exactly finds every capability in them.
+  Mapper followup;
+  followup.set_sample_interval(16, 42);
+  followup.set_exact_ranges(hot);
+  followup.scan(cap(dense), "dense");
+  followup.scan(cap(empty), "empty");
+  TRY(followup.stats().tagged >= slots);
+  estimate.compute(followup);
+  TRY(estimate.total().capabilities.low >= slots);
+
+  free(empty);
+  free(dense);
+  free(leaf);
+}
+
+TEST(scan_stepped) {
+  // Stepping through a scan should find the same ranges as a blocking scan.
+  TreeNode* root = make_tree(8);
+  Mapper blocking;
+  blocking.maps()->push_back(std::make_unique<capmap::LoadMap>());
+  blocking.scan(cap(root), "root");
+
+  Mapper stepped;
+  stepped.maps()->push_back(std::make_unique<capmap::LoadMap>());
+  stepped.begin(cap(root), "root");
+  TRY(!stepped.done());
+  size_t steps = 0;
+  while (!stepped.step(capmap::StepBudget::max_granules(7))) {
+    TRY(!stepped.step_pages().is_empty());
+    steps++;
+  }
+  if (options().verbose()) printf("Steps: %zu\n", steps);
+  TRY(stepped.done());
+  // 511 nodes of two granules each.
+  TRY(steps + 1 >= 1022 / 7);
+  TRY(stepped.stats().granules == blocking.stats().granules);
+  TRY(stepped.load_cap_map().sparse_range() == blocking.load_cap_map().sparse_range());
+  TRY(stepped.maps()->at(0)->ranges() == blocking.maps()->at(0)->ranges());
+  TRY(stepped.max_seen_scan_depth() == blocking.max_seen_scan_depth());
+  free_tree(root);
+}
+
+TEST(scan_stepped_region) {
+  // A step can stop part way through a region, and resume from there.
+  static int target;
+  static void* __capability array[1024];
+  for (auto& element : array) element = cap(&target);
+
+  Mapper mapper;
+  mapper.begin(cap(&array), "array");
+  TRY(!mapper.step(capmap::StepBudget::max_granules(100)));
+  TRY(mapper.stats().granules == 100);
+  TRY(mapper.stats().tagged == 100);
+  TRY(mapper.step_pages().includes(addr(&array[0])));
+  TRY(!mapper.step_pages().includes(addr(&array[1023])));
+
+  TRY(mapper.step(capmap::StepBudget::time_ns(UINT64_MAX - 1)));
+  // `target` is smaller than a granule, so only the array is scanned.
+  TRY(mapper.stats().granules == 1024);
+  TRY(mapper.step_pages().includes(addr(&array[1023])));
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&array)));
+}
+
+TEST(scan_stepped_time_budget) {
+  // A time budget bounds a step even within a single large region.
+  static int target;
+  static void* __capability array[64 * 1024];
+  for (auto& element : array) element = cap(&target);
+
+  Mapper mapper;
+  mapper.begin(cap(&array), "array");
+  size_t steps = 0;
+  while (!mapper.step(capmap::StepBudget::time_ns(1))) {
+    steps++;
+    TRY(mapper.stats().granules < 64 * 1024);
+  }
+  if (options().verbose()) printf("Steps: %zu\n", steps);
+  TRY(steps >= 2);
+  TRY(mapper.stats().granules == 64 * 1024);
+  TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&array)));
+}
+
 TEST(scan_load_vs_load_cap) {
   // `LoadMap` should always be at least as big as `LoadCapMap`.
   void* __capability load_only = map_load_only();
@@ -276,6 +920,38 @@ TEST(scan_load_vs_load_cap) {
   TRY(load_map->sparse_range().includes(load_cap_map.sparse_range()));
 }
 
+TEST(load_cap_map_includes_cap) {
+  // A whole included range is skipped in one step.
+  alignas(16) static char buffer[256];
+  capmap::LoadCapMap map;
+  TRY(map.try_combine(cap(&buffer)));
+  ptraddr_t base = addr(&buffer);
+  ptraddr_t cont = 0;
+  TRY(map.includes_cap(base, &cont));
+  TRY(cont == base + sizeof(buffer));
+  TRY(map.includes_cap(base + 128, &cont));
+  TRY(cont == base + sizeof(buffer));
+  cont = 42;
+  TRY(!map.includes_cap(base + sizeof(buffer), &cont));
+  TRY(!map.includes_cap(base - sizeof(void* __capability), &cont));
+  TRY(cont == 42);
+
+  // A range that reaches the end of the address space has nothing after it, so
+  // even from the last granule, `cont` wraps rather than staying put.
+  void* __capability ddc = cheri_ddc_get();
+  if (!cheri_tag_get(ddc) || (Range::from_cap(ddc).last() != UINT64_MAX)) {
+    printf("Skipping: DDC doesn't reach the end of the address space.\n");
+    return;
+  }
+  capmap::LoadCapMap everything;
+  TRY(everything.try_combine(ddc));
+  ptraddr_t last = UINT64_MAX & ~static_cast<ptraddr_t>(sizeof(void* __capability) - 1);
+  TRY(everything.includes_cap(last, &cont));
+  TRY(cont == 0);
+  TRY(everything.includes_cap(base, &cont));
+  TRY(cont == 0);
+}
+
 TEST(scan_depth_zero) {
   // If we limit the depth to zero, roots are never dereferenced, so we don't
   // have to worry about the memory being mapped.
@@ -430,6 +1106,87 @@ TEST(scan_branch_map) {
 #endif
 }
 
+TEST(scan_permission_combo_map) {
+  // One PermissionComboMap should find the same ranges as separate
+  // PermissionMaps, and print each combination as its own map.
+  cheri_perms_t const combos[] = {CHERI_PERM_LOAD, CHERI_PERM_STORE,
+                                  (cheri_perms_t)(CHERI_PERM_LOAD | CHERI_PERM_STORE),
+                                  (cheri_perms_t)(CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP)};
+  char const* const names[] = {"r", "w", "rw", "rR"};
+  void* __capability caps[6] = {
+      cap_with_perms(sizeof(long), CHERI_PERM_LOAD),
+      cap_with_perms(sizeof(long), CHERI_PERM_STORE),
+      cap_with_perms(sizeof(long), CHERI_PERM_LOAD | CHERI_PERM_STORE),
+      cap_with_perms(sizeof(long), CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP),
+      cap_with_perms(sizeof(long), CHERI_PERM_STORE | CHERI_PERM_STORE_CAP),
+      cap_with_perms(sizeof(long), CHERI_PERM_LOAD | CHERI_PERM_STORE | CHERI_PERM_LOAD_CAP),
+  };
+
+  Mapper separate;
+  Mapper combined;
+  auto combo_map = std::make_unique<capmap::PermissionComboMap>("combo", "virtual memory");
+  for (size_t i = 0; i < 4; i++) {
+    separate.maps()->push_back(
+        std::make_unique<capmap::PermissionMap>(names[i], "virtual memory", combos[i]));
+    TRY(combo_map->add(names[i], combos[i]));
+  }
+  auto const* combo = combo_map.get();
+  combined.maps()->push_back(std::move(combo_map));
+  separate.scan(cap(&caps), "caps");
+  combined.scan(cap(&caps), "caps");
+
+  TRY(combo->submap_count() == 4);
+  SparseRange all;
+  for (size_t i = 0; i < 4; i++) {
+    TRY(strcmp(combo->submap(i).name(), names[i]) == 0);
+    TRY(combo->submap(i).ranges() == separate.maps()->at(i)->ranges());
+    for (auto range : separate.maps()->at(i)->ranges()) all.combine(range);
+  }
+  TRY(combo->ranges() == all.parts());
+
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  combined.print_json(file);
+  long size = ftell(file);
+  std::string text(size, '\0');
+  rewind(file);
+  TRY(fread(&text[0], 1, size, file) == static_cast<size_t>(size));
+  fclose(file);
+  if (options().verbose()) printf("%s", text.c_str());
+  TRY(text.find("\"rw\": {") != std::string::npos);
+  TRY(text.find("\"combo\"") == std::string::npos);
+
+#ifdef __CHERI_PURE_CAPABILITY__
+  for (auto c : caps) free(c);
+#else
+  for (auto c : caps) free((void*)cheri_address_get(c));
+#endif
+}
+
+TEST(scan_execute_map) {
+  // Overlapping executable capabilities (without LoadCap, so that they aren't
+  // scanned) are recorded individually, but merged in `ranges()`.
+  void* __capability pcc = cheri_perms_and(cheri_pcc_get(), CHERI_PERM_LOAD | CHERI_PERM_EXECUTE);
+  ptraddr_t base = cheri_base_get(pcc);
+  void* __capability caps[3] = {
+      pcc,
+      cheri_bounds_set(cheri_address_set(pcc, base + 0x100), 0x200),
+      cheri_bounds_set(cheri_address_set(pcc, base + 0x200), 0x200),
+  };
+
+  Mapper mapper;
+  mapper.maps()->push_back(std::make_unique<capmap::ExecuteMap>());
+  mapper.scan(cap(&caps), "caps");
+  if (options().verbose()) mapper.print_json(stdout);
+  auto execute_map = dynamic_cast<capmap::ExecuteMap const*>(mapper.maps()->at(0).get());
+
+  TRY(execute_map->index().size() == 3);
+  TRY(execute_map->index().count_containing(base) == 1);
+  TRY(execute_map->index().count_containing(base + 0x100) == 2);
+  TRY(execute_map->index().count_containing(base + 0x200) == 3);
+  TRY(execute_map->ranges() == SparseRange(Range::from_cap(pcc)).parts());
+}
+
 static int pois_acc = 0;
 bool pois_cb(void* __capability cap) {
   (void)cap;
@@ -482,3 +1239,80 @@ TEST(scan_poison_map) {
     head = next;
   }
 }
+
+TEST(scan_sealed) {
+  void* __capability sealcap;
+  size_t size = sizeof(sealcap);
+  if ((sysctlbyname("security.cheri.sealcap", &sealcap, &size, NULL, 0) != 0) ||
+      !cheri_tag_get(sealcap)) {
+    printf("Skipping: no sealing capability.\n");
+    return;
+  }
+  ptraddr_t otype = cheri_base_get(sealcap) + 42;
+  void* __capability sealer = cheri_address_set(sealcap, otype);
+  void* __capability unsealer = cheri_perms_and(sealer, CHERI_PERM_UNSEAL);
+  unsealer = cheri_bounds_set(unsealer, 1);
+
+  // A sealed object holding a capability to a secret, reachable only by
+  // unsealing the object.
+  static int secret;
+  static void* __capability object[2];
+  object[0] = cap(&secret);
+  void* __capability slots[2] = {cheri_seal(cap(&object), sealer), unsealer};
+
+  // The unsealer can be found before or after the sealed capability.
+  for (int first = 0; first < 2; first++) {
+    Mapper mapper;
+    mapper.scan(slots[first], "first");
+    TRY(mapper.stats().sealed_pending == ((first == 0) ? 1 : 0));
+    mapper.scan(slots[1 - first], "second");
+    TRY(mapper.stats().unsealed == 1);
+    TRY(mapper.stats().sealed_pending == 0);
+    TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&object)));
+    TRY(mapper.load_cap_map().sparse_range().includes(Range::from_object(&secret)));
+  }
+
+  // An unsealer for another type doesn't help.
+  Mapper mapper;
+  mapper.scan(slots[0], "sealed");
+  void* __capability other = cheri_perms_and(sealcap, CHERI_PERM_UNSEAL);
+  other = cheri_bounds_set(cheri_address_set(other, otype + 1), 1);
+  mapper.scan(other, "other");
+  TRY(mapper.stats().unsealed == 0);
+  TRY(mapper.stats().sealed_pending == 1);
+  TRY(!mapper.load_cap_map().sparse_range().includes(Range::from_object(&secret)));
+
+  // A root covering low addresses, claimed first (as DDC is by a hybrid
+  // `scan(get_roots())`), covers the bounds of both the unsealer and the
+  // sealed object, but must not hide either of them. Nothing is included, so
+  // the root itself isn't scanned.
+  void* __capability wide = cheri_ddc_get();
+  if (cheri_tag_get(wide) && Range::from_cap(wide).includes(Range::from_cap(unsealer)) &&
+      Range::from_cap(wide).includes(Range::from_object(&object))) {
+    Mapper covered{SparseRange()};
+    covered.scan(wide, "wide");
+    covered.scan(slots[0], "sealed");
+    TRY(covered.stats().sealed_pending == 1);
+    covered.scan(unsealer, "unsealer");
+    TRY(covered.stats().unsealed == 1);
+    TRY(covered.stats().sealed_pending == 0);
+  } else {
+    printf("Skipping wide root: DDC doesn't cover the object and its type.\n");
+  }
+
+  // An unsealer that can also load capabilities is still registered. Sealing
+  // capabilities rarely grant loads, so this needs one that does.
+  void* __capability loadable = cheri_perms_and(unsealer, CHERI_PERM_UNSEAL | CHERI_PERM_LOAD |
+                                                              CHERI_PERM_LOAD_CAP);
+  if (!capmap::LoadCapMap::can_load_caps(loadable) ||
+      !(cheri_perms_get(loadable) & CHERI_PERM_UNSEAL)) {
+    printf("Skipping loadable unsealer: the sealing capability can't load.\n");
+    return;
+  }
+  Mapper loading;
+  loading.scan(slots[0], "sealed");
+  loading.scan(loadable, "loadable");
+  TRY(loading.stats().unsealed == 1);
+  TRY(loading.stats().sealed_pending == 0);
+  TRY(loading.load_cap_map().sparse_range().includes(Range::from_object(&secret)));
+}
@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+#include "include/capmap-snapshot.h"
+#include "include/capmap.h"
+#include "tests.h"
+
+using capmap::ForkedScan;
+using capmap::Mapper;
+using capmap::tests::contents;
+
+TEST(snapshot_consistent) {
+  // The child scans memory as it was at the fork, regardless of what the
+  // parent does afterwards.
+  char* buffer = static_cast<char*>(malloc(4096));
+  void* __capability* holder = static_cast<void* __capability*>(malloc(sizeof(void* __capability)));
+#ifdef __CHERI_PURE_CAPABILITY__
+  *holder = buffer;
+  void* __capability root = holder;
+  ptraddr_t base = cheri_address_get(buffer);
+#else
+  auto ddc = cheri_ddc_get();
+  *holder = cheri_bounds_set(cheri_address_set(ddc, reinterpret_cast<ptraddr_t>(buffer)), 4096);
+  void* __capability root = cheri_bounds_set(
+      cheri_address_set(ddc, reinterpret_cast<ptraddr_t>(holder)), sizeof(void* __capability));
+  ptraddr_t base = reinterpret_cast<ptraddr_t>(buffer);
+#endif
+
+  Mapper mapper;
+  ForkedScan scan;
+  TRY(scan.start(&mapper, root, "holder"));
+  TRY(scan.fd() >= 0);
+  TRY(!scan.start(&mapper, root, "again"));
+  *holder = nullptr;
+
+  FILE* file = tmpfile();
+  TRY(file != nullptr);
+  TRY(scan.finish(file));
+  std::string text = contents(file);
+  fclose(file);
+  if (options().verbose()) printf("%s", text.c_str());
+
+  char expected[64];
+  snprintf(expected, sizeof(expected), "\"base\": 0x%" PRIx64, static_cast<uint64_t>(base));
+  TRY(text.find("\"holder\"") != std::string::npos);
+  TRY(text.find(expected) != std::string::npos);
+  TRY(text.find("\"stats\"") != std::string::npos);
+  // The parent's mapper was never used.
+  TRY(mapper.load_cap_map().sparse_range().is_empty());
+  free(holder);
+  free(buffer);
+}
+
+TEST(snapshot_abandoned) {
+  // Destroying an unfinished scan must not leave the child behind.
+  Mapper mapper;
+  {
+    ForkedScan scan;
+    TRY(scan.start(&mapper, capmap::get_roots()));
+    TRY(scan.pid() > 0);
+  }
+  ForkedScan scan;
+  TRY(!scan.finish(stdout));
+}
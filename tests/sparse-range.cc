@@ -33,6 +33,27 @@ TEST(sparse_range_empty) {
   TRY(sr.parts().empty());
 }
 
+TEST(sparse_range_coarsen) {
+  SparseRange sr;
+  sr.combine(Range::from_base_length(0x1000, 0x10));
+  sr.combine(Range::from_base_length(0x1020, 0x10));  // 16-byte gap.
+  sr.combine(Range::from_base_length(0x1100, 0x10));  // 208-byte gap.
+  SparseRange original = sr;
+
+  TRY(sr.coarsen(0) == 0);
+  TRY(sr.coarsen(16) == 0);
+  TRY(sr == original);
+
+  TRY(sr.coarsen(17) == 16);
+  TRY(sr.parts().size() == 2);
+  TRY(sr.includes(Range::from_base_last(0x1000, 0x102f)));
+  TRY(!sr.overlaps(Range::from_base_last(0x1030, 0x10ff)));
+
+  TRY(sr.coarsen(0x1000) == 208);
+  TRY(sr == SparseRange(Range::from_base_last(0x1000, 0x110f)));
+  TRY(sr.coarsen(0x1000) == 0);
+}
+
 TEST(sparse_range_combine_empty) {
   Range r = Range::from_base_last(42, 420);
   SparseRange sr;
@@ -632,3 +653,198 @@ TEST(sparse_range_combine_remove_fuzz) {
     TRY(check == reference);
   }
 }
+
+TEST(scan_filter_clip) {
+  // include: [100,199] [300,399]
+  // exclude: [150,159]
+  // done:    [180,319]
+  SparseRange include;
+  include.combine(Range::from_base_last(100, 199));
+  include.combine(Range::from_base_last(300, 399));
+  capmap::ScanFilter filter;
+  filter.rebuild(include, SparseRange(Range::from_base_last(150, 159)));
+  SparseRange done(Range::from_base_last(180, 319));
+
+  capmap::RangeVector pieces;
+  filter.clip(Range::from_base_last(42, 420), done, &pieces);
+  TRY(pieces.size() == 3);
+  TRY(pieces[0] == Range::from_base_last(100, 149));
+  TRY(pieces[1] == Range::from_base_last(160, 179));
+  TRY(pieces[2] == Range::from_base_last(320, 399));
+
+  pieces.clear();
+  filter.clip(Range::from_base_last(190, 310), done, &pieces);
+  TRY(pieces.empty());
+
+  pieces.clear();
+  filter.clip(Range::full_64bit(), SparseRange(), &pieces);
+  TRY(pieces.size() == 3);
+}
+
+TEST(scan_filter_clip_fuzz) {
+  auto random_sparse_range = []() {
+    SparseRange sr;
+    for (int i = 0; i < 8; i++) {
+      size_t base = (size_t)mrand48() % 64;
+      size_t last = base + (size_t)mrand48() % 8;
+      if (last > 63) last = 63;
+      sr.combine(Range::from_base_last(base, last));
+    }
+    return sr;
+  };
+  auto bitmap = [](SparseRange const& sr) {
+    uint64_t bits = 0;
+    for (size_t bit = 0; bit < 64; bit++) {
+      if (sr.includes(bit)) bits |= (uint64_t)1 << bit;
+    }
+    return bits;
+  };
+
+  for (int i = 0; i < 1024; i++) {
+    SparseRange include = random_sparse_range();
+    SparseRange exclude = random_sparse_range();
+    SparseRange done = random_sparse_range();
+    size_t base = (size_t)mrand48() % 64;
+    size_t last = base + (size_t)mrand48() % 32;
+    if (last > 63) last = 63;
+    Range range = Range::from_base_last(base, last);
+
+    capmap::ScanFilter filter;
+    filter.rebuild(include, exclude);
+    capmap::RangeVector pieces;
+    filter.clip(range, done, &pieces);
+
+    SparseRange result;
+    Range prev;
+    for (auto piece : pieces) {
+      TRY(!piece.is_empty());
+      if (!prev.is_empty()) TRY(prev.last() < piece.base());
+      result.combine(piece);
+      prev = piece;
+    }
+    uint64_t expected =
+        bitmap(SparseRange(range)) & bitmap(include) & ~bitmap(exclude) & ~bitmap(done);
+    TRY(bitmap(result) == expected);
+  }
+}
+
+TEST(sparse_range_combine_all_fuzz) {
+  // `combine_all()` should match combining each range individually, in order.
+  for (int i = 0; i < 1024; i++) {
+    SparseRange initial;
+    for (int n = mrand48() % 8; n > 0; n--) {
+      size_t base = (size_t)mrand48() % 256;
+      initial.combine(Range::from_base_length(base, 1 + (size_t)mrand48() % 16));
+    }
+    capmap::RangeVector batch;
+    for (int n = mrand48() % 16; n > 0; n--) {
+      size_t base = (size_t)mrand48() % 256;
+      batch.push_back(Range::from_base_length(base, (size_t)mrand48() % 16));
+    }
+    if (mrand48() % 8 == 0) batch.push_back(Range::from_base_last(UINT64_MAX - 3, UINT64_MAX));
+
+    SparseRange expected = initial;
+    for (auto range : batch) expected.combine(range);
+    SparseRange result = initial;
+    result.combine_all(&batch);
+    TRY(result == expected);
+  }
+}
+
+TEST(sparse_range_bulk_fuzz) {
+  // The bulk operations should match applying each part individually.
+  auto random_sparse_range = [](int count) {
+    SparseRange sr;
+    for (int i = 0; i < count; i++) {
+      size_t base = (size_t)mrand48() % 256;
+      size_t last = base + (size_t)mrand48() % 8;
+      if (last > 255) last = 255;
+      sr.combine(Range::from_base_last(base, last));
+    }
+    return sr;
+  };
+
+  for (int i = 0; i < 1024; i++) {
+    // Mostly similar sizes (which sweep), but sometimes a small `b` (which is
+    // applied per part).
+    SparseRange a = random_sparse_range(mrand48() % 64);
+    SparseRange b = random_sparse_range((mrand48() % 4 == 0) ? 1 : mrand48() % 64);
+
+    SparseRange expected = a;
+    for (auto range : b.parts()) expected.combine(range);
+    SparseRange result = a;
+    result.unite(b);
+    TRY(result == expected);
+    result = a;
+    result.unite(SparseRange(b));
+    TRY(result == expected);
+
+    expected = a;
+    for (auto range : b.parts()) expected.remove(range);
+    result = a;
+    result.subtract(b);
+    TRY(result == expected);
+
+    SparseRange gaps(Range::from_base_last(0, 255));
+    for (auto range : b.parts()) gaps.remove(range);
+    expected = a;
+    for (auto range : gaps.parts()) expected.remove(range);
+    result = a;
+    result.intersect(b);
+    TRY(result == expected);
+
+    size_t base = (size_t)mrand48() % 256;
+    Range clip = Range::from_base_length(base, (size_t)mrand48() % 64);
+    expected = a;
+    expected.intersect(SparseRange(clip));
+    result = a;
+    result.clip(clip);
+    TRY(result == expected);
+  }
+
+  // Operations with self.
+  SparseRange sr = random_sparse_range(16);
+  SparseRange copy = sr;
+  sr.unite(sr);
+  TRY(sr == copy);
+  sr.intersect(sr);
+  TRY(sr == copy);
+  sr.subtract(sr);
+  TRY(sr.is_empty());
+}
+
+TEST(sparse_range_cursor_fuzz) {
+  // Cursor queries, at increasing addresses with random strides, should match
+  // `includes()` and a linear search for the next boundary.
+  for (int i = 0; i < 256; i++) {
+    SparseRange sr;
+    for (int n = mrand48() % 32; n > 0; n--) {
+      size_t base = (size_t)mrand48() % 1024;
+      sr.combine(Range::from_base_length(base, 1 + (size_t)mrand48() % 32));
+    }
+    if (mrand48() % 8 == 0) sr.combine(Range::from_base_last(1000, UINT64_MAX));
+
+    SparseRange::Cursor cursor = sr.cursor();
+    for (ptraddr_t addr = 0; addr < 1100; addr += 1 + (size_t)mrand48() % ((i % 2) ? 4 : 128)) {
+      bool included = sr.includes(addr);
+      Range const* part = cursor.seek(addr);
+      TRY((part != nullptr) == included);
+      if (part) TRY(part->includes(addr));
+
+      ptraddr_t next = addr;
+      while (!sr.includes(next) && (next < 1100)) next++;
+      auto found = cursor.next_included(addr);
+      TRY(found.first == (next < 1100));
+      if (found.first) TRY(found.second == next);
+
+      found = cursor.next_excluded(addr);
+      if (!included) {
+        TRY(found.first && (found.second == addr));
+      } else if (part->last() == UINT64_MAX) {
+        TRY(!found.first);
+      } else {
+        TRY(found.first && (found.second == part->last() + 1) && !sr.includes(found.second));
+      }
+    }
+  }
+}
@@ -13,6 +13,15 @@ using capmap::tests::Options;
 using capmap::tests::Test;
 using capmap::tests::TestRun;
 
+std::string capmap::tests::contents(FILE *file) {
+  std::string text;
+  rewind(file);
+  char chunk[256];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) text.append(chunk, n);
+  return text;
+}
+
 std::vector<Test *> &Test::list() {
   static std::vector<Test *> singleton;
   return singleton;
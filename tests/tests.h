@@ -4,8 +4,11 @@
 #ifndef TESTS_H_
 #define TESTS_H_
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include <string>
 #include <vector>
 
 #include "include/capmap.h"
@@ -138,6 +141,41 @@ class Test {
     }                                                           \
   } while (0)
 
+// The range of addresses occupied by `obj`.
+template <typename T>
+Range range_of(T *obj, size_t size = sizeof(T)) {
+  auto addr = static_cast<ptraddr_t>(reinterpret_cast<uintptr_t>(obj));
+  return Range::from_base_length(addr, size);
+}
+
+// A data capability for `obj`, derived from DDC in hybrid builds.
+template <typename T>
+void *__capability cap(T *obj, size_t size = sizeof(T)) {
+#ifdef __CHERI_PURE_CAPABILITY__
+  (void)size;
+  return obj;
+#else
+  auto addr = reinterpret_cast<ptraddr_t>(obj);
+  return cheri_bounds_set(cheri_address_set(cheri_ddc_get(), addr), size);
+#endif
+}
+
+// Collect the output of `print(stream)`.
+template <typename F>
+std::string capture(F print) {
+  char *data = nullptr;
+  size_t size = 0;
+  FILE *stream = open_memstream(&data, &size);
+  print(stream);
+  fclose(stream);
+  std::string text(data, size);
+  free(data);
+  return text;
+}
+
+// Read back everything written to `file`.
+std::string contents(FILE *file);
+
 }  // namespace tests
 }  // namespace capmap
 
@@ -0,0 +1,73 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "include/capmap.h"
+#include "include/capmap-threads.h"
+#include "tests.h"
+
+using capmap::Mapper;
+using capmap::Range;
+using capmap::RootList;
+using capmap::ThreadCapture;
+using capmap::tests::cap;
+using capmap::tests::range_of;
+
+namespace {
+
+size_t const kObjectSize = 64;
+
+}  // namespace
+
+TEST(threads_capture) {
+  // Each thread holds the only capability to its object on its own stack (or
+  // in a register).
+  size_t const kThreads = 4;
+  std::atomic<size_t> ready{0};
+  std::atomic<bool> done{false};
+  std::vector<void*> objects;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreads; i++) {
+    void* object = calloc(1, kObjectSize);
+    objects.push_back(object);
+    threads.emplace_back([&, object]() {
+      void* __capability volatile held = cap(object, kObjectSize);
+      ready++;
+      while (!done) std::this_thread::yield();
+      (void)held;
+    });
+  }
+  while (ready < kThreads) std::this_thread::yield();
+
+  ThreadCapture capture;
+  TRY(capture.stop());
+  TRY(capture.captured() >= kThreads);
+  RootList roots;
+  capture.append_roots(&roots);
+  Mapper mapper;
+  mapper.scan(roots);
+  capture.release();
+  if (options().verbose()) {
+    printf("  %zu threads stopped in %" PRIu64 " ns, released after %" PRIu64 " ns\n",
+           capture.captured(), capture.pause_ns(), capture.stopped_ns());
+  }
+  TRY(capture.stopped_ns() >= capture.pause_ns());
+  for (void* object : objects) {
+    TRY(mapper.load_cap_map().sparse_range().includes(range_of(object, kObjectSize)));
+  }
+
+  // Once released, another capture can start.
+  TRY(capture.stop());
+  capture.release();
+
+  done = true;
+  for (auto& thread : threads) thread.join();
+  for (void* object : objects) free(object);
+}
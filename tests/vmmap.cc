@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: Copyright 2023 Arm Limited and/or its affiliates <open-source-office@arm.com>
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "include/capmap.h"
+#include "include/capmap-vmmap.h"
+#include "tests.h"
+
+using capmap::LoadCapMap;
+using capmap::VmEntry;
+using capmap::VmMap;
+
+namespace {
+void vmmap_test_function() {}
+
+template <typename T>
+ptraddr_t address(T* ptr) {
+  return static_cast<ptraddr_t>(reinterpret_cast<uintptr_t>(ptr));
+}
+}  // namespace
+
+TEST(vmmap_kinds) {
+  VmMap map;
+  TRY(map.refresh());
+  TRY(!map.entries().empty());
+  if (options().verbose()) {
+    for (auto const& entry : map.entries()) {
+      printf("  [%#zx, %#zx) prot %#x kinds %#x %s\n", entry.range.base(), entry.range.limit(),
+             entry.protection, entry.kinds, entry.path);
+    }
+  }
+
+  void* heap = malloc(42);
+  int local = 0;
+  // The heap may have grown since the refresh.
+  map.refresh_if_changed();
+
+  VmEntry const* entry = map.find(address(heap));
+  TRY(entry != nullptr);
+  TRY(entry->kinds & capmap::kVmHeap);
+  TRY(entry->can_load_caps());
+
+  entry = map.find(address(&local));
+  TRY(entry != nullptr);
+  TRY(entry->kinds & capmap::kVmStack);
+
+  entry = map.find(address(&vmmap_test_function));
+  TRY(entry != nullptr);
+  TRY(entry->kinds & capmap::kVmText);
+  TRY(entry->kinds & capmap::kVmFile);
+  free(heap);
+
+  TRY(map.find(0) == nullptr);
+}
+
+TEST(vmmap_refresh_if_changed) {
+  VmMap map;
+  TRY(map.refresh_if_changed());
+  uint64_t generation = map.generation();
+  // Nothing is mapped in between, so the cached map is kept.
+  TRY(!map.refresh_if_changed());
+  TRY(map.generation() == generation);
+  TRY(map.refresh());
+  TRY(map.generation() == generation + 1);
+
+  // A new mapping changes the process's size, so it is noticed.
+  size_t const size = 1 << 20;
+  void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  TRY(region != MAP_FAILED);
+  TRY(map.refresh_if_changed());
+  TRY(map.find(reinterpret_cast<ptraddr_t>(region)) != nullptr);
+  munmap(region, size);
+}
+
+TEST(vmmap_process) {
+  // The default Mapper include set comes from the shared map.
+  VmMap map = VmMap::process();
+  TRY(!map.entries().empty());
+  TRY(LoadCapMap::vmmap() == VmMap::process().ranges());
+  TRY(map.ranges(capmap::kVmGuard).parts().empty());
+  for (auto const& entry : map.entries()) TRY(entry.path != nullptr);
+}